@@ -0,0 +1,47 @@
+#pragma once
+
+// Stand-in for NickelHook when the pipeline is built for the host.
+// Logs are only printed when NS_BENCH_LOG is set, so they don't skew timings.
+
+#include <cstdio>
+#include <cstdlib>
+
+#define nh_log(fmt, ...) do { \
+        if (getenv("NS_BENCH_LOG")) { \
+            fprintf(stderr, "[nickel-screensaver] " fmt "\n", ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+// Enough of the hook tables for screensaver.cc to build, nothing is hooked on the host
+struct nh_info {
+    const char* name;
+    const char* desc;
+    const char* uninstall_flag;
+};
+
+struct nh_hook {
+    const char* sym;
+    const char* sym_new;
+    const char* lib;
+    void** out;
+    const char* desc;
+    bool optional;
+};
+
+struct nh_dlsym {
+    const char* name;
+    void** out;
+    const char* desc;
+    bool optional;
+};
+
+struct nh {
+    int (*init)();
+    struct nh_info* info;
+    struct nh_hook* hook;
+    struct nh_dlsym* dlsym;
+    bool (*uninstall)();
+};
+
+#define nh_symoutptr(x) ((void**)(&(x)))
+#define NickelHook(...) struct nh NickelHook = {__VA_ARGS__}
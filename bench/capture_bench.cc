@@ -0,0 +1,214 @@
+#include "framebuffer.h"
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QGuiApplication>
+#include <QTemporaryDir>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// Writes fake unrotated framebuffer files with a known page in every pixel layout, reads them back through
+// framebuffer_copy() and checks every pixel, and checks that rotated framebuffers are refused.
+// Whether a device really lays its framebuffer out that way is checked on the device, against a rendered capture.
+// Usage: capture_bench [runs]
+
+static const QSize SCREEN_SIZE(1264, 1680);
+
+// Part of the screen the view covers, like a view below a status bar
+static const QRect VIEW_REGION(0, 40, 1264, 1640);
+
+// Unused bytes at the end of every framebuffer row, and a panned first row
+constexpr int ROW_PADDING = 64;
+constexpr int PAN_ROWS = 3;
+
+struct Layout {
+    const char* name;
+    int bits_per_pixel;
+    int grayscale;
+    FramebufferChannel red;
+    FramebufferChannel green;
+    FramebufferChannel blue;
+};
+
+static const Layout LAYOUTS[] = {
+    {"gray8", 8, 1, {0, 8}, {0, 8}, {0, 8}},
+    {"gray8-inverted", 8, 2, {0, 8}, {0, 8}, {0, 8}},
+    {"rgb565", 16, 0, {11, 5}, {5, 6}, {0, 5}},
+    {"rgb888", 24, 0, {16, 8}, {8, 8}, {0, 8}},
+    {"xrgb8888", 32, 0, {16, 8}, {8, 8}, {0, 8}},
+    {"xbgr8888", 32, 0, {0, 8}, {8, 8}, {16, 8}},
+};
+
+// Text-like stripes and a gradient, different in every channel
+static QImage make_page(QSize size) {
+    QImage page(size, QImage::Format_RGB32);
+    for (int y = 0; y < size.height(); ++y) {
+        QRgb* row = reinterpret_cast<QRgb*>(page.scanLine(y));
+        for (int x = 0; x < size.width(); ++x) {
+            int ink = (y / 24) % 2 == 0 && (x / 9) % 5 != 0 ? 0 : 255;
+            row[x] = qRgb(ink ^ (x & 0xff), ink ^ (y & 0xff), (x + y) & 0xff);
+        }
+    }
+
+    return page;
+}
+
+static quint32 channel_bits(int value, const FramebufferChannel &channel) {
+    return (quint32)(value >> (8 - channel.length)) << channel.offset;
+}
+
+static int channel_value(int value, const FramebufferChannel &channel) {
+    int max = (1 << channel.length) - 1;
+    int bits = value >> (8 - channel.length);
+    return (bits * 255 + max / 2) / max;
+}
+
+// What the framebuffer shows for `color`, after the layout dropped its low bits
+static QRgb shown_color(QRgb color, const Layout &layout) {
+    if (layout.bits_per_pixel == 8) {
+        int gray = qGray(color);
+        return qRgb(gray, gray, gray);
+    }
+
+    return qRgb(channel_value(qRed(color), layout.red), channel_value(qGreen(color), layout.green), channel_value(qBlue(color), layout.blue));
+}
+
+// Framebuffer memory holding `page`
+static QByteArray make_framebuffer(const QImage &memory, const Layout &layout, FramebufferInfo &info) {
+    int bytes_per_pixel = layout.bits_per_pixel / 8;
+
+    info.width = memory.width();
+    info.height = memory.height();
+    info.x_offset = 0;
+    info.y_offset = PAN_ROWS;
+    info.bits_per_pixel = layout.bits_per_pixel;
+    info.line_length = memory.width() * bytes_per_pixel + ROW_PADDING;
+    info.grayscale = layout.grayscale;
+    info.rotate = 0;
+    info.red = layout.red;
+    info.green = layout.green;
+    info.blue = layout.blue;
+    info.size = (qint64)(memory.height() + PAN_ROWS) * info.line_length;
+
+    QByteArray data(info.size, '\x55');
+    for (int y = 0; y < memory.height(); ++y) {
+        const QRgb* row = reinterpret_cast<const QRgb*>(memory.constScanLine(y));
+        uchar* out = reinterpret_cast<uchar*>(data.data()) + (qint64)(y + PAN_ROWS) * info.line_length;
+        for (int x = 0; x < memory.width(); ++x) {
+            quint32 pixel;
+            if (layout.bits_per_pixel == 8) {
+                int gray = qGray(row[x]);
+                pixel = layout.grayscale == 2 ? 255 - gray : gray;
+            } else {
+                pixel = channel_bits(qRed(row[x]), layout.red) | channel_bits(qGreen(row[x]), layout.green) | channel_bits(qBlue(row[x]), layout.blue);
+            }
+
+            for (int i = 0; i < bytes_per_pixel; ++i) {
+                out[x * bytes_per_pixel + i] = (pixel >> (8 * i)) & 0xff;
+            }
+        }
+    }
+
+    return data;
+}
+
+static int count_mismatches(const QImage &frame, const QImage &page, QRect region, const Layout &layout) {
+    int mismatches = 0;
+    for (int y = 0; y < frame.height(); ++y) {
+        const QRgb* row = reinterpret_cast<const QRgb*>(frame.constScanLine(y));
+        for (int x = 0; x < frame.width(); ++x) {
+            // The frame is the view's size, so nothing is scaled
+            QRgb expected = shown_color(page.pixel(region.x() + x, region.y() + y), layout);
+            if (row[x] != expected) {
+                mismatches++;
+            }
+        }
+    }
+
+    return mismatches;
+}
+
+static double median(std::vector<double> samples) {
+    std::sort(samples.begin(), samples.end());
+    return samples[samples.size() / 2];
+}
+
+int main(int argc, char** argv) {
+    QGuiApplication app(argc, argv);
+    int runs = argc > 1 ? qMax(1, atoi(argv[1])) : 10;
+
+    QTemporaryDir dir;
+    if (!dir.isValid()) {
+        fprintf(stderr, "Couldn't create a temporary directory\n");
+        return 1;
+    }
+
+    QImage page = make_page(SCREEN_SIZE);
+    QImage frame(VIEW_REGION.size(), QImage::Format_RGB32);
+    bool is_ok = true;
+
+    printf("%dx%d view of a %dx%d screen, median of %d runs\n\n",
+        VIEW_REGION.width(), VIEW_REGION.height(), SCREEN_SIZE.width(), SCREEN_SIZE.height(), runs);
+    printf("%-16s %10s %12s\n", "layout", "copy ms", "mismatches");
+
+    for (const Layout &layout : LAYOUTS) {
+        FramebufferInfo info;
+        QByteArray memory = make_framebuffer(page, layout, info);
+
+        // Read it back through a memory-mapped file, like /dev/fb0
+        QFile file(dir.path() + "/fb");
+        if (!file.open(QIODevice::ReadWrite | QIODevice::Truncate) || file.write(memory) != memory.size()) {
+            fprintf(stderr, "Couldn't write the fake framebuffer\n");
+            return 1;
+        }
+        file.flush();
+        const uchar* data = file.map(0, file.size());
+        if (!data) {
+            fprintf(stderr, "Couldn't map the fake framebuffer\n");
+            return 1;
+        }
+
+        std::vector<double> samples;
+        bool is_copied = true;
+        for (int i = 0; i < runs && is_copied; ++i) {
+            frame.fill(Qt::magenta);
+            QElapsedTimer timer;
+            timer.start();
+            is_copied = framebuffer_copy(data, info, VIEW_REGION, frame);
+            samples.push_back(timer.nsecsElapsed() / 1e6);
+        }
+
+        int mismatches = is_copied ? count_mismatches(frame, page, VIEW_REGION, layout) : frame.width() * frame.height();
+        printf("%-16s %10.2f %12d\n", layout.name, median(samples), mismatches);
+        if (!is_copied || mismatches > 0) {
+            is_ok = false;
+        }
+
+        file.unmap(const_cast<uchar*>(data));
+        file.close();
+    }
+
+    // A framebuffer smaller than its screen info says must be refused instead of read past its end
+    FramebufferInfo info;
+    QByteArray memory = make_framebuffer(page, LAYOUTS[0], info);
+    info.size -= ROW_PADDING + 1;
+    if (framebuffer_copy(reinterpret_cast<const uchar*>(memory.constData()), info, VIEW_REGION, frame)) {
+        printf("\nFAIL: a truncated framebuffer was read\n");
+        is_ok = false;
+    }
+
+    // A rotated framebuffer must be refused, the page is rendered instead
+    memory = make_framebuffer(page, LAYOUTS[0], info);
+    for (int rotate = 1; rotate < 4; ++rotate) {
+        info.rotate = rotate;
+        if (framebuffer_copy(reinterpret_cast<const uchar*>(memory.constData()), info, VIEW_REGION, frame)) {
+            printf("\nFAIL: a framebuffer rotated %d quarter turns was read\n", rotate);
+            is_ok = false;
+        }
+    }
+
+    return is_ok ? 0 : 1;
+}
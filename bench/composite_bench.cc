@@ -0,0 +1,171 @@
+#include "compositor.h"
+#include "frame_pool.h"
+
+#include <QGuiApplication>
+#include <QElapsedTimer>
+#include <QPainter>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// Compares the RGB32 QPainter compositing with the fused compositor and the grayscale pipeline
+// on every screen size. Fails when the fused compositor is off by more than its tolerance.
+// Usage: composite_bench [runs]
+
+// Per channel, see composite_fused()
+constexpr int FUSED_TOLERANCE = 2;
+
+static const QSize SCREEN_SIZES[] = {
+    QSize(1072, 1448),
+    QSize(1264, 1680),
+    QSize(1404, 1872),
+};
+
+// Gradient with some noise, like a photo
+static QImage make_wallpaper(QSize size) {
+    QImage wallpaper(size, QImage::Format_RGB32);
+    for (int y = 0; y < size.height(); ++y) {
+        QRgb* row = reinterpret_cast<QRgb*>(wallpaper.scanLine(y));
+        for (int x = 0; x < size.width(); ++x) {
+            int v = qBound(0, (x + y) * 255 / (size.width() + size.height()) + qrand() % 32 - 16, 255);
+            row[x] = qRgb(v, 255 - v, v / 2);
+        }
+    }
+
+    return wallpaper;
+}
+
+// Transparent overlay with an opaque frame and a translucent circle
+static QImage make_overlay(QSize size) {
+    QImage overlay(size, QImage::Format_ARGB32);
+    overlay.fill(Qt::transparent);
+
+    QPainter painter(&overlay);
+    painter.fillRect(0, 0, size.width(), size.height() / 8, Qt::black);
+    painter.fillRect(0, size.height() * 7 / 8, size.width(), size.height() / 8, Qt::black);
+    painter.setPen(Qt::NoPen);
+    painter.setBrush(QColor(255, 255, 255, 160));
+    painter.drawEllipse(QPoint(size.width() / 2, size.height() / 2), size.width() / 3, size.width() / 3);
+    painter.end();
+
+    return overlay;
+}
+
+static int max_channel_difference(const QImage &a, const QImage &b) {
+    int difference = 0;
+    for (int y = 0; y < a.height(); ++y) {
+        const QRgb* row_a = reinterpret_cast<const QRgb*>(a.constScanLine(y));
+        const QRgb* row_b = reinterpret_cast<const QRgb*>(b.constScanLine(y));
+        for (int x = 0; x < a.width(); ++x) {
+            difference = qMax(difference, qAbs(qRed(row_a[x]) - qRed(row_b[x])));
+            difference = qMax(difference, qAbs(qGreen(row_a[x]) - qGreen(row_b[x])));
+            difference = qMax(difference, qAbs(qBlue(row_a[x]) - qBlue(row_b[x])));
+        }
+    }
+
+    return difference;
+}
+
+template <typename Func>
+static double median_ms(int runs, Func func) {
+    std::vector<double> samples;
+    for (int i = 0; i < runs; ++i) {
+        QElapsedTimer timer;
+        timer.start();
+        func();
+        samples.push_back(timer.nsecsElapsed() / 1e6);
+    }
+
+    std::sort(samples.begin(), samples.end());
+    return samples[samples.size() / 2];
+}
+
+int main(int argc, char** argv) {
+    if (qgetenv("QT_QPA_PLATFORM").isEmpty()) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    QGuiApplication app(argc, argv);
+
+    qsrand(1);
+    int runs = argc > 1 ? qMax(1, atoi(argv[1])) : 10;
+    QColor color_overlay(255, 255, 255, 30 * 255 / 100);
+
+    printf("%d runs, median per frame\n", runs);
+    printf("%-10s %-18s %10s %12s\n", "screen", "pipeline", "time (ms)", "memory (KB)");
+
+    bool passed = true;
+
+    for (const QSize &size : SCREEN_SIZES) {
+        QImage wallpaper = make_wallpaper(size);
+        QImage overlay = make_overlay(size);
+        QString screen = QString("%1x%2").arg(size.width()).arg(size.height());
+        int pixels = size.width() * size.height();
+
+        QImage frame(size, QImage::Format_RGB32);
+        double rgb_ms = median_ms(runs, [&]() {
+            frame.fill(Qt::white);
+            composite_layers(&frame, size, wallpaper, QPixmap(), color_overlay, overlay);
+        });
+        // Frame and overlay
+        printf("%-10s %-18s %10.1f %12d\n", qPrintable(screen), "rgb32", rgb_ms, (4 * pixels + overlay.byteCount()) / 1024);
+
+        // The plugin premultiplies overlays once when loading them
+        QImage premultiplied_overlay = overlay.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+        QImage fused(size, QImage::Format_RGB32);
+        double fused_ms = median_ms(runs, [&]() {
+            composite_fused(fused, wallpaper, color_overlay, premultiplied_overlay);
+        });
+        int difference = max_channel_difference(frame, fused);
+        printf("%-10s %-18s %10.1f %12d  max difference %d\n", qPrintable(screen), "rgb32 (fused)", fused_ms, (fused.byteCount() + premultiplied_overlay.byteCount()) / 1024, difference);
+        if (difference > FUSED_TOLERANCE) {
+            passed = false;
+        }
+
+        // Skipping the transparent parts and copying the opaque ones must not change a single pixel
+        QVector<OverlaySpan> rows = overlay_spans(premultiplied_overlay);
+        QImage skipped(size, QImage::Format_RGB32);
+        double skipped_ms = median_ms(runs, [&]() {
+            composite_fused(skipped, wallpaper, color_overlay, premultiplied_overlay, rows.constData());
+        });
+        int skipped_difference = max_channel_difference(fused, skipped);
+        printf("%-10s %-18s %10.1f %12d  max difference %d\n", qPrintable(screen), "rgb32 (spans)", skipped_ms, (skipped.byteCount() + premultiplied_overlay.byteCount()) / 1024, skipped_difference);
+        if (skipped_difference > 0) {
+            fprintf(stderr, "Blending with overlay spans changes the frame\n");
+            passed = false;
+        }
+
+        const char* dither_names[] = {"gray8 (off)", "gray8 (ordered)", "gray8 (diffusion)"};
+        for (int dither = DITHER_MODE::Off; dither <= DITHER_MODE::Diffusion; ++dither) {
+            QImage gray;
+            double gray_ms = median_ms(runs, [&]() {
+                frame_pool_release(gray);
+                gray = composite_grayscale(size, wallpaper, color_overlay, overlay, dither);
+            });
+            // Frame plus the luma and alpha planes of the overlay
+            printf("%-10s %-18s %10.1f %12d\n", qPrintable(screen), dither_names[dither], gray_ms, (gray.byteCount() + 2 * pixels) / 1024);
+
+            // With the planes and spans the overlay cache keeps, the frame must not change a single pixel
+            QByteArray planes = overlay_gray_planes(premultiplied_overlay);
+            QImage cached;
+            double cached_ms = median_ms(runs, [&]() {
+                frame_pool_release(cached);
+                cached = composite_grayscale(size, wallpaper, color_overlay, premultiplied_overlay, dither, planes, rows.constData());
+            });
+            printf("%-10s %-18s %10.1f %12d\n", qPrintable(screen), "  (cached planes)", cached_ms, (cached.byteCount() + 2 * pixels) / 1024);
+            if (cached != gray) {
+                fprintf(stderr, "Blending the cached gray planes changes the frame\n");
+                passed = false;
+            }
+            frame_pool_release(cached);
+        }
+    }
+
+    if (!passed) {
+        fprintf(stderr, "Fused compositor is off by more than %d\n", FUSED_TOLERANCE);
+        return 1;
+    }
+
+    return 0;
+}
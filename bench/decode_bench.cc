@@ -0,0 +1,177 @@
+#include "decoder.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QImage>
+#include <QProcess>
+#include <QStringList>
+#include <QTemporaryDir>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/resource.h>
+
+// Decodes oversized fixtures in a fresh process each, so the peak RSS of one decode can be measured,
+// and fails when the budgeted decoder goes over its budget.
+// Usage: decode_bench [budget in MB]
+
+static const QSize SCREEN_SIZE(1404, 1872);
+
+// Plugin loading and allocator slack, not part of the decode itself
+constexpr qint64 RSS_SLACK_KB = 4 * 1024;
+
+// 24 MP, like a photo straight from a camera
+static const QSize FIXTURE_SIZE(6000, 4000);
+
+static qint64 max_rss_kb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static QImage make_fixture(bool has_alpha) {
+    QImage image(FIXTURE_SIZE, has_alpha ? QImage::Format_ARGB32 : QImage::Format_RGB32);
+    for (int y = 0; y < image.height(); ++y) {
+        QRgb* row = reinterpret_cast<QRgb*>(image.scanLine(y));
+        for (int x = 0; x < image.width(); ++x) {
+            int v = (x + y) * 255 / (image.width() + image.height());
+            row[x] = qRgba(v, 255 - v, (x ^ y) & 0xff, has_alpha ? 128 + v / 2 : 255);
+        }
+    }
+
+    return image;
+}
+
+// Child process: decode one file and print "<width>x<height> <peak KB>", or "null <peak KB>"
+static int run_child(const QString &file_path, qint64 budget, bool is_reference) {
+    qint64 baseline = max_rss_kb();
+
+    QImage image;
+    if (is_reference) {
+        // What the pipeline did before, decode at full size then scale
+        image = QImage(file_path);
+        if (!image.isNull()) {
+            image = image.scaled(SCREEN_SIZE, Qt::KeepAspectRatioByExpanding, Qt::SmoothTransformation);
+        }
+    } else {
+        decoder_configure(budget);
+        image = decode_scaled(file_path, SCREEN_SIZE);
+    }
+
+    qint64 peak = max_rss_kb() - baseline;
+    if (image.isNull()) {
+        printf("null %lld\n", peak);
+    } else {
+        printf("%dx%d %lld\n", image.width(), image.height(), peak);
+    }
+
+    return 0;
+}
+
+struct ChildResult {
+    bool is_null;
+    qint64 peak_kb;
+    double ms;
+};
+
+static bool run_decode(const QString &file_path, qint64 budget_mb, bool is_reference, ChildResult &result) {
+    QStringList arguments;
+    arguments << "--child" << file_path << QString::number(budget_mb);
+    if (is_reference) {
+        arguments << "--reference";
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    QProcess process;
+    process.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+    process.start(QCoreApplication::applicationFilePath(), arguments);
+    if (!process.waitForFinished(-1) || process.exitCode() != 0) {
+        return false;
+    }
+
+    QStringList fields = QString::fromLatin1(process.readAllStandardOutput()).trimmed().split(' ');
+    if (fields.size() != 2) {
+        return false;
+    }
+
+    result.is_null = fields.at(0) == "null";
+    result.peak_kb = fields.at(1).toLongLong();
+    result.ms = timer.nsecsElapsed() / 1e6;
+    return true;
+}
+
+int main(int argc, char** argv) {
+    QCoreApplication app(argc, argv);
+
+    if (argc >= 4 && strcmp(argv[1], "--child") == 0) {
+        return run_child(QString::fromLocal8Bit(argv[2]), atoll(argv[3]) * 1024 * 1024, argc >= 5);
+    }
+
+    qint64 budget_mb = argc > 1 ? qMax(8, atoi(argv[1])) : 48;
+
+    QTemporaryDir dir;
+    if (!dir.isValid()) {
+        fprintf(stderr, "Couldn't create a temporary directory\n");
+        return 1;
+    }
+
+    struct Fixture {
+        const char* name;
+        bool has_alpha;
+    };
+    static const Fixture FIXTURES[] = {
+        {"wallpaper.png", false},
+        {"overlay.png", true},
+        {"wallpaper.jpg", false},
+    };
+
+    for (const Fixture &fixture : FIXTURES) {
+        if (!make_fixture(fixture.has_alpha).save(dir.path() + "/" + fixture.name, nullptr, 90)) {
+            fprintf(stderr, "Couldn't write %s\n", fixture.name);
+            return 1;
+        }
+    }
+
+    printf("%dx%d fixtures decoded for %dx%d, budget %lld MB\n\n",
+        FIXTURE_SIZE.width(), FIXTURE_SIZE.height(), SCREEN_SIZE.width(), SCREEN_SIZE.height(), budget_mb);
+    printf("%-16s %14s %10s %14s %10s\n", "file", "budgeted KB", "ms", "full KB", "ms");
+
+    bool is_ok = true;
+    for (const Fixture &fixture : FIXTURES) {
+        QString file_path = dir.path() + "/" + fixture.name;
+
+        ChildResult budgeted, reference;
+        if (!run_decode(file_path, budget_mb, false, budgeted) || !run_decode(file_path, budget_mb, true, reference)) {
+            fprintf(stderr, "Couldn't run the decoder on %s\n", fixture.name);
+            return 1;
+        }
+
+        printf("%-16s %14lld %10.1f %14lld %10.1f\n", fixture.name, budgeted.peak_kb, budgeted.ms, reference.peak_kb, reference.ms);
+
+        if (budgeted.is_null) {
+            printf("  FAIL: %s fits the budget but wasn't decoded\n", fixture.name);
+            is_ok = false;
+        } else if (budgeted.peak_kb > budget_mb * 1024 + RSS_SLACK_KB) {
+            printf("  FAIL: %s went over the budget\n", fixture.name);
+            is_ok = false;
+        }
+    }
+
+    // Too large for the smallest budget, it must be skipped without being decoded
+    ChildResult rejected;
+    if (!run_decode(dir.path() + "/wallpaper.png", 8, false, rejected)) {
+        fprintf(stderr, "Couldn't run the decoder\n");
+        return 1;
+    }
+
+    printf("\nwallpaper.png with an 8 MB budget: %s, %lld KB\n", rejected.is_null ? "skipped" : "decoded", rejected.peak_kb);
+    if (!rejected.is_null || rejected.peak_kb > 8 * 1024 + RSS_SLACK_KB) {
+        printf("  FAIL: over-budget files must be skipped\n");
+        is_ok = false;
+    }
+
+    return is_ok ? 0 : 1;
+}
@@ -0,0 +1,78 @@
+#include "fixtures.h"
+#include "settings.h"
+
+#include <QDir>
+#include <QPainter>
+#include <QSettings>
+
+// White page with lines of "words", stands in for the screenshot
+QImage make_page(QSize size) {
+    QImage page(size, QImage::Format_RGB32);
+    page.fill(Qt::white);
+
+    QPainter painter(&page);
+    for (int y = 120; y < size.height() - 120; y += 48) {
+        int x = 80;
+        while (x < size.width() - 80) {
+            int word = 20 + qrand() % 120;
+            painter.fillRect(x, y, qMin(word, size.width() - 80 - x), 28, Qt::black);
+            x += word + 16;
+        }
+    }
+    painter.end();
+
+    return page;
+}
+
+QImage make_wallpaper(QSize size, int variant) {
+    QImage wallpaper(size, QImage::Format_RGB32);
+    for (int y = 0; y < size.height(); ++y) {
+        QRgb* row = reinterpret_cast<QRgb*>(wallpaper.scanLine(y));
+        for (int x = 0; x < size.width(); ++x) {
+            int v = qBound(0, (x * variant + y) * 255 / (size.width() * variant + size.height()) + qrand() % 32 - 16, 255);
+            row[x] = qRgb(v, v, v);
+        }
+    }
+
+    return wallpaper;
+}
+
+QImage make_overlay(QSize size, int variant) {
+    QImage overlay(size, QImage::Format_ARGB32);
+    overlay.fill(Qt::transparent);
+
+    QPainter painter(&overlay);
+    painter.fillRect(0, 0, size.width(), size.height() / (4 + variant), Qt::black);
+    painter.setPen(Qt::NoPen);
+    painter.setBrush(QColor(255, 255, 255, 160));
+    painter.drawEllipse(QPoint(size.width() / 2, size.height() / 2), size.width() / (2 + variant), size.width() / (2 + variant));
+    painter.end();
+
+    return overlay;
+}
+
+// Wallpapers are bigger than every screen so they always need scaling, like most user files
+bool make_fixtures(const QString &root) {
+    QDir dir(root);
+    if (!dir.mkpath("wallpaper/overlay")) {
+        return false;
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        make_overlay(QSize(1404, 1872), i).save(dir.filePath(QString("book-%1.png").arg(i)));
+        make_overlay(QSize(1404, 1872), i + 1).save(dir.filePath(QString("wallpaper/overlay/overlay-%1.png").arg(i)));
+    }
+    for (int i = 0; i < 5; ++i) {
+        make_wallpaper(QSize(1600, 2400), i + 1).save(dir.filePath(QString("wallpaper/wallpaper-%1.jpg").arg(i)), "JPG", 85);
+    }
+
+    ScreensaverSettings values;
+    values.book_color_overlay_alpha = 20;
+    values.wallpaper_color_overlay_alpha = 20;
+    values.glitch_enabled = true;
+
+    QSettings settings(dir.filePath("_settings.ini"), QSettings::IniFormat);
+    settings_write(settings, values);
+
+    return settings.status() == QSettings::NoError;
+}
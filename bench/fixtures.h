@@ -0,0 +1,15 @@
+#pragma once
+
+#include <QImage>
+#include <QString>
+
+// Generated files shared by the host benchmarks, random with qrand()
+
+// White page with lines of "words", stands in for the screenshot
+QImage make_page(QSize size);
+
+QImage make_wallpaper(QSize size, int variant);
+QImage make_overlay(QSize size, int variant);
+
+// Fill `root` like .adds/screensaver: Book mode overlays, wallpapers and their overlays, and settings
+bool make_fixtures(const QString &root);
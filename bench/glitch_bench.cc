@@ -0,0 +1,77 @@
+#include "glitch.h"
+
+#include <QGuiApplication>
+#include <QElapsedTimer>
+#include <QPainter>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// Compares the glitch engines on a full page at every Glitch/Iterations value.
+// Usage: glitch_bench [page image] [runs] [jpeg quality]
+
+// White page with lines of "words"
+static QImage make_page(QSize size) {
+    QImage page(size, QImage::Format_RGB32);
+    page.fill(Qt::white);
+
+    QPainter painter(&page);
+    for (int y = 120; y < size.height() - 120; y += 48) {
+        int x = 80;
+        while (x < size.width() - 80) {
+            int word = 20 + qrand() % 120;
+            painter.fillRect(x, y, qMin(word, size.width() - 80 - x), 28, Qt::black);
+            x += word + 16;
+        }
+    }
+    painter.end();
+
+    return page;
+}
+
+template <typename Func>
+static double median_ms(int runs, Func func) {
+    std::vector<double> samples;
+    for (int i = 0; i < runs; ++i) {
+        QElapsedTimer timer;
+        timer.start();
+        func();
+        samples.push_back(timer.nsecsElapsed() / 1e6);
+    }
+
+    std::sort(samples.begin(), samples.end());
+    return samples[samples.size() / 2];
+}
+
+int main(int argc, char** argv) {
+    if (qgetenv("QT_QPA_PLATFORM").isEmpty()) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    QGuiApplication app(argc, argv);
+
+    // Fixed seed, so every run glitches the same blocks
+    qsrand(1);
+
+    QImage page = argc > 1 ? QImage(argv[1]) : make_page(QSize(1404, 1872));
+    if (page.isNull()) {
+        fprintf(stderr, "Couldn't load %s\n", argv[1]);
+        return 1;
+    }
+    page = page.convertToFormat(QImage::Format_RGB32);
+
+    int runs = argc > 2 ? qMax(1, atoi(argv[2])) : 10;
+    int quality = argc > 3 ? qBound(10, atoi(argv[3]), 100) : 10;
+
+    printf("%dx%d, %d runs, jpeg quality %d\n", page.width(), page.height(), runs, quality);
+    printf("%10s %12s %12s %9s\n", "iterations", "jpeg (ms)", "pixel (ms)", "speedup");
+
+    for (int iterations = 2; iterations <= 10; ++iterations) {
+        double jpeg_ms = median_ms(runs, [&]() { glitch_image(page, iterations, quality); });
+        double pixel_ms = median_ms(runs, [&]() { glitch_image_pixels(page, iterations); });
+        printf("%10d %12.1f %12.1f %8.1fx\n", iterations, jpeg_ms, pixel_ms, jpeg_ms / pixel_ms);
+    }
+
+    return 0;
+}
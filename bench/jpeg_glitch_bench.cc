@@ -0,0 +1,293 @@
+#include "decoder.h"
+#include "glitch.h"
+
+#include <QBuffer>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QGuiApplication>
+#include <QStringList>
+
+#include <algorithm>
+#include <csetjmp>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include <jpeglib.h>
+
+// Glitches a corpus of JPEG files many times over and fails when a glitched file no longer decodes,
+// when a byte outside of the scan data changed, or when the markers of the file moved.
+// The corpus covers baseline, progressive and restart interval files, generated with libjpeg,
+// and the files of a folder when one is given. Also compares the time with re-encoding the wallpaper.
+// Usage: jpeg_glitch_bench [runs per file] [folder of JPEG files]
+
+static const QSize SCREEN_SIZE(1404, 1872);
+
+struct CorpusFile {
+    QString name;
+    QByteArray data;
+};
+
+// Colors and noise, so every MCU has AC coefficients
+static QImage make_photo(QSize size) {
+    QImage image(size, QImage::Format_RGB32);
+    for (int y = 0; y < size.height(); ++y) {
+        QRgb* row = reinterpret_cast<QRgb*>(image.scanLine(y));
+        for (int x = 0; x < size.width(); ++x) {
+            int noise = qrand() % 48 - 24;
+            row[x] = qRgb(qBound(0, x * 255 / size.width() + noise, 255), qBound(0, y * 255 / size.height() + noise, 255), (x ^ y) & 0xff);
+        }
+    }
+
+    return image;
+}
+
+struct JpegOptions {
+    bool is_gray = false;
+    bool is_progressive = false;
+    int restart_rows = 0;     // restart interval in MCU rows
+    int restart_mcus = 0;     // restart interval in MCUs
+    int h_sampling = 2;       // luma sampling, 1 for 4:4:4
+    int quality = 85;
+};
+
+static QByteArray encode_jpeg(const QImage &image, const JpegOptions &options) {
+    jpeg_compress_struct cinfo;
+    jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+
+    unsigned char* buffer = nullptr;
+    unsigned long size = 0;
+    jpeg_mem_dest(&cinfo, &buffer, &size);
+
+    cinfo.image_width = image.width();
+    cinfo.image_height = image.height();
+    cinfo.input_components = options.is_gray ? 1 : 3;
+    cinfo.in_color_space = options.is_gray ? JCS_GRAYSCALE : JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, options.quality, TRUE);
+    if (!options.is_gray) {
+        cinfo.comp_info[0].h_samp_factor = options.h_sampling;
+        cinfo.comp_info[0].v_samp_factor = options.h_sampling;
+    }
+    if (options.is_progressive) {
+        jpeg_simple_progression(&cinfo);
+    }
+    cinfo.restart_in_rows = options.restart_rows;
+    cinfo.restart_interval = options.restart_mcus;
+
+    jpeg_start_compress(&cinfo, TRUE);
+    std::vector<JSAMPLE> row(image.width() * cinfo.input_components);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        const QRgb* pixels = reinterpret_cast<const QRgb*>(image.constScanLine(cinfo.next_scanline));
+        for (int x = 0; x < image.width(); ++x) {
+            if (options.is_gray) {
+                row[x] = qGray(pixels[x]);
+            } else {
+                row[x * 3] = qRed(pixels[x]);
+                row[x * 3 + 1] = qGreen(pixels[x]);
+                row[x * 3 + 2] = qBlue(pixels[x]);
+            }
+        }
+        JSAMPROW rows[1] = {row.data()};
+        jpeg_write_scanlines(&cinfo, rows, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    QByteArray data(reinterpret_cast<const char*>(buffer), size);
+    free(buffer);
+    return data;
+}
+
+struct StrictError {
+    jpeg_error_mgr manager;
+    jmp_buf jump;
+};
+
+static void strict_error_exit(j_common_ptr cinfo) {
+    longjmp(reinterpret_cast<StrictError*>(cinfo->err)->jump, 1);
+}
+
+// Corrupt scan data only gives warnings, errors mean the structure of the file is broken
+static void quiet_message(j_common_ptr) {
+}
+
+static bool libjpeg_decodes(const QByteArray &data) {
+    jpeg_decompress_struct cinfo;
+    StrictError error;
+    cinfo.err = jpeg_std_error(&error.manager);
+    error.manager.error_exit = strict_error_exit;
+    error.manager.output_message = quiet_message;
+    if (setjmp(error.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, reinterpret_cast<const unsigned char*>(data.constData()), data.size());
+    jpeg_read_header(&cinfo, TRUE);
+    jpeg_start_decompress(&cinfo);
+    std::vector<JSAMPLE> row(cinfo.output_width * cinfo.output_components);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW rows[1] = {row.data()};
+        jpeg_read_scanlines(&cinfo, rows, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+
+    return true;
+}
+
+static std::vector<CorpusFile> make_corpus(const QString &folder) {
+    std::vector<CorpusFile> corpus;
+
+    // Odd sizes, so the last MCU row and column are partial
+    QImage photo = make_photo(QSize(1601, 2403));
+    QImage small = make_photo(QSize(37, 23));
+
+    JpegOptions baseline;
+    corpus.push_back({"baseline 4:2:0", encode_jpeg(photo, baseline)});
+    JpegOptions full;
+    full.h_sampling = 1;
+    corpus.push_back({"baseline 4:4:4", encode_jpeg(photo, full)});
+    JpegOptions gray;
+    gray.is_gray = true;
+    corpus.push_back({"grayscale", encode_jpeg(photo, gray)});
+    JpegOptions progressive;
+    progressive.is_progressive = true;
+    corpus.push_back({"progressive", encode_jpeg(photo, progressive)});
+    JpegOptions restart_rows;
+    restart_rows.restart_rows = 1;
+    corpus.push_back({"restart every row", encode_jpeg(photo, restart_rows)});
+    JpegOptions restart_mcu;
+    restart_mcu.restart_mcus = 1;
+    corpus.push_back({"restart every MCU", encode_jpeg(photo, restart_mcu)});
+    JpegOptions progressive_restart;
+    progressive_restart.is_progressive = true;
+    progressive_restart.restart_mcus = 3;
+    corpus.push_back({"progressive restart", encode_jpeg(photo, progressive_restart)});
+    JpegOptions low_quality;
+    low_quality.quality = 10;
+    corpus.push_back({"quality 10", encode_jpeg(photo, low_quality)});
+    corpus.push_back({"tiny progressive restart", encode_jpeg(small, progressive_restart)});
+
+    QBuffer buffer;
+    buffer.open(QIODevice::WriteOnly);
+    photo.save(&buffer, "JPG", 85);
+    corpus.push_back({"Qt", buffer.data()});
+
+    if (!folder.isEmpty()) {
+        QDir dir(folder);
+        for (const QString &name : dir.entryList(QStringList() << "*.jpg" << "*.jpeg", QDir::Files)) {
+            QFile file(dir.filePath(name));
+            if (file.open(QIODevice::ReadOnly)) {
+                corpus.push_back({name, file.readAll()});
+            }
+        }
+    }
+
+    return corpus;
+}
+
+// Bytes outside of `segments` that differ between `a` and `b`
+static int bytes_outside(const QByteArray &a, const QByteArray &b, const std::vector<JpegSegment> &segments) {
+    int changed = 0;
+    qint64 pos = 0;
+    for (size_t i = 0; i <= segments.size(); ++i) {
+        qint64 end = i < segments.size() ? segments[i].start : a.size();
+        for (; pos < end; ++pos) {
+            changed += a[(int)pos] != b[(int)pos];
+        }
+        if (i < segments.size()) {
+            pos = segments[i].end;
+        }
+    }
+
+    return changed;
+}
+
+static bool same_segments(const std::vector<JpegSegment> &a, const std::vector<JpegSegment> &b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (a[i].start != b[i].start || a[i].end != b[i].end) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char** argv) {
+    if (qgetenv("QT_QPA_PLATFORM").isEmpty()) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    QGuiApplication app(argc, argv);
+
+    // Fixed seed, so a failure can be reproduced
+    qsrand(1);
+
+    int runs = argc > 1 ? qMax(1, atoi(argv[1])) : 200;
+    std::vector<CorpusFile> corpus = make_corpus(argc > 2 ? QString(argv[2]) : QString());
+    int iterations = 10;
+    bool passed = true;
+
+    printf("%d glitches of %d iterations per file, decoded to cover %dx%d\n", runs, iterations, SCREEN_SIZE.width(), SCREEN_SIZE.height());
+    printf("%-26s %9s %9s %8s %14s %14s\n", "file", "KB", "segments", "failed", "in place (ms)", "re-encode (ms)");
+
+    for (const CorpusFile &file : corpus) {
+        std::vector<JpegSegment> segments;
+        if (!jpeg_entropy_segments(reinterpret_cast<const uchar*>(file.data.constData()), file.data.size(), segments)) {
+            printf("%-26s FAIL: no scan data found\n", qPrintable(file.name));
+            passed = false;
+            continue;
+        }
+
+        int failed = 0;
+        std::vector<double> in_place_ms;
+        for (int run = 0; run < runs; ++run) {
+            QByteArray glitched = file.data;
+            glitched.detach();
+
+            QElapsedTimer timer;
+            timer.start();
+            glitch_jpeg_data(reinterpret_cast<uchar*>(glitched.data()), glitched.size(), iterations);
+            QBuffer buffer(&glitched);
+            buffer.open(QIODevice::ReadOnly);
+            QImage image = decode_scaled(&buffer, file.name, SCREEN_SIZE);
+            in_place_ms.push_back(timer.nsecsElapsed() / 1e6);
+
+            std::vector<JpegSegment> glitched_segments;
+            jpeg_entropy_segments(reinterpret_cast<const uchar*>(glitched.constData()), glitched.size(), glitched_segments);
+            if (image.isNull() || !libjpeg_decodes(glitched) || !same_segments(segments, glitched_segments)
+                    || bytes_outside(file.data, glitched, segments) > 0) {
+                ++failed;
+            }
+        }
+        std::sort(in_place_ms.begin(), in_place_ms.end());
+
+        // What glitching the wallpaper would take with the jpeg engine: decode, encode, glitch and decode again
+        QElapsedTimer timer;
+        timer.start();
+        QBuffer buffer(const_cast<QByteArray*>(&file.data));
+        buffer.open(QIODevice::ReadOnly);
+        glitch_image(decode_scaled(&buffer, file.name, SCREEN_SIZE), iterations, 90);
+        double re_encode_ms = timer.nsecsElapsed() / 1e6;
+
+        printf("%-26s %9d %9d %8d %14.1f %14.1f\n", qPrintable(file.name), file.data.size() / 1024, (int)segments.size(), failed,
+            in_place_ms[in_place_ms.size() / 2], re_encode_ms);
+        if (failed > 0) {
+            passed = false;
+        }
+    }
+
+    if (!passed) {
+        printf("FAIL: some glitched files are broken\n");
+    }
+
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,222 @@
+#include "sleep_lifecycle.h"
+
+#include <QCoreApplication>
+#include <QHash>
+#include <QStringList>
+
+#include <cstdio>
+
+// Replays recorded sequences of Nickel hook calls against the sleep lifecycle, the way the hooks in
+// screensaver.cc drive it, and checks that every sleep is prepared and handed off at most once and that
+// only the frame of the current sleep is ever handed off.
+
+// One call per line: "<hook> <current view>", "wake <view>" when the idle work sees the device awake,
+// "hide <view>" when the sleep view showing the frame is hidden, "wait <ms>". Indented lines are made by Nickel while the frame of the line above is being prepared.
+struct Scenario {
+    const char* name;
+    const char* calls;
+    int prepared;     // frames prepared
+    int handed_off;   // frames handed off
+    int forwarded;    // calls of Nickel's handleSleep
+};
+
+static const Scenario SCENARIOS[] = {
+    {
+        "sleep, wake, sleep",
+        "handleSleep ReadingView\n"
+        "showSleepView BookCoverDragonPowerView\n"
+        "wake ReadingView\n"
+        "handleSleep ReadingView\n"
+        "showSleepView BookCoverDragonPowerView\n",
+        2, 2, 2,
+    },
+    {
+        "handleSleep called twice",
+        "handleSleep ReadingView\n"
+        "handleSleep ReadingView\n"
+        "showSleepView BookCoverDragonPowerView\n"
+        "showSleepView BookCoverDragonPowerView\n",
+        1, 1, 2,
+    },
+    {
+        "power off while asleep",
+        "handleSleep HomeView\n"
+        "showSleepView FullScreenDragonPowerView\n"
+        "powerOff FullScreenDragonPowerView\n"
+        "showPowerOffView FullScreenDragonPowerView\n",
+        2, 2, 2,
+    },
+    {
+        "power off before the sleep view is shown",
+        "handleSleep ReadingView\n"
+        "powerOff ReadingView\n"
+        "showSleepView BookCoverDragonPowerView\n"
+        "showPowerOffView FullScreenDragonPowerView\n",
+        2, 1, 2,
+    },
+    {
+        "low battery power off",
+        "powerOff ReadingView\n"
+        "showPowerOffView FullScreenDragonPowerView\n",
+        1, 1, 1,
+    },
+    {
+        "re-entered while preparing",
+        "handleSleep ReadingView\n"
+        "  handleSleep ReadingView\n"
+        "  powerOff ReadingView\n"
+        "showSleepView BookCoverDragonPowerView\n",
+        1, 1, 2,
+    },
+    {
+        "woken up and asleep again before the idle work",
+        "handleSleep ReadingView\n"
+        "showSleepView BookCoverDragonPowerView\n"
+        "hide BookCoverDragonPowerView\n"
+        "handleSleep BookCoverDragonPowerView\n"
+        "showSleepView BookCoverDragonPowerView\n"
+        "wake ReadingView\n",
+        2, 2, 2,
+    },
+    {
+        "unlocked before the view is shown",
+        "handleSleep ReadingView\n"
+        "showSleepView ReadingView\n"
+        "handleSleep ReadingView\n"
+        "showSleepView BookCoverDragonPowerView\n",
+        2, 1, 2,
+    },
+    {
+        "rapid power button presses",
+        "handleSleep ReadingView\n"
+        "showSleepView BookCoverDragonPowerView\n"
+        "handleSleep BookCoverDragonPowerView\n"
+        "handleSleep ReadingView\n"
+        "handleSleep ReadingView\n"
+        "showSleepView BookCoverDragonPowerView\n"
+        "showSleepView BookCoverDragonPowerView\n",
+        2, 2, 4,
+    },
+    {
+        "sleep view never shown",
+        "handleSleep ReadingView\n"
+        "wait 2000\n"
+        "handleSleep ReadingView\n"
+        "wait 15000\n"
+        "handleSleep ReadingView\n"
+        "showSleepView BookCoverDragonPowerView\n",
+        2, 1, 3,
+    },
+};
+
+// What the hooks of screensaver.cc do, with counters instead of Nickel
+class Replay {
+public:
+    int prepared = 0;
+    int handed_off = 0;
+    int forwarded = 0;
+    QStringList errors;
+
+    void run(const QStringList &lines) {
+        for (int i = 0; i < lines.size(); ++i) {
+            // Calls made during the preparation of this one
+            QStringList nested;
+            while (i + 1 < lines.size() && lines[i + 1].startsWith("  ")) {
+                nested.append(lines[++i].mid(2));
+            }
+            call(lines[i], nested);
+        }
+    }
+
+private:
+    qint64 now_ms = 0;
+    quint64 frame_generation = 0;  // sleep_frame.generation
+    int deferred = 0;              // deferred_sleeps
+    QHash<quint64, int> prepare_counts;
+    QHash<quint64, int> hand_off_counts;
+
+    void call(const QString &line, const QStringList &nested) {
+        QString hook = line.section(' ', 0, 0);
+        QString view = line.section(' ', 1);
+
+        if (hook == "handleSleep" || hook == "powerOff") {
+            quint64 generation = hook == "powerOff" ? sleep_lifecycle_power_off() : sleep_lifecycle_request(view, now_ms);
+            if (hook == "handleSleep" && generation == 0 && sleep_lifecycle_state() == SLEEP_STATE::Preparing) {
+                // Forwarded after the call preparing the frame
+                deferred++;
+                return;
+            }
+            if (generation != 0) {
+                prepare(generation, nested);
+            }
+            // powerOff only shows the sleep view for a frame of its own, the frame always needs it here
+            if (hook == "handleSleep" || generation != 0) {
+                forwarded++;
+            }
+            forwarded += deferred;
+            deferred = 0;
+        } else if (hook == "showSleepView" || hook == "showPowerOffView") {
+            hand_off(sleep_lifecycle_shown(view));
+        } else if (hook == "hide") {
+            sleep_lifecycle_hidden();
+        } else if (hook == "wake") {
+            if (!is_sleep_view(view)) {
+                sleep_lifecycle_woke();
+            }
+        } else if (hook == "wait") {
+            now_ms += view.toLongLong();
+        } else {
+            errors << QString("unknown call \"%1\"").arg(line);
+        }
+    }
+
+    void prepare(quint64 generation, const QStringList &nested) {
+        if (++prepare_counts[generation] > 1) {
+            errors << QString("generation %1 prepared twice").arg(generation);
+        }
+        frame_generation = generation;
+        prepared++;
+
+        run(nested);
+        sleep_lifecycle_prepared(generation, now_ms);
+    }
+
+    void hand_off(quint64 generation) {
+        if (generation == 0) {
+            return;
+        }
+        if (generation != frame_generation || generation != sleep_lifecycle_generation()) {
+            errors << QString("stale frame of generation %1 handed off").arg(generation);
+        }
+        if (++hand_off_counts[generation] > 1) {
+            errors << QString("generation %1 handed off twice").arg(generation);
+        }
+        handed_off++;
+    }
+};
+
+int main(int argc, char** argv) {
+    QCoreApplication app(argc, argv);
+    bool is_ok = true;
+
+    printf("%-36s %9s %11s %10s\n", "scenario", "prepared", "handed off", "forwarded");
+    for (const Scenario &scenario : SCENARIOS) {
+        // Every scenario starts awake, after the previous one
+        sleep_lifecycle_woke();
+
+        Replay replay;
+        replay.run(QString(scenario.calls).split('\n', QString::SkipEmptyParts));
+        printf("%-36s %9d %11d %10d\n", scenario.name, replay.prepared, replay.handed_off, replay.forwarded);
+
+        if (replay.prepared != scenario.prepared || replay.handed_off != scenario.handed_off || replay.forwarded != scenario.forwarded) {
+            replay.errors << QString("expected %1 prepared, %2 handed off, %3 forwarded")
+                .arg(scenario.prepared).arg(scenario.handed_off).arg(scenario.forwarded);
+        }
+        for (const QString &error : replay.errors) {
+            printf("  FAIL: %s\n", qPrintable(error));
+            is_ok = false;
+        }
+    }
+
+    return is_ok ? 0 : 1;
+}
@@ -0,0 +1,237 @@
+#include "composition_cache.h"
+#include "compositor.h"
+#include "fixtures.h"
+#include "frame_pool.h"
+#include "glitch.h"
+#include "image_cache.h"
+#include "pipeline.h"
+#include "worker_pool.h"
+
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QGuiApplication>
+#include <QTemporaryDir>
+
+#include <sched.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+// Runs the sleep pipeline stages against a fixture folder laid out like .adds/screensaver
+// and reports latency percentiles per stage, for every screen size and display mode.
+
+static const QSize SCREEN_SIZES[] = {
+    QSize(1072, 1448),
+    QSize(1264, 1680),
+    QSize(1404, 1872),
+};
+
+// Samples in ms, in the order stages were first recorded
+class StageTimings {
+public:
+    void record(const char* stage, double ms) {
+        for (auto &entry : stages) {
+            if (entry.first == stage) {
+                entry.second.push_back(ms);
+                return;
+            }
+        }
+        stages.push_back(std::make_pair(QString(stage), std::vector<double>(1, ms)));
+    }
+
+    void print(const QString &title) {
+        printf("\n%s\n", qPrintable(title));
+        printf("  %-16s %8s %8s %8s %8s %8s\n", "stage", "count", "p50", "p90", "p99", "max");
+        for (auto &entry : stages) {
+            std::vector<double> &samples = entry.second;
+            std::sort(samples.begin(), samples.end());
+            printf("  %-16s %8d %8.1f %8.1f %8.1f %8.1f\n",
+                qPrintable(entry.first),
+                (int)samples.size(),
+                percentile(samples, 50),
+                percentile(samples, 90),
+                percentile(samples, 99),
+                samples.back()
+            );
+        }
+    }
+
+private:
+    static double percentile(const std::vector<double> &sorted, int p) {
+        int index = qBound(0, (int)((sorted.size() - 1) * p / 100.0 + 0.5), (int)sorted.size() - 1);
+        return sorted[index];
+    }
+
+    std::vector<std::pair<QString, std::vector<double>>> stages;
+};
+
+class StageTimer {
+public:
+    StageTimer(StageTimings &timings, const char* stage) : timings(timings), stage(stage) {
+        timer.start();
+    }
+
+    ~StageTimer() {
+        timings.record(stage, timer.nsecsElapsed() / 1e6);
+    }
+
+private:
+    StageTimings &timings;
+    const char* stage;
+    QElapsedTimer timer;
+};
+
+// Stands in for capture_view(), which paints the page into the frame
+static void copy_page(const QImage &page, QImage &frame) {
+    int height = qMin(page.height(), frame.height());
+    int bytes = qMin(page.bytesPerLine(), frame.bytesPerLine());
+    for (int y = 0; y < height; ++y) {
+        memcpy(frame.scanLine(y), page.constScanLine(y), bytes);
+    }
+}
+
+static void run(const QString &root, QSize screen_size, bool is_reading, int runs, uint seed) {
+    // Same files and glitches for every run with the same seed
+    qsrand(seed);
+
+    QSettings ini(root + "/_settings.ini", QSettings::IniFormat);
+    ScreensaverSettings settings = settings_read(ini);
+    QImage page = make_page(screen_size).convertToFormat(QImage::Format_RGB32);
+    StageTimings timings;
+    frame_pool_begin();
+
+    for (int i = 0; i < runs; ++i) {
+        SleepPlan plan;
+        {
+            StageTimer timer(timings, "select");
+            plan = pick_plan(root, screen_size, is_reading, settings.selection_mode);
+        }
+        if (plan.display_mode == DISPLAY_MODE::None) {
+            fprintf(stderr, "No files found in %s\n", qPrintable(root));
+            return;
+        }
+
+        QImage wallpaper;
+        if (!plan.wallpaper_file.isEmpty()) {
+            StageTimer timer(timings, "decode wallpaper");
+            wallpaper = load_scaled_image(plan.wallpaper_file, screen_size);
+        }
+
+        ScaledOverlay overlay;
+        if (!plan.overlay_file.isEmpty()) {
+            StageTimer timer(timings, "decode overlay");
+            overlay = load_scaled_overlay(plan.overlay_file, screen_size);
+        }
+
+        QImage glitched;
+        if (is_reading) {
+            glitched = frame_pool_acquire(screen_size, QImage::Format_RGB32);
+            {
+                StageTimer timer(timings, "capture");
+                copy_page(page, glitched);
+            }
+
+            StageTimer timer(timings, "glitch");
+            glitch_screenshot(settings, glitched);
+        }
+
+        if (plan.display_mode & DISPLAY_MODE::Overlay) {
+            StageTimer timer(timings, "composite");
+            QImage base = is_reading ? glitched : wallpaper;
+            QImage frame;
+            if (settings.grayscale_enabled) {
+                frame = composite_grayscale(screen_size, base, QColor(255, 255, 255, 51), overlay.image, settings.grayscale_dither);
+            } else {
+                frame = frame_pool_acquire(screen_size, QImage::Format_RGB32);
+                composite_fused(frame, base, QColor(255, 255, 255, 51), overlay.image, overlay.rows.constData());
+            }
+            frame_pool_release(frame);
+        }
+        frame_pool_release(glitched);
+
+        // Everything before_handle() does after picking the files, then with the layers decoded meanwhile,
+        // then once more with the composited layers of the same files in memory
+        for (int pass = 0; pass < 3; ++pass) {
+            if (pass < 2) {
+                composition_cache_clear();
+            }
+
+            StageTimer timer(timings, pass == 0 ? "sleep (serial)" : pass == 1 ? "sleep (parallel)" : "sleep (cached)");
+            QImage image;
+            QPixmap overlay_pixmap;
+            if (pass > 0) {
+                start_plan_layers(plan, settings, screen_size);
+            }
+            if (is_reading) {
+                image = frame_pool_acquire(screen_size, QImage::Format_RGB32);
+                copy_page(page, image);
+                glitch_screenshot(settings, image);
+            }
+            render_plan(plan, settings, screen_size, image, overlay_pixmap);
+            frame_pool_release(image);
+        }
+    }
+
+    timings.print(QString("%1x%2, %3 mode, %4 runs").arg(screen_size.width()).arg(screen_size.height()).arg(is_reading ? "Book" : "Wallpaper").arg(runs));
+    printf("  frame buffers: %lld KB at peak, %lld KB allocated\n", frame_pool_peak() / 1024, frame_pool_allocated() / 1024);
+}
+
+int main(int argc, char** argv) {
+    if (qgetenv("QT_QPA_PLATFORM").isEmpty()) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    QGuiApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Sleep pipeline benchmark");
+    parser.addHelpOption();
+    parser.addOption(QCommandLineOption("fixtures", "Folder laid out like .adds/screensaver, generated when missing.", "dir"));
+    parser.addOption(QCommandLineOption("runs", "Runs per screen size and mode (default: 50).", "n", "50"));
+    parser.addOption(QCommandLineOption("seed", "Random seed (default: 1).", "n", "1"));
+    parser.addOption(QCommandLineOption("cores", "Run on the first n CPU cores only, like a single-core Kobo.", "n"));
+    parser.process(app);
+
+    if (parser.isSet("cores")) {
+        int cores = qMax(1, parser.value("cores").toInt());
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int cpu = 0; cpu < cores && cpu < CPU_SETSIZE; ++cpu) {
+            CPU_SET(cpu, &cpus);
+        }
+        // Threads started later inherit it
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+            fprintf(stderr, "Couldn't restrict the benchmark to %d cores\n", cores);
+            return 1;
+        }
+        worker_pool_configure(cores);
+    }
+
+    int runs = qMax(1, parser.value("runs").toInt());
+    uint seed = parser.value("seed").toUInt();
+
+    // Measure the actual decoding, the cache lives on the device
+    image_cache_configure(false, 0);
+    overlay_cache_configure(false);
+
+    QTemporaryDir temp_dir;
+    QString root = parser.value("fixtures");
+    if (root.isEmpty()) {
+        qsrand(seed);
+        root = temp_dir.path();
+        if (!make_fixtures(root)) {
+            fprintf(stderr, "Couldn't create fixtures in %s\n", qPrintable(root));
+            return 1;
+        }
+    }
+
+    printf("Fixtures: %s, seed: %u, worker threads: %d\n", qPrintable(root), seed, worker_pool_threads());
+    for (const QSize &size : SCREEN_SIZES) {
+        run(root, size, true, runs, seed);
+        run(root, size, false, runs, seed);
+    }
+
+    return 0;
+}
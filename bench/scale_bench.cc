@@ -0,0 +1,193 @@
+#include "area_scaler.h"
+
+#include <QElapsedTimer>
+#include <QGuiApplication>
+#include <QPainter>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// Compares area_scale() with Qt's fast and smooth scaling on line art, for speed and for PSNR against
+// the same art drawn at the scaled size. Fails when area_scale() is less accurate than nearest-neighbor,
+// or more than 1 level away from the exact area average.
+// Usage: scale_bench [runs]
+
+static const QSize SCREEN_SIZES[] = {
+    QSize(1072, 1448),
+    QSize(1264, 1680),
+    QSize(1404, 1872),
+};
+
+// Thin lines, hatching, circles and lines of "words", the worst case for aliasing on e-ink
+static void draw_line_art(QPainter &painter, QSize size) {
+    painter.fillRect(QRect(QPoint(0, 0), size), Qt::white);
+    painter.setRenderHint(QPainter::Antialiasing, true);
+
+    int w = size.width();
+    int h = size.height();
+    painter.setPen(QPen(Qt::black, 1.5));
+    for (int i = 0; i < 60; ++i) {
+        painter.drawLine(QPointF(0, h * i / 60.0), QPointF(w * 0.4, h * (i + 7) / 60.0));
+    }
+    for (int i = 0; i < 12; ++i) {
+        painter.drawEllipse(QPointF(w * 0.7, h * 0.25), w * 0.02 * (i + 1), w * 0.02 * (i + 1));
+    }
+
+    painter.setPen(Qt::NoPen);
+    painter.setBrush(Qt::black);
+    for (double y = h * 0.5; y < h * 0.95; y += h * 0.02) {
+        double x = w * 0.45;
+        while (x < w * 0.95) {
+            double word = w * (0.02 + (qrand() % 100) / 1000.0);
+            painter.drawRect(QRectF(x, y, qMin(word, w * 0.95 - x), h * 0.008));
+            x += word + w * 0.01;
+        }
+    }
+}
+
+// The art drawn at `size`, with the same random words as at the source size when `seed` is the same
+static QImage make_line_art(QSize source_size, QSize size, uint seed) {
+    QImage image(size, QImage::Format_RGB32);
+    QPainter painter(&image);
+    painter.scale((qreal)size.width() / source_size.width(), (qreal)size.height() / source_size.height());
+    qsrand(seed);
+    draw_line_art(painter, source_size);
+    painter.end();
+
+    return image;
+}
+
+static double psnr(const QImage &a, const QImage &b) {
+    double squares = 0;
+    for (int y = 0; y < a.height(); ++y) {
+        const QRgb* row_a = reinterpret_cast<const QRgb*>(a.constScanLine(y));
+        const QRgb* row_b = reinterpret_cast<const QRgb*>(b.constScanLine(y));
+        for (int x = 0; x < a.width(); ++x) {
+            int red = qRed(row_a[x]) - qRed(row_b[x]);
+            int green = qGreen(row_a[x]) - qGreen(row_b[x]);
+            int blue = qBlue(row_a[x]) - qBlue(row_b[x]);
+            squares += red * red + green * green + blue * blue;
+        }
+    }
+
+    double mse = squares / (3.0 * a.width() * a.height());
+    return mse > 0 ? 10 * std::log10(255.0 * 255.0 / mse) : 99.0;
+}
+
+// Largest difference between area_scale() and the area average computed exactly, on random pixels
+static double area_error(QSize source_size, QSize target_size) {
+    QImage source(source_size, QImage::Format_ARGB32_Premultiplied);
+    for (int y = 0; y < source.height(); ++y) {
+        QRgb* row = reinterpret_cast<QRgb*>(source.scanLine(y));
+        for (int x = 0; x < source.width(); ++x) {
+            int alpha = qrand() % 256;
+            row[x] = qRgba(qrand() % (alpha + 1), qrand() % (alpha + 1), qrand() % (alpha + 1), alpha);
+        }
+    }
+
+    QImage scaled = area_scale(source, target_size);
+    double sx = (double)source.width() / scaled.width();
+    double sy = (double)source.height() / scaled.height();
+    double error = 0;
+    for (int y = 0; y < scaled.height(); ++y) {
+        for (int x = 0; x < scaled.width(); ++x) {
+            double sums[4] = {0, 0, 0, 0};
+            for (int py = (int)(y * sy); py < source.height() && py < (y + 1) * sy; ++py) {
+                double wy = qMin(py + 1.0, (y + 1) * sy) - qMax((double)py, y * sy);
+                const QRgb* row = reinterpret_cast<const QRgb*>(source.constScanLine(py));
+                for (int px = (int)(x * sx); px < source.width() && px < (x + 1) * sx; ++px) {
+                    double weight = wy * (qMin(px + 1.0, (x + 1) * sx) - qMax((double)px, x * sx));
+                    sums[0] += weight * qAlpha(row[px]);
+                    sums[1] += weight * qRed(row[px]);
+                    sums[2] += weight * qGreen(row[px]);
+                    sums[3] += weight * qBlue(row[px]);
+                }
+            }
+
+            QRgb pixel = reinterpret_cast<const QRgb*>(scaled.constScanLine(y))[x];
+            int values[4] = {qAlpha(pixel), qRed(pixel), qGreen(pixel), qBlue(pixel)};
+            for (int c = 0; c < 4; ++c) {
+                error = qMax(error, std::fabs(sums[c] / (sx * sy) - values[c]));
+            }
+        }
+    }
+
+    return error;
+}
+
+template <typename Func>
+static double median_ms(int runs, Func func) {
+    std::vector<double> samples;
+    for (int i = 0; i < runs; ++i) {
+        QElapsedTimer timer;
+        timer.start();
+        func();
+        samples.push_back(timer.nsecsElapsed() / 1e6);
+    }
+
+    std::sort(samples.begin(), samples.end());
+    return samples[samples.size() / 2];
+}
+
+int main(int argc, char** argv) {
+    if (qgetenv("QT_QPA_PLATFORM").isEmpty()) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    QGuiApplication app(argc, argv);
+
+    int runs = argc > 1 ? qMax(1, atoi(argv[1])) : 5;
+    bool passed = true;
+
+    printf("%d runs, median per image, PSNR against the art drawn at the scaled size\n", runs);
+    printf("%-10s %-10s %-8s %10s %10s\n", "screen", "source", "scaler", "time (ms)", "PSNR (dB)");
+
+    for (const QSize &screen : SCREEN_SIZES) {
+        // An integer ratio, a slightly larger scan, and a photo-sized source that is cropped
+        const QSize sources[] = {screen * 2, QSize(1600, 2400), QSize(4000, 6000)};
+        for (const QSize &source_size : sources) {
+            QImage source = make_line_art(source_size, source_size, 1);
+            QSize scaled_size = source_size.scaled(screen, Qt::KeepAspectRatioByExpanding);
+            QImage reference = make_line_art(source_size, scaled_size, 1);
+
+            QImage fast, smooth, area;
+            double fast_ms = median_ms(runs, [&]() { fast = source.scaled(scaled_size, Qt::IgnoreAspectRatio, Qt::FastTransformation); });
+            double smooth_ms = median_ms(runs, [&]() { smooth = source.scaled(scaled_size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation); });
+            double area_ms = median_ms(runs, [&]() { area = area_scale(source, screen); });
+
+            QString screen_name = QString("%1x%2").arg(screen.width()).arg(screen.height());
+            QString source_name = QString("%1x%2").arg(source_size.width()).arg(source_size.height());
+            double fast_psnr = psnr(fast, reference);
+            double area_psnr = psnr(area, reference);
+            printf("%-10s %-10s %-8s %10.1f %10.2f\n", qPrintable(screen_name), qPrintable(source_name), "fast", fast_ms, fast_psnr);
+            printf("%-10s %-10s %-8s %10.1f %10.2f\n", qPrintable(screen_name), qPrintable(source_name), "smooth", smooth_ms, psnr(smooth, reference));
+            printf("%-10s %-10s %-8s %10.1f %10.2f\n", qPrintable(screen_name), qPrintable(source_name), "area", area_ms, area_psnr);
+
+            if (area.size() != scaled_size || area_psnr < fast_psnr) {
+                printf("FAIL: area scaling of %s is worse than nearest-neighbor\n", qPrintable(source_name));
+                passed = false;
+            }
+        }
+    }
+
+    // Integer, fractional and upscaling ratios
+    qsrand(1);
+    const QSize checks[][2] = {
+        {QSize(480, 640), QSize(240, 320)},
+        {QSize(701, 503), QSize(300, 200)},
+        {QSize(97, 131), QSize(300, 400)},
+    };
+    for (const auto &check : checks) {
+        double error = area_error(check[0], check[1]);
+        printf("%dx%d to cover %dx%d: %.2f levels from the exact area average\n",
+            check[0].width(), check[0].height(), check[1].width(), check[1].height(), error);
+        if (error > 1.0) {
+            printf("FAIL: area scaling is off by more than 1 level\n");
+            passed = false;
+        }
+    }
+
+    return passed ? 0 : 1;
+}
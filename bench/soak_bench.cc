@@ -0,0 +1,275 @@
+#include "fixtures.h"
+#include "onboard.h"
+#include "settings.h"
+
+#include <QApplication>
+#include <QCommandLineParser>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QLabel>
+#include <QScreen>
+#include <QTemporaryDir>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+// Sleeps and wakes the whole mod thousands of times against stub Nickel views, like a device does
+// over months, and fails when the memory, the number of live objects or the sleep latency keeps growing.
+// screensaver.cc is built with its folders under "onboard" in a scratch folder.
+
+// From screensaver.cc
+extern void (*N3PowerWorkflowManager_handleSleep)(void* self);
+extern void (*N3PowerWorkflowManager_showSleepView)(void* self);
+extern void (*N3PowerWorkflowManager_powerOff)(void* self, bool low_battery);
+extern void (*N3PowerWorkflowManager_showPowerOffView)(void* self);
+extern void* (*MainWindowController_sharedInstance)();
+extern QWidget* (*MainWindowController_currentView)(void*);
+extern void (*FullScreenDragonPowerView_setImage)(QWidget* self, const QImage& img);
+extern "C" void hook_N3PowerWorkflowManager_handleSleep(void* self);
+extern "C" void hook_N3PowerWorkflowManager_showSleepView(void* self);
+void run_idle_work();
+bool prerender_pending();
+
+// Stand-ins for Nickel, which keeps its views around from one sleep to the next
+static QWidget* current_view = nullptr;
+static QWidget* sleep_view = nullptr;
+static QImage view_image;  // kept by FullScreenDragonPowerView::setImage()
+
+static void show_view(QWidget* view) {
+    if (current_view) {
+        current_view->hide();
+    }
+    current_view = view;
+    current_view->show();
+}
+
+static void* stub_shared_instance() {
+    return &current_view;
+}
+
+static QWidget* stub_current_view(void*) {
+    return current_view;
+}
+
+static void stub_set_image(QWidget*, const QImage &image) {
+    view_image = image;
+}
+
+static void stub_handle_sleep(void* self) {
+    show_view(sleep_view);
+    hook_N3PowerWorkflowManager_showSleepView(self);
+}
+
+static void stub_show_view(void*) {
+}
+
+static void stub_power_off(void*, bool) {
+}
+
+static qint64 resident_bytes() {
+    QFile statm("/proc/self/statm");
+    if (!statm.open(QIODevice::ReadOnly)) {
+        return 0;
+    }
+
+    return statm.readAll().split(' ').value(1).toLongLong() * sysconf(_SC_PAGESIZE);
+}
+
+// Objects reachable from the application and its windows
+static int live_objects() {
+    int count = 1 + qApp->findChildren<QObject*>().size();
+    for (QWidget* widget : QApplication::topLevelWidgets()) {
+        count += 1 + widget->findChildren<QObject*>().size();
+    }
+
+    return count;
+}
+
+struct CycleSample {
+    double ms;
+    qint64 rss;
+    int widgets;
+    int objects;
+};
+
+// Samples of one stretch of cycles
+struct Stretch {
+    double p50_ms;
+    qint64 max_rss;
+    int widgets;
+    int objects;
+};
+
+static Stretch summarize(std::vector<CycleSample>::const_iterator begin, std::vector<CycleSample>::const_iterator end) {
+    std::vector<double> ms;
+    Stretch stretch = {0, 0, 0, 0};
+    for (auto it = begin; it != end; ++it) {
+        ms.push_back(it->ms);
+        stretch.max_rss = qMax(stretch.max_rss, it->rss);
+        stretch.widgets = it->widgets;
+        stretch.objects = it->objects;
+    }
+    std::sort(ms.begin(), ms.end());
+    stretch.p50_ms = ms[ms.size() / 2];
+
+    return stretch;
+}
+
+static bool make_soak_fixtures() {
+    QString root = QString(NICKEL_SCREENSAVER_ONBOARD) + "/.adds/screensaver";
+    if (!make_fixtures(root) || !QDir().mkpath(QString(NICKEL_SCREENSAVER_ONBOARD) + "/.kobo/screensaver")) {
+        return false;
+    }
+
+    // Cover mode now and then, with the overlay alone in a label
+    QFile cover(root + "/wallpaper/cover");
+    if (!cover.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    cover.close();
+
+    // The page is rendered, there's no framebuffer to read, and everything the idle work does is on
+    QSettings ini(SETTINGS_PATH, QSettings::IniFormat);
+    ScreensaverSettings values = settings_read(ini);
+    values.book_screenshot = CAPTURE_SOURCE::Render;
+    values.wallpaper_prerender = true;
+    values.stats_enabled = true;
+    settings_write(ini, values);
+    ini.sync();
+
+    return ini.status() == QSettings::NoError;
+}
+
+int main(int argc, char** argv) {
+    if (qgetenv("QT_QPA_PLATFORM").isEmpty()) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    QApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Sleep/wake soak test");
+    parser.addHelpOption();
+    parser.addOption(QCommandLineOption("cycles", "Sleep/wake cycles after the warm-up (default: 2000).", "n", "2000"));
+    parser.addOption(QCommandLineOption("warmup", "Cycles run before measuring, while caches fill up (default: 50).", "n", "50"));
+    parser.addOption(QCommandLineOption("max-rss-growth", "Growth of the resident memory allowed, in MB (default: 8).", "mb", "8"));
+    parser.addOption(QCommandLineOption("max-object-growth", "Growth of live QObjects and widgets allowed (default: 0).", "n", "0"));
+    parser.addOption(QCommandLineOption("max-latency-drift", "Growth of the median sleep latency allowed, in % (default: 50).", "percent", "50"));
+    parser.addOption(QCommandLineOption("seed", "Random seed (default: 1).", "n", "1"));
+    parser.process(app);
+
+    int cycles = qMax(10, parser.value("cycles").toInt());
+    int warmup = qMax(0, parser.value("warmup").toInt());
+    qint64 max_rss_growth = parser.value("max-rss-growth").toLongLong() * 1024 * 1024;
+    int max_object_growth = parser.value("max-object-growth").toInt();
+    int max_latency_drift = parser.value("max-latency-drift").toInt();
+    qsrand(parser.value("seed").toUInt());
+
+    QTemporaryDir temp_dir;
+    if (!temp_dir.isValid() || !QDir::setCurrent(temp_dir.path()) || !make_soak_fixtures()) {
+        fprintf(stderr, "Couldn't create fixtures in %s\n", qPrintable(temp_dir.path()));
+        return 1;
+    }
+
+    N3PowerWorkflowManager_handleSleep = &stub_handle_sleep;
+    N3PowerWorkflowManager_showSleepView = &stub_show_view;
+    N3PowerWorkflowManager_powerOff = &stub_power_off;
+    N3PowerWorkflowManager_showPowerOffView = &stub_show_view;
+    MainWindowController_sharedInstance = &stub_shared_instance;
+    MainWindowController_currentView = &stub_current_view;
+    FullScreenDragonPowerView_setImage = &stub_set_image;
+
+    QSize screen_size = QGuiApplication::primaryScreen()->size();
+    QWidget window;
+    window.setGeometry(QRect(QPoint(0, 0), screen_size));
+
+    QLabel reading_view(&window);
+    reading_view.setObjectName("ReadingView");
+    reading_view.setPixmap(QPixmap::fromImage(make_page(screen_size)));
+
+    QWidget home_view(&window);
+    home_view.setObjectName("HomeView");
+
+    QWidget book_cover_view(&window);
+    book_cover_view.setObjectName("BookCoverDragonPowerView");
+
+    QWidget framed_view(&window);
+    framed_view.setObjectName("FramedDragonPowerView");
+
+    for (QWidget* view : {(QWidget*)&reading_view, &home_view, &book_cover_view, &framed_view}) {
+        view->setGeometry(window.rect());
+        view->hide();
+    }
+    window.show();
+
+    printf("Fixtures: %s, screen: %dx%d, %d cycles after %d to warm up\n",
+        qPrintable(temp_dir.path()), screen_size.width(), screen_size.height(), cycles, warmup);
+    printf("%8s %10s %10s %8s %8s\n", "cycle", "p50 (ms)", "RSS (MB)", "widgets", "objects");
+
+    std::vector<CycleSample> samples;
+    int report_every = qMax(1, cycles / 10);
+    for (int i = 0; i < warmup + cycles; ++i) {
+        // Book and Wallpaper modes, in both sleep views
+        bool is_reading = i % 2 == 0;
+        show_view(is_reading ? (QWidget*)&reading_view : &home_view);
+        sleep_view = (i / 2) % 2 == 0 ? &book_cover_view : &framed_view;
+
+        QElapsedTimer timer;
+        timer.start();
+        hook_N3PowerWorkflowManager_handleSleep(nullptr);
+        double ms = timer.nsecsElapsed() / 1e6;
+
+        // Wake up, the idle timer fires
+        show_view(is_reading ? (QWidget*)&reading_view : &home_view);
+        run_idle_work();
+        // The next frame is composited once its layers are decoded on the worker threads
+        while (prerender_pending()) {
+            app.processEvents(QEventLoop::WaitForMoreEvents);
+        }
+        QCoreApplication::sendPostedEvents(nullptr, QEvent::DeferredDelete);
+        app.processEvents();
+
+        if (i < warmup) {
+            continue;
+        }
+
+        samples.push_back({ms, resident_bytes(), QApplication::allWidgets().size(), live_objects()});
+        if ((int)samples.size() % report_every == 0) {
+            Stretch stretch = summarize(samples.end() - report_every, samples.end());
+            printf("%8d %10.1f %10.1f %8d %8d\n", (int)samples.size(), stretch.p50_ms, stretch.max_rss / 1048576.0, stretch.widgets, stretch.objects);
+        }
+    }
+
+    // The first tenth of the measured cycles against the last one
+    Stretch first = summarize(samples.begin(), samples.begin() + report_every);
+    Stretch last = summarize(samples.end() - report_every, samples.end());
+    const CycleSample &baseline = samples.front();
+
+    bool passed = true;
+    qint64 rss_growth = last.max_rss - first.max_rss;
+    if (rss_growth > max_rss_growth) {
+        printf("FAIL: resident memory grew by %.1f MB\n", rss_growth / 1048576.0);
+        passed = false;
+    }
+    if (last.widgets - baseline.widgets > max_object_growth) {
+        printf("FAIL: %d widgets leaked\n", last.widgets - baseline.widgets);
+        passed = false;
+    }
+    if (last.objects - baseline.objects > max_object_growth) {
+        printf("FAIL: %d objects leaked\n", last.objects - baseline.objects);
+        passed = false;
+    }
+    if (last.p50_ms > first.p50_ms * (100 + max_latency_drift) / 100) {
+        printf("FAIL: median sleep latency went from %.1f ms to %.1f ms\n", first.p50_ms, last.p50_ms);
+        passed = false;
+    }
+    if (passed) {
+        printf("PASS: %+.1f MB, %+d widgets, %+d objects, %.1f -> %.1f ms\n",
+            rss_growth / 1048576.0, last.widgets - baseline.widgets, last.objects - baseline.objects, first.p50_ms, last.p50_ms);
+    }
+
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,253 @@
+#include "area_scaler.h"
+
+#include <QVector>
+
+#include <algorithm>
+
+constexpr int WEIGHT_BITS = 15;
+constexpr quint32 WEIGHT_ONE = 1 << WEIGHT_BITS;
+
+// Weight of [a, b) within [start, start + length). Rounding the ends instead of the difference
+// makes the weights of one interval add up to exactly WEIGHT_ONE.
+static inline quint16 span_weight(qint64 a, qint64 b, qint64 start, qint64 length) {
+    qint64 end_weight = ((b - start) * WEIGHT_ONE + length / 2) / length;
+    qint64 start_weight = ((a - start) * WEIGHT_ONE + length / 2) / length;
+    return (quint16)(end_weight - start_weight);
+}
+
+AreaScaler::AreaScaler(int src_width, int src_height, QSize scaled_size, QImage &dst)
+    : src_width(src_width), src_height(src_height), scaled_height(scaled_size.height()), dst(dst),
+      filtered(dst.width() * 4, 0) {
+    int dst_width = dst.width();
+    int scaled_width = scaled_size.width();
+
+    // Source pixel s spans [s * scaled_width, (s + 1) * scaled_width), column x spans [x * src_width, (x + 1) * src_width)
+    if (src_width % scaled_width == 0) {
+        integer_ratio = src_width / scaled_width;
+        integer_reciprocal = ((1 << 22) + integer_ratio / 2) / integer_ratio;
+    } else {
+        column_start.resize(dst_width + 1);
+        column_weights.resize(dst_width + 1);
+        for (int x = 0; x < dst_width; ++x) {
+            qint64 start = (qint64)x * src_width;
+            qint64 end = start + src_width;
+            int first = start / scaled_width;
+            int last = (end - 1) / scaled_width;
+
+            column_start[x] = first;
+            column_weights[x] = weights.size();
+            for (int s = first; s <= last; ++s) {
+                qint64 a = qMax((qint64)s * scaled_width, start);
+                qint64 b = qMin((qint64)(s + 1) * scaled_width, end);
+                weights.push_back(span_weight(a, b, start, src_width));
+            }
+        }
+        column_weights[dst_width] = weights.size();
+    }
+
+    // Rows of `dst` a single source row can reach
+    slot_count = (scaled_height + src_height - 1) / src_height + 1;
+    sums.assign((size_t)slot_count * dst_width * 4, 0);
+}
+
+qint64 AreaScaler::memory(int src_width, int src_height, QSize scaled_size) {
+    int slots = (scaled_size.height() + src_height - 1) / src_height + 1;
+    qint64 columns = src_width % scaled_size.width() == 0 ? 0 : (qint64)scaled_size.width() * 2 * sizeof(int) + (qint64)(src_width + scaled_size.width()) * sizeof(quint16);
+    return columns + (qint64)scaled_size.width() * 4 * (sizeof(quint16) + slots * sizeof(quint32));
+}
+
+// Horizontal pass: one source row into `filtered`, in B, G, R, A order with 8 more bits of precision
+void AreaScaler::filter_row(const QRgb* row) {
+    int dst_width = dst.width();
+    quint16* out = filtered.data();
+
+    if (integer_ratio) {
+        for (int x = 0; x < dst_width; ++x, out += 4, row += integer_ratio) {
+            quint32 b = 0, g = 0, r = 0, a = 0;
+            for (int i = 0; i < integer_ratio; ++i) {
+                QRgb pixel = row[i];
+                b += pixel & 0xff;
+                g += (pixel >> 8) & 0xff;
+                r += (pixel >> 16) & 0xff;
+                a += pixel >> 24;
+            }
+            out[0] = (b * integer_reciprocal + (1 << 13)) >> 14;
+            out[1] = (g * integer_reciprocal + (1 << 13)) >> 14;
+            out[2] = (r * integer_reciprocal + (1 << 13)) >> 14;
+            out[3] = (a * integer_reciprocal + (1 << 13)) >> 14;
+        }
+        return;
+    }
+
+    const quint16* weight = weights.data();
+    for (int x = 0; x < dst_width; ++x, out += 4) {
+        const QRgb* pixel = row + column_start[x];
+        const quint16* end = weights.data() + column_weights[x + 1];
+        quint32 b = 0, g = 0, r = 0, a = 0;
+        for (; weight < end; ++weight, ++pixel) {
+            quint32 w = *weight;
+            b += w * (*pixel & 0xff);
+            g += w * ((*pixel >> 8) & 0xff);
+            r += w * ((*pixel >> 16) & 0xff);
+            a += w * (*pixel >> 24);
+        }
+        const int shift = WEIGHT_BITS - 8;
+        out[0] = (b + (1 << (shift - 1))) >> shift;
+        out[1] = (g + (1 << (shift - 1))) >> shift;
+        out[2] = (r + (1 << (shift - 1))) >> shift;
+        out[3] = (a + (1 << (shift - 1))) >> shift;
+    }
+}
+
+// Vertical pass: sums += weight * filtered. Filtered values are at most 255 << 8, so a full weight still fits 32 bits.
+#if (defined(__ARM_NEON__) || defined(__ARM_NEON))
+#include <arm_neon.h>
+
+static void accumulate(quint32* sums, const quint16* filtered, quint16 weight, int count) {
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        uint16x8_t values = vld1q_u16(filtered + i);
+        vst1q_u32(sums + i, vmlal_n_u16(vld1q_u32(sums + i), vget_low_u16(values), weight));
+        vst1q_u32(sums + i + 4, vmlal_n_u16(vld1q_u32(sums + i + 4), vget_high_u16(values), weight));
+    }
+    for (; i < count; ++i) {
+        sums[i] += (quint32)weight * filtered[i];
+    }
+}
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+static void accumulate(quint32* sums, const quint16* filtered, quint16 weight, int count) {
+    const __m128i weights = _mm_set1_epi16((short)weight);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(filtered + i));
+        // 32-bit products from their low and high halves
+        __m128i low = _mm_mullo_epi16(values, weights);
+        __m128i high = _mm_mulhi_epu16(values, weights);
+        __m128i* out = reinterpret_cast<__m128i*>(sums + i);
+        _mm_storeu_si128(out, _mm_add_epi32(_mm_loadu_si128(out), _mm_unpacklo_epi16(low, high)));
+        _mm_storeu_si128(out + 1, _mm_add_epi32(_mm_loadu_si128(out + 1), _mm_unpackhi_epi16(low, high)));
+    }
+    for (; i < count; ++i) {
+        sums[i] += (quint32)weight * filtered[i];
+    }
+}
+
+#else
+
+static void accumulate(quint32* sums, const quint16* filtered, quint16 weight, int count) {
+    for (int i = 0; i < count; ++i) {
+        sums[i] += (quint32)weight * filtered[i];
+    }
+}
+
+#endif
+
+void AreaScaler::write_row(int y) {
+    int dst_width = dst.width();
+    quint32* sum = sums.data() + (size_t)(y % slot_count) * dst_width * 4;
+    QRgb* out = reinterpret_cast<QRgb*>(dst.scanLine(y));
+    QRgb opaque = dst.format() == QImage::Format_RGB32 ? 0xff000000 : 0;
+
+    const int shift = WEIGHT_BITS + 8;
+    const quint32 half = 1 << (shift - 1);
+    for (int x = 0; x < dst_width; ++x, sum += 4) {
+        out[x] = opaque
+            | ((sum[0] + half) >> shift)
+            | ((sum[1] + half) >> shift) << 8
+            | ((sum[2] + half) >> shift) << 16
+            | ((sum[3] + half) >> shift) << 24;
+    }
+
+    std::fill(sums.begin() + (size_t)(y % slot_count) * dst_width * 4, sums.begin() + (size_t)(y % slot_count + 1) * dst_width * 4, 0);
+}
+
+void AreaScaler::add_row(const QRgb* row) {
+    int dst_height = dst.height();
+    if (dst_y >= dst_height) {
+        return;
+    }
+
+    filter_row(row);
+
+    // Source row s spans [s * scaled_height, (s + 1) * scaled_height), row y spans [y * src_height, (y + 1) * src_height)
+    qint64 start = (qint64)src_y * scaled_height;
+    qint64 end = start + scaled_height;
+    int last = qMin((int)((end - 1) / src_height), dst_height - 1);
+    int count = dst.width() * 4;
+    for (int y = qMax((int)(start / src_height), dst_y); y <= last; ++y) {
+        qint64 row_start = (qint64)y * src_height;
+        quint16 weight = span_weight(qMax(start, row_start), qMin(end, row_start + src_height), row_start, src_height);
+        if (weight) {
+            accumulate(sums.data() + (size_t)(y % slot_count) * count, filtered.data(), weight, count);
+        }
+    }
+    ++src_y;
+
+    // Rows whose whole span has been added
+    while (dst_y < dst_height && (qint64)(dst_y + 1) * src_height <= (qint64)src_y * scaled_height) {
+        write_row(dst_y);
+        ++dst_y;
+    }
+}
+
+// Row `y` of `image` as premultiplied pixels, `buffer` is used when it has to be converted
+static const QRgb* premultiplied_row(const QImage &image, int y, const QVector<QRgb> &color_table, std::vector<QRgb> &buffer) {
+    const uchar* line = image.constScanLine(y);
+    switch (image.format()) {
+        case QImage::Format_Indexed8:
+            for (int x = 0; x < image.width(); ++x) {
+                buffer[x] = line[x] < color_table.size() ? color_table[line[x]] : qRgb(0, 0, 0);
+            }
+            return buffer.data();
+        case QImage::Format_ARGB32:
+            for (int x = 0; x < image.width(); ++x) {
+                buffer[x] = qPremultiply(reinterpret_cast<const QRgb*>(line)[x]);
+            }
+            return buffer.data();
+        default:
+            return reinterpret_cast<const QRgb*>(line);
+    }
+}
+
+void area_scale_into(const QImage &source, QSize scaled_size, QImage &dst) {
+    if (source.isNull() || dst.isNull() || scaled_size.isEmpty()) {
+        return;
+    }
+
+    QImage image = source;
+    if (image.format() != QImage::Format_RGB32 && image.format() != QImage::Format_ARGB32
+            && image.format() != QImage::Format_ARGB32_Premultiplied && image.format() != QImage::Format_Indexed8) {
+        image = image.convertToFormat(image.hasAlphaChannel() ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32);
+    }
+
+    QVector<QRgb> color_table = image.colorTable();
+    for (QRgb &color : color_table) {
+        color = qPremultiply(color);
+    }
+
+    AreaScaler scaler(image.width(), image.height(), scaled_size, dst);
+    std::vector<QRgb> buffer(image.width());
+    int rows = qMin(image.height(), (int)(((qint64)dst.height() * image.height() + scaled_size.height() - 1) / scaled_size.height()));
+    for (int y = 0; y < rows; ++y) {
+        scaler.add_row(premultiplied_row(image, y, color_table, buffer));
+    }
+}
+
+QImage area_scale(const QImage &source, QSize target_size) {
+    if (source.isNull() || target_size.isEmpty()) {
+        return QImage();
+    }
+
+    QSize scaled_size = source.size().scaled(target_size, Qt::KeepAspectRatioByExpanding);
+    QImage::Format format = source.hasAlphaChannel() ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32;
+    if (scaled_size == source.size()) {
+        return source.convertToFormat(format);
+    }
+
+    QImage image(scaled_size, format);
+    area_scale_into(source, scaled_size, image);
+    return image;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <QImage>
+#include <QSize>
+
+#include <vector>
+
+// Area-averaging scaler in two separable passes with 15-bit fixed-point weights, for premultiplied pixels.
+// Every destination pixel is the mean of the source area it covers, partly covered source pixels included,
+// so fractional ratios are as smooth as integer ones. When upscaling, it blends the 1 or 2 pixels it overlaps.
+// Source rows are added one at a time, so a decoder can scale while it decodes.
+class AreaScaler {
+public:
+    // Scale a `src_width` x `src_height` source to `scaled_size`, keeping its top left corner in `dst`.
+    // `dst` is RGB32 or ARGB32_Premultiplied, at most as big as `scaled_size`.
+    AreaScaler(int src_width, int src_height, QSize scaled_size, QImage &dst);
+    AreaScaler(int src_width, int src_height, QImage &dst) : AreaScaler(src_width, src_height, dst.size(), dst) {}
+
+    // Bytes used besides the destination image
+    static qint64 memory(int src_width, int src_height, QSize scaled_size);
+
+    // Next row of the source, premultiplied. Rows past the ones `dst` needs are ignored.
+    void add_row(const QRgb* row);
+
+private:
+    void filter_row(const QRgb* row);
+    void write_row(int y);
+
+    int src_width;
+    int src_height;
+    int scaled_height;
+    QImage &dst;
+
+    // Horizontal pass: the source pixels of each column, with their weights unless the ratio is an integer
+    int integer_ratio = 0;
+    quint32 integer_reciprocal = 0;
+    std::vector<int> column_start;
+    std::vector<int> column_weights;
+    std::vector<quint16> weights;
+    std::vector<quint16> filtered;  // one row, 4 channels with 8 more bits of precision
+
+    // Vertical pass: accumulated rows of `dst` that are still missing source rows
+    std::vector<quint32> sums;
+    int slot_count;
+    int src_y = 0;
+    int dst_y = 0;
+};
+
+// `source` scaled to cover `target_size`, in a new image of the scaled size.
+// Returns ARGB32_Premultiplied when `source` has an alpha channel, RGB32 otherwise.
+QImage area_scale(const QImage &source, QSize target_size);
+
+// `source` scaled to `scaled_size`, keeping its top left corner in `dst`. Only the source rows it needs are read.
+void area_scale_into(const QImage &source, QSize scaled_size, QImage &dst);
@@ -0,0 +1,254 @@
+#include "bundle.h"
+#include "sleep_stats.h"
+#include <NickelHook.h>
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QMutex>
+#include <QSharedPointer>
+
+#include <climits>
+#include <cstring>
+#include <zlib.h>
+
+struct MappedBundle {
+    QFile file;
+    const uchar* data = nullptr;
+    qint64 size = 0;
+    QString root;
+    QHash<QString, int> entries;          // relative path -> entry
+    QHash<QString, QStringList> folders;  // relative folder -> file names
+};
+
+static QSharedPointer<MappedBundle> current_bundle;
+// Path, mtime, size and screen of the last file mapped or rejected, so a broken bundle is only logged once
+static QString checked_key;
+// Images are loaded on worker threads
+static QMutex bundle_mutex;
+
+static const BundleEntry &entry_at(const MappedBundle &bundle, int index) {
+    return reinterpret_cast<const BundleEntry*>(bundle.data + sizeof(BundleHeader))[index];
+}
+
+static bool is_entry_valid(const BundleEntry &entry, qint64 file_size) {
+    if (entry.data_offset < 0 || entry.data_size < 0 || entry.data_offset > file_size - entry.data_size) {
+        return false;
+    }
+
+    if (entry.format == QImage::Format_Invalid) {
+        return entry.data_size == 0;
+    }
+
+    bool is_32bit = entry.format == QImage::Format_RGB32
+        || entry.format == QImage::Format_ARGB32
+        || entry.format == QImage::Format_ARGB32_Premultiplied;
+    if (!is_32bit || entry.width <= 0 || entry.height <= 0
+            || entry.bytes_per_line < (qint64)entry.width * 4 || entry.bytes_per_line % 4 != 0) {
+        return false;
+    }
+
+    qint64 raw_size = (qint64)entry.bytes_per_line * entry.height + entry.extra_size;
+    if (raw_size > INT_MAX) {
+        return false;
+    }
+
+    switch (entry.compression) {
+    case BUNDLE_COMPRESSION::Stored:
+        return entry.data_offset % BUNDLE_ALIGNMENT == 0 && entry.data_size == raw_size;
+    case BUNDLE_COMPRESSION::Deflate:
+        return entry.data_size > 0;
+    default:
+        return false;
+    }
+}
+
+static QSharedPointer<MappedBundle> map_bundle(const QString &path, const QString &root, QSize screen_size) {
+    QSharedPointer<MappedBundle> bundle(new MappedBundle());
+    bundle->file.setFileName(path);
+    if (!bundle->file.open(QIODevice::ReadOnly)) {
+        nh_log("Couldn't open %s", qPrintable(path));
+        return QSharedPointer<MappedBundle>();
+    }
+
+    bundle->size = bundle->file.size();
+    bundle->data = bundle->size > (qint64)sizeof(BundleHeader) ? bundle->file.map(0, bundle->size) : nullptr;
+    const BundleHeader* header = reinterpret_cast<const BundleHeader*>(bundle->data);
+    if (!header || header->magic != BUNDLE_MAGIC) {
+        nh_log("%s isn't a screensaver bundle", qPrintable(path));
+        return QSharedPointer<MappedBundle>();
+    }
+
+    if (QSize(header->screen_width, header->screen_height) != screen_size) {
+        nh_log("%s was built for a %dx%d screen instead of %dx%d", qPrintable(path),
+            header->screen_width, header->screen_height, screen_size.width(), screen_size.height());
+        return QSharedPointer<MappedBundle>();
+    }
+
+    qint64 entries_end = (qint64)sizeof(BundleHeader) + (qint64)header->entry_count * (qint64)sizeof(BundleEntry);
+    if (entries_end > bundle->size || header->names_offset < entries_end
+            || (qint64)header->names_offset + header->names_size > bundle->size) {
+        nh_log("%s is truncated", qPrintable(path));
+        return QSharedPointer<MappedBundle>();
+    }
+
+    const char* names = reinterpret_cast<const char*>(bundle->data) + header->names_offset;
+    for (int i = 0; i < (int)header->entry_count; ++i) {
+        const BundleEntry &entry = entry_at(*bundle, i);
+        if (!is_entry_valid(entry, bundle->size) || (qint64)entry.name_offset + entry.name_size > header->names_size) {
+            nh_log("%s has a corrupted entry", qPrintable(path));
+            return QSharedPointer<MappedBundle>();
+        }
+
+        QString name = QString::fromUtf8(names + entry.name_offset, entry.name_size);
+        bundle->entries.insert(name, i);
+        bundle->folders[name.section('/', 0, -2)].append(name.section('/', -1));
+    }
+
+    bundle->root = root;
+    return bundle;
+}
+
+static QSharedPointer<MappedBundle> open_bundle() {
+    QMutexLocker locker(&bundle_mutex);
+    return current_bundle;
+}
+
+bool bundle_open(const QString &screensaver_path, QSize screen_size) {
+    QString root = QDir::cleanPath(screensaver_path);
+    QString path = root + '/' + BUNDLE_FILE_NAME;
+    QFileInfo info(path);
+    sleep_stats_count_fs(1);
+
+    QMutexLocker locker(&bundle_mutex);
+    if (!info.isFile()) {
+        current_bundle.clear();
+        checked_key.clear();
+        return false;
+    }
+
+    QString key = path
+        + '|' + QString::number(info.lastModified().toMSecsSinceEpoch())
+        + '|' + QString::number(info.size())
+        + '|' + QString::number(screen_size.width()) + 'x' + QString::number(screen_size.height());
+    if (key != checked_key) {
+        // Images still using the previous mapping keep it alive
+        checked_key = key;
+        current_bundle = map_bundle(path, root, screen_size);
+        sleep_stats_count_fs(1);
+        if (current_bundle) {
+            nh_log("Mapped %s with %d files", qPrintable(path), current_bundle->entries.size());
+        }
+    }
+
+    return !current_bundle.isNull();
+}
+
+bool bundle_list(const QString &dir_path, const QStringList &filters, QStringList &files) {
+    QSharedPointer<MappedBundle> bundle = open_bundle();
+    if (!bundle) {
+        return false;
+    }
+
+    QString path = QDir::cleanPath(dir_path);
+    QString folder;
+    if (path != bundle->root) {
+        if (!path.startsWith(bundle->root + '/')) {
+            return false;
+        }
+        folder = path.mid(bundle->root.size() + 1);
+    }
+
+    files.clear();
+    for (const QString &name : bundle->folders.value(folder)) {
+        if (QDir::match(filters, name)) {
+            files.append(name);
+        }
+    }
+
+    return true;
+}
+
+static void release_bundle(void* info) {
+    delete static_cast<QSharedPointer<MappedBundle>*>(info);
+}
+
+// Inflate one zlib stream into the pixels, then the extra data, which must fill both exactly
+static bool inflate_entry(const BundleEntry &entry, const uchar* data, uchar* pixels, char* extra) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit(&stream) != Z_OK) {
+        return false;
+    }
+
+    stream.next_in = const_cast<Bytef*>(data);
+    stream.avail_in = entry.data_size;
+
+    Bytef* outputs[2] = {pixels, reinterpret_cast<Bytef*>(extra)};
+    uInt sizes[2] = {(uInt)entry.bytes_per_line * entry.height, entry.extra_size};
+    int result = Z_OK;
+    for (int i = 0; i < 2 && result == Z_OK; ++i) {
+        stream.next_out = outputs[i];
+        stream.avail_out = sizes[i];
+        while (stream.avail_out > 0 && result == Z_OK) {
+            result = inflate(&stream, Z_NO_FLUSH);
+        }
+    }
+
+    bool is_complete = result == Z_STREAM_END;
+    if (result == Z_OK) {
+        // Both are full, the stream must end right there
+        Bytef spare;
+        stream.next_out = &spare;
+        stream.avail_out = 1;
+        is_complete = inflate(&stream, Z_FINISH) == Z_STREAM_END && stream.avail_out == 1;
+    }
+    is_complete = is_complete && stream.total_out == (uLong)sizes[0] + sizes[1];
+
+    inflateEnd(&stream);
+    return is_complete;
+}
+
+QImage bundle_image(const QString &file_path, QByteArray *extra) {
+    QSharedPointer<MappedBundle> bundle = open_bundle();
+    if (!bundle || !file_path.startsWith(bundle->root + '/')) {
+        return QImage();
+    }
+
+    int index = bundle->entries.value(file_path.mid(bundle->root.size() + 1), -1);
+    if (index < 0) {
+        return QImage();
+    }
+
+    const BundleEntry &entry = entry_at(*bundle, index);
+    if (entry.format == QImage::Format_Invalid) {
+        return QImage();
+    }
+
+    const uchar* data = bundle->data + entry.data_offset;
+    qint64 pixels_size = (qint64)entry.bytes_per_line * entry.height;
+    if (entry.compression == BUNDLE_COMPRESSION::Stored) {
+        if (extra) {
+            *extra = QByteArray(reinterpret_cast<const char*>(data) + pixels_size, entry.extra_size);
+        }
+
+        // The mapping stays alive as long as the image
+        return QImage(data, entry.width, entry.height, entry.bytes_per_line, (QImage::Format)entry.format,
+            release_bundle, new QSharedPointer<MappedBundle>(bundle));
+    }
+
+    QImage image(entry.width, entry.height, (QImage::Format)entry.format);
+    QByteArray extra_data(entry.extra_size, Qt::Uninitialized);
+    if (image.isNull() || image.bytesPerLine() != entry.bytes_per_line
+            || !inflate_entry(entry, data, image.bits(), extra_data.data())) {
+        nh_log("Couldn't inflate %s from the bundle", qPrintable(file_path));
+        return QImage();
+    }
+
+    if (extra) {
+        *extra = extra_data;
+    }
+
+    return image;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <QByteArray>
+#include <QImage>
+#include <QSize>
+#include <QString>
+#include <QStringList>
+
+// Screensaver files already scaled to one screen size, packed by tools/build_bundle into a single file
+// at the root of the screensaver folder. It's memory-mapped, so picking and loading a file needs no
+// folder scan and no decoding. When it's there, the loose files of the folders it covers are ignored.
+
+constexpr const char* BUNDLE_FILE_NAME = "screensaver.bundle";
+constexpr quint32 BUNDLE_MAGIC = 0x3142534e; // "NSB1"
+
+// Entry data is aligned for QImage and the NEON/SSE2 compositor
+constexpr int BUNDLE_ALIGNMENT = 64;
+
+enum BUNDLE_COMPRESSION {
+    Stored  = 0,
+    Deflate = 1,  // zlib stream of the pixels and the extra data
+};
+
+// Followed by `entry_count` entries, then the UTF-8 names
+struct BundleHeader {
+    quint32 magic;
+    quint32 entry_count;
+    qint32 screen_width;
+    qint32 screen_height;
+    quint32 names_offset;
+    quint32 names_size;
+    quint32 reserved[2];
+};
+static_assert(sizeof(BundleHeader) == 32, "BundleHeader is part of the file format");
+
+struct BundleEntry {
+    quint32 name_offset;     // path relative to the screensaver folder, in the names
+    quint32 name_size;
+    quint32 format;          // QImage::Format, Format_Invalid for a file without pixels like `cover`
+    qint32 width;
+    qint32 height;
+    qint32 bytes_per_line;
+    quint32 compression;     // BUNDLE_COMPRESSION
+    quint32 extra_size;      // data stored after the pixels, the spans of an overlay
+    qint64 data_offset;      // from the start of the file
+    qint64 data_size;        // stored bytes
+};
+static_assert(sizeof(BundleEntry) == 48, "BundleEntry is part of the file format");
+
+// Map the bundle of `screensaver_path` when it was built for `screen_size`, it's only remapped when it changes.
+// Returns false when there is none, then everything falls back to the loose files.
+bool bundle_open(const QString &screensaver_path, QSize screen_size);
+
+// Names of the files of `dir_path` matching `filters`, like QDir::entryList().
+// Returns false when the open bundle doesn't cover that folder.
+bool bundle_list(const QString &dir_path, const QStringList &filters, QStringList &files);
+
+// Pixels of `file_path` from the open bundle, mapped in place unless they're compressed.
+// Returns a null image when the bundle doesn't have it. `extra` receives the data stored with it.
+QImage bundle_image(const QString &file_path, QByteArray *extra = nullptr);
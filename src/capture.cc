@@ -0,0 +1,144 @@
+#include "capture.h"
+#include "area_scaler.h"
+#include "framebuffer.h"
+#include <NickelHook.h>
+
+#include <QElapsedTimer>
+#include <QGuiApplication>
+#include <QPainter>
+#include <QRegion>
+#include <QScreen>
+#include <QWidget>
+
+#include <cstring>
+
+constexpr const char* FRAMEBUFFER_PATH = "/dev/fb0";
+
+// The first framebuffer capture is compared with a rendered one on a grid of pixels
+constexpr int CHECK_STEP = 8;
+// Gray levels apart, the panel only shows 16 of them
+constexpr int CHECK_TOLERANCE = 32;
+constexpr int CHECK_MAX_MISMATCH_PERCENT = 5;
+// Share of dark pixels a page needs for the comparison to tell anything
+constexpr int CHECK_MIN_INK_PERCENT = 1;
+
+enum FRAMEBUFFER_STATE {
+    Unchecked = 0,
+    Matches   = 1,  // shows the same page as a rendered capture
+    Differs   = 2,  // can't be read, or lays the page out some other way
+};
+
+static int framebuffer_state = FRAMEBUFFER_STATE::Unchecked;
+// Screen the state was found for, it's checked again when the screen changes
+static QSize framebuffer_screen;
+
+static bool render_view(QWidget *view, QImage &frame) {
+    // Render the whole window under the view, like grabbing that part of the screen
+    QWidget *window = view->window();
+    QRect source(view->mapTo(window, QPoint(0, 0)), view->size());
+
+    QPainter painter(&frame);
+    window->render(&painter, QPoint(0, 0), QRegion(source), QWidget::DrawWindowBackground | QWidget::DrawChildren);
+
+    return painter.end();
+}
+
+// Returns Matches or Differs when `captured` and `rendered` tell, Unchecked when the page is too blank to tell
+static int compare_captures(const QImage &captured, const QImage &rendered) {
+    int samples = 0;
+    int mismatches = 0;
+    int ink = 0;
+    for (int y = CHECK_STEP / 2; y < rendered.height(); y += CHECK_STEP) {
+        const QRgb* captured_row = reinterpret_cast<const QRgb*>(captured.constScanLine(y));
+        const QRgb* rendered_row = reinterpret_cast<const QRgb*>(rendered.constScanLine(y));
+        for (int x = CHECK_STEP / 2; x < rendered.width(); x += CHECK_STEP) {
+            int gray = qGray(rendered_row[x]);
+            samples++;
+            ink += gray < 128;
+            mismatches += qAbs(qGray(captured_row[x]) - gray) > CHECK_TOLERANCE;
+        }
+    }
+
+    if (ink * 100 < samples * CHECK_MIN_INK_PERCENT) {
+        return FRAMEBUFFER_STATE::Unchecked;
+    }
+
+    return mismatches * 100 <= samples * CHECK_MAX_MISMATCH_PERCENT ? FRAMEBUFFER_STATE::Matches : FRAMEBUFFER_STATE::Differs;
+}
+
+// Read the page from the framebuffer once it's known to show it like Nickel renders it.
+// The first time, the page is also rendered: it's kept and the framebuffer isn't used anymore when they differ.
+static bool capture_framebuffer(QWidget *view, QImage &frame) {
+    QSize screen_size = QGuiApplication::primaryScreen()->size();
+    if (screen_size != framebuffer_screen) {
+        framebuffer_screen = screen_size;
+        framebuffer_state = FRAMEBUFFER_STATE::Unchecked;
+    }
+    if (framebuffer_state == FRAMEBUFFER_STATE::Differs) {
+        return false;
+    }
+
+    QRect region(view->mapToGlobal(QPoint(0, 0)), view->size());
+    if (!framebuffer_capture(FRAMEBUFFER_PATH, screen_size, region, frame)) {
+        nh_log("Couldn't read %s, the page is rendered from now on", FRAMEBUFFER_PATH);
+        framebuffer_state = FRAMEBUFFER_STATE::Differs;
+        return false;
+    }
+    if (framebuffer_state == FRAMEBUFFER_STATE::Matches) {
+        return true;
+    }
+
+    QImage rendered(frame.size(), QImage::Format_RGB32);
+    if (rendered.isNull() || !render_view(view, rendered)) {
+        return true;
+    }
+
+    framebuffer_state = compare_captures(frame, rendered);
+    if (framebuffer_state == FRAMEBUFFER_STATE::Matches) {
+        nh_log("%s shows the page like it's rendered, it's read from now on", FRAMEBUFFER_PATH);
+        return true;
+    }
+    if (framebuffer_state == FRAMEBUFFER_STATE::Differs) {
+        nh_log("%s doesn't show the page like it's rendered, the page is rendered from now on", FRAMEBUFFER_PATH);
+    }
+
+    // Same size and format, the frame keeps its buffer
+    memcpy(frame.bits(), rendered.constBits(), frame.byteCount());
+    return true;
+}
+
+// Capture at the view size, then average it down to cover `frame`
+static bool capture_scaled(QWidget *view, QImage &frame, int source) {
+    QImage page(view->size(), QImage::Format_RGB32);
+    if (page.isNull() || !capture_view(view, page, source)) {
+        return false;
+    }
+
+    area_scale_into(page, view->size().scaled(frame.size(), Qt::KeepAspectRatioByExpanding), frame);
+    return true;
+}
+
+bool capture_view(QWidget *view, QImage &frame, int source) {
+    if (view->size().isEmpty() || frame.isNull()) {
+        return false;
+    }
+    if (view->size() != frame.size()) {
+        return capture_scaled(view, frame, source);
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    if (source == CAPTURE_SOURCE::Framebuffer && capture_framebuffer(view, frame)) {
+        nh_log("Captured %s from %s in %lld ms", qPrintable(view->objectName()), FRAMEBUFFER_PATH, timer.elapsed());
+        return true;
+    }
+
+    if (!render_view(view, frame)) {
+        nh_log("Couldn't capture %s", qPrintable(view->objectName()));
+        return false;
+    }
+
+    nh_log("Rendered %s in %lld ms", qPrintable(view->objectName()), timer.elapsed());
+    return true;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <QImage>
+
+class QWidget;
+
+enum CAPTURE_SOURCE {
+    Framebuffer = 0,  // Read the page from /dev/fb0, once it's checked to show the page like it's rendered
+    Render      = 1,  // Paint the widgets again
+};
+
+// Copy what is shown in `view` straight into `frame`, scaled to cover it.
+// `frame` should be a detached RGB32 buffer, so no other full-screen image is allocated.
+// When the view size differs, the page is captured at that size first and area-averaged into `frame`.
+// Falls back to rendering the widgets when the framebuffer can't be read or doesn't show the page the same way,
+// which is checked against a rendered capture the first time.
+bool capture_view(QWidget *view, QImage &frame, int source);
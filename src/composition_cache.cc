@@ -0,0 +1,138 @@
+#include "composition_cache.h"
+#include "frame_pool.h"
+#include <NickelHook.h>
+
+#include <QCryptographicHash>
+#include <QList>
+
+// A frame and the layer below it, for the last combination. Each one is 10 MB on 1404x1872 screens.
+constexpr int MEMORY_ENTRIES = 2;
+
+struct CompositionEntry {
+    QString key;
+    QImage image;
+    QPixmap pixmap;
+};
+
+static bool cache_enabled = true;
+// Most recently used first
+static QList<CompositionEntry> memory_entries;
+
+static void drop_last() {
+    CompositionEntry entry = memory_entries.takeLast();
+    frame_pool_release(entry.image);
+}
+
+static void remember(const CompositionEntry &entry) {
+    if (!cache_enabled) {
+        return;
+    }
+
+    for (int i = 0; i < memory_entries.size(); ++i) {
+        if (memory_entries.at(i).key == entry.key) {
+            memory_entries.removeAt(i);
+            break;
+        }
+    }
+
+    memory_entries.prepend(entry);
+    while (memory_entries.size() > MEMORY_ENTRIES) {
+        drop_last();
+    }
+}
+
+// Moves the entry of `key` to the front, returns null when it isn't there
+static const CompositionEntry* find(const QString &key) {
+    if (key.isEmpty()) {
+        return nullptr;
+    }
+
+    for (int i = 0; i < memory_entries.size(); ++i) {
+        if (memory_entries.at(i).key == key) {
+            memory_entries.move(i, 0);
+            return &memory_entries.first();
+        }
+    }
+
+    return nullptr;
+}
+
+void composition_cache_configure(bool enabled) {
+    cache_enabled = enabled;
+    if (!enabled) {
+        composition_cache_clear();
+    }
+}
+
+QString composition_cache_key(const char* operation, const QStringList &inputs) {
+    QString identity = QString::fromLatin1(operation) + '|' + inputs.join('|');
+    return QString::fromLatin1(QCryptographicHash::hash(identity.toUtf8(), QCryptographicHash::Md5).toHex());
+}
+
+bool composition_cache_contains(const QString &key) {
+    if (key.isEmpty()) {
+        return false;
+    }
+
+    for (const CompositionEntry &entry : memory_entries) {
+        if (entry.key == key) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+QImage composition_cache_lookup(const QString &key) {
+    const CompositionEntry* entry = find(key);
+    if (!entry || entry->image.isNull()) {
+        return QImage();
+    }
+
+    nh_log("Composited layer found in memory");
+    return entry->image;
+}
+
+QPixmap composition_cache_lookup_pixmap(const QString &key) {
+    const CompositionEntry* entry = find(key);
+    if (!entry || entry->pixmap.isNull()) {
+        return QPixmap();
+    }
+
+    nh_log("Composited overlay found in memory");
+    return entry->pixmap;
+}
+
+void composition_cache_insert(const QString &key, const QImage &image) {
+    if (!key.isEmpty() && !image.isNull()) {
+        remember({key, image, QPixmap()});
+    }
+}
+
+void composition_cache_insert(const QString &key, const QPixmap &pixmap) {
+    if (!key.isEmpty() && !pixmap.isNull()) {
+        remember({key, QImage(), pixmap});
+    }
+}
+
+void composition_cache_clear() {
+    composition_cache_trim(0);
+}
+
+void composition_cache_trim(int max_entries) {
+    while (memory_entries.size() > qMax(0, max_entries)) {
+        drop_last();
+    }
+}
+
+qint64 composition_cache_bytes() {
+    qint64 bytes = 0;
+    for (const CompositionEntry &entry : memory_entries) {
+        bytes += entry.image.byteCount();
+        if (!entry.pixmap.isNull()) {
+            bytes += (qint64)entry.pixmap.width() * entry.pixmap.height() * entry.pixmap.depth() / 8;
+        }
+    }
+
+    return bytes;
+}
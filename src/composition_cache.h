@@ -0,0 +1,34 @@
+#pragma once
+
+#include <QImage>
+#include <QPixmap>
+#include <QString>
+#include <QStringList>
+
+// Layers made by compositing, kept in memory by the identity of everything they were made from:
+// the wallpaper blended with the color overlay, the whole frame, or the overlay of cover mode.
+// Only the most recently used ones are kept, each one is a full-screen buffer.
+// Only used from the GUI thread.
+
+void composition_cache_configure(bool enabled);
+
+// Key of the layer made by `operation` from `inputs`, the keys of the files and layers below it and the settings it uses
+QString composition_cache_key(const char* operation, const QStringList &inputs);
+
+bool composition_cache_contains(const QString &key);
+
+// Return a null image or pixmap on miss
+QImage composition_cache_lookup(const QString &key);
+QPixmap composition_cache_lookup_pixmap(const QString &key);
+
+void composition_cache_insert(const QString &key, const QImage &image);
+void composition_cache_insert(const QString &key, const QPixmap &pixmap);
+
+// Drop every layer, their buffers go back to the frame pool
+void composition_cache_clear();
+
+// Drop the least recently used layers until at most `max_entries` are left
+void composition_cache_trim(int max_entries);
+
+// Bytes held by the cached layers
+qint64 composition_cache_bytes();
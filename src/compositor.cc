@@ -0,0 +1,486 @@
+#include "compositor.h"
+#include "area_scaler.h"
+#include "frame_pool.h"
+
+#include <QPainter>
+#include <QVector>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+// Number of gray levels of e-ink panels
+constexpr int GRAY_LEVELS = 16;
+
+static const uchar BAYER_8X8[8][8] = {
+    { 0, 32,  8, 40,  2, 34, 10, 42},
+    {48, 16, 56, 24, 50, 18, 58, 26},
+    {12, 44,  4, 36, 14, 46,  6, 38},
+    {60, 28, 52, 20, 62, 30, 54, 22},
+    { 3, 35, 11, 43,  1, 33,  9, 41},
+    {51, 19, 59, 27, 49, 17, 57, 25},
+    {15, 47,  7, 39, 13, 45,  5, 37},
+    {63, 31, 55, 23, 61, 29, 53, 21},
+};
+
+QVector<OverlaySpan> overlay_spans(const QImage &overlay) {
+    QVector<OverlaySpan> rows(overlay.height());
+    if (overlay.format() != QImage::Format_ARGB32_Premultiplied || overlay.width() > 0xffff) {
+        // Everything is blended
+        for (OverlaySpan &span : rows) {
+            span = {0, (quint16)qMin(overlay.width(), 0xffff), 0, 0};
+        }
+        return rows;
+    }
+
+    int width = overlay.width();
+    for (int y = 0; y < overlay.height(); ++y) {
+        const QRgb* row = reinterpret_cast<const QRgb*>(overlay.constScanLine(y));
+        int left = 0;
+        while (left < width && qAlpha(row[left]) == 0) {
+            left++;
+        }
+        int right = width;
+        while (right > left && qAlpha(row[right - 1]) == 0) {
+            right--;
+        }
+
+        bool is_opaque = true;
+        for (int x = left; x < right && is_opaque; ++x) {
+            is_opaque = qAlpha(row[x]) == 255;
+        }
+
+        rows[y] = {(quint16)left, (quint16)right, (quint16)(is_opaque && left < right), 0};
+    }
+
+    return rows;
+}
+
+void composite_layers(QPaintDevice *backing, QSize screen_size, const QImage &base_image, const QPixmap &base_pixmap, const QColor &color_overlay, const QImage &overlay) {
+    QPainter painter(backing); // this will copy the image data if it's referenced somewhere else
+    painter.setRenderHint(QPainter::SmoothPixmapTransform, false);
+
+    // Draw wallpaper
+    if (!base_image.isNull()) {
+        painter.drawImage(0, 0, base_image);
+    } else if (!base_pixmap.isNull()) {
+        if (base_pixmap.size() != screen_size) {
+            // Only scale if size mismatch
+            painter.drawImage(0, 0, area_scale(base_pixmap.toImage(), screen_size));
+        } else {
+            painter.drawPixmap(0, 0, base_pixmap);
+        }
+    }
+
+    // Draw color overlay layer
+    if (color_overlay.isValid() && color_overlay.alpha() > 0) {
+        painter.fillRect(0, 0, screen_size.width(), screen_size.height(), color_overlay);
+    }
+
+    // Draw image overlay
+    if (!overlay.isNull()) {
+        painter.drawImage(0, 0, overlay);
+    }
+
+    painter.end();
+}
+
+static const QVector<QRgb> &gray_color_table() {
+    static QVector<QRgb> table;
+    if (table.isEmpty()) {
+        for (int i = 0; i < 256; ++i) {
+            table.append(qRgb(i, i, i));
+        }
+    }
+
+    return table;
+}
+
+static inline int luma(QRgb color) {
+    return (qRed(color) * 77 + qGreen(color) * 150 + qBlue(color) * 29) >> 8;
+}
+
+// x / 255 for x in [0, 255 * 255]
+static inline int div255(int x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+// Convert `source` to luma in the top-left corner of `frame`, over a white background
+static void fill_gray(QImage &frame, QImage source) {
+    QSize size = frame.size();
+    if (source.format() != QImage::Format_RGB32 && source.format() != QImage::Format_ARGB32_Premultiplied) {
+        source = source.convertToFormat(source.hasAlphaChannel() ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32);
+    }
+
+    int width = qMin(size.width(), source.width());
+    int height = qMin(size.height(), source.height());
+    for (int y = 0; y < height; ++y) {
+        const QRgb* src = reinterpret_cast<const QRgb*>(source.constScanLine(y));
+        uchar* dst = frame.scanLine(y);
+        for (int x = 0; x < width; ++x) {
+            // Alpha is 255 in RGB32
+            dst[x] = luma(src[x]) + 255 - qAlpha(src[x]);
+        }
+    }
+}
+
+static void blend_color(QImage &frame, const QColor &color) {
+    int alpha = color.alpha();
+    int gray = luma(color.rgb());
+
+    uchar lut[256];
+    for (int v = 0; v < 256; ++v) {
+        lut[v] = div255(v * (255 - alpha) + gray * alpha);
+    }
+
+    int width = frame.width();
+    for (int y = 0; y < frame.height(); ++y) {
+        uchar* row = frame.scanLine(y);
+        for (int x = 0; x < width; ++x) {
+            row[x] = lut[row[x]];
+        }
+    }
+}
+
+QByteArray overlay_gray_planes(const QImage &overlay) {
+    QImage source = overlay.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    int width = source.width();
+    int height = source.height();
+
+    QByteArray planes(width * height * 2, Qt::Uninitialized);
+    uchar* dst = reinterpret_cast<uchar*>(planes.data());
+    for (int y = 0; y < height; ++y) {
+        const QRgb* src = reinterpret_cast<const QRgb*>(source.constScanLine(y));
+        for (int x = 0; x < width; ++x) {
+            *dst++ = luma(src[x]);
+            *dst++ = qAlpha(src[x]);
+        }
+    }
+
+    return planes;
+}
+
+static void blend_overlay(QImage &frame, const QImage &overlay, QByteArray planes, const OverlaySpan* rows) {
+    int stride = overlay.width();
+    if (planes.size() != stride * overlay.height() * 2) {
+        planes = overlay_gray_planes(overlay);
+    }
+
+    int width = qMin(frame.width(), overlay.width());
+    int height = qMin(frame.height(), overlay.height());
+    const uchar* data = reinterpret_cast<const uchar*>(planes.constData());
+    for (int y = 0; y < height; ++y) {
+        uchar* row = frame.scanLine(y);
+        const uchar* src = data + y * stride * 2;
+        int left = rows ? qMin((int)rows[y].left, width) : 0;
+        int right = rows ? qMin((int)rows[y].right, width) : width;
+        for (int x = left; x < right; ++x) {
+            row[x] = src[2 * x] + div255(row[x] * (255 - src[2 * x + 1]));
+        }
+    }
+}
+
+static void quantize(QImage &frame, int dither) {
+    int width = frame.width();
+    int height = frame.height();
+    constexpr int step = 255 / (GRAY_LEVELS - 1);
+
+    if (dither == DITHER_MODE::Ordered) {
+        // Thresholds spread over (0, 255)
+        int thresholds[8][8];
+        for (int i = 0; i < 8; ++i) {
+            for (int j = 0; j < 8; ++j) {
+                thresholds[i][j] = (2 * BAYER_8X8[i][j] + 1) * 255 / 128;
+            }
+        }
+
+        for (int y = 0; y < height; ++y) {
+            uchar* row = frame.scanLine(y);
+            const int* threshold = thresholds[y & 7];
+            for (int x = 0; x < width; ++x) {
+                row[x] = (row[x] * (GRAY_LEVELS - 1) + threshold[x & 7]) / 255 * step;
+            }
+        }
+    } else if (dither == DITHER_MODE::Diffusion) {
+        // Errors in 1/16 units, with one pixel of padding on each side
+        std::vector<int> errors(2 * (width + 2), 0);
+        int* current = errors.data() + 1;
+        int* next = current + width + 2;
+
+        for (int y = 0; y < height; ++y) {
+            uchar* row = frame.scanLine(y);
+            std::fill(next - 1, next + width + 1, 0);
+
+            for (int x = 0; x < width; ++x) {
+                int value = qBound(0, row[x] * 16 + current[x], 255 * 16);
+                int level = (value * (GRAY_LEVELS - 1) + 255 * 8) / (255 * 16);
+                int error = value - level * step * 16;
+
+                row[x] = level * step;
+                current[x + 1] += error * 7 / 16;
+                next[x - 1] += error * 3 / 16;
+                next[x] += error * 5 / 16;
+                next[x + 1] += error / 16;
+            }
+
+            std::swap(current, next);
+        }
+    } else {
+        for (int y = 0; y < height; ++y) {
+            uchar* row = frame.scanLine(y);
+            for (int x = 0; x < width; ++x) {
+                row[x] = (row[x] * (GRAY_LEVELS - 1) + 127) / 255 * step;
+            }
+        }
+    }
+}
+
+QImage composite_grayscale(QSize screen_size, const QImage &base, const QColor &color_overlay, const QImage &overlay, int dither,
+        const QByteArray &overlay_planes, const OverlaySpan* overlay_rows) {
+    QImage frame = frame_pool_acquire(screen_size, QImage::Format_Indexed8);
+    frame.setColorTable(gray_color_table());
+    frame.fill(255);
+
+    if (!base.isNull()) {
+        fill_gray(frame, base);
+    }
+
+    if (color_overlay.isValid() && color_overlay.alpha() > 0) {
+        blend_color(frame, color_overlay);
+    }
+
+    if (!overlay.isNull()) {
+        blend_overlay(frame, overlay, overlay_planes, overlay_rows);
+    }
+
+    quantize(frame, dither);
+    return frame;
+}
+
+// Color overlay layer for the fused compositor, channels are premultiplied but not divided by 255
+struct ColorLayer {
+    int inverse_alpha;
+    int red;
+    int green;
+    int blue;
+};
+
+// Rounded x / 255 for x in [0, 255 * 255]
+static inline int div255_round(int x) {
+    return (x + ((x + 128) >> 8) + 128) >> 8;
+}
+
+// Base over white, then the color layer, then the premultiplied overlay
+static void blend_row_scalar(QRgb* dst, const QRgb* base, const QRgb* overlay, int count, const ColorLayer &color) {
+    for (int i = 0; i < count; ++i) {
+        QRgb b = base[i];
+        QRgb o = overlay[i];
+        int white = 255 - qAlpha(b);
+        int inverse_overlay_alpha = 255 - qAlpha(o);
+
+        int red = div255_round((qRed(b) + white) * color.inverse_alpha + color.red);
+        int green = div255_round((qGreen(b) + white) * color.inverse_alpha + color.green);
+        int blue = div255_round((qBlue(b) + white) * color.inverse_alpha + color.blue);
+
+        dst[i] = qRgb(
+            qRed(o) + div255_round(red * inverse_overlay_alpha),
+            qGreen(o) + div255_round(green * inverse_overlay_alpha),
+            qBlue(o) + div255_round(blue * inverse_overlay_alpha)
+        );
+    }
+}
+
+#if (defined(__ARM_NEON__) || defined(__ARM_NEON)) && Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+#include <arm_neon.h>
+
+static inline uint8x8_t blend_channel_neon(uint8x8_t p, uint8x8_t inverse_alpha, uint16x8_t color, uint8x8_t o, uint8x8_t inverse_overlay_alpha) {
+    // vraddhn(t, vrshr(t, 8)) is the same rounded division as div255_round()
+    uint16x8_t t = vmlal_u8(color, p, inverse_alpha);
+    p = vraddhn_u16(t, vrshrq_n_u16(t, 8));
+    t = vmull_u8(p, inverse_overlay_alpha);
+    return vadd_u8(o, vraddhn_u16(t, vrshrq_n_u16(t, 8)));
+}
+
+static void blend_row(QRgb* dst, const QRgb* base, const QRgb* overlay, int count, const ColorLayer &color) {
+    const uint8x8_t v255 = vdup_n_u8(255);
+    const uint8x8_t inverse_alpha = vdup_n_u8(color.inverse_alpha);
+    const uint16x8_t red = vdupq_n_u16(color.red);
+    const uint16x8_t green = vdupq_n_u16(color.green);
+    const uint16x8_t blue = vdupq_n_u16(color.blue);
+
+    // 8 pixels at a time, deinterleaved into B, G, R, A
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        uint8x8x4_t b = vld4_u8(reinterpret_cast<const uint8_t*>(base + i));
+        uint8x8x4_t o = vld4_u8(reinterpret_cast<const uint8_t*>(overlay + i));
+        uint8x8_t white = vsub_u8(v255, b.val[3]);
+        uint8x8_t inverse_overlay_alpha = vsub_u8(v255, o.val[3]);
+
+        uint8x8x4_t out;
+        out.val[0] = blend_channel_neon(vadd_u8(b.val[0], white), inverse_alpha, blue, o.val[0], inverse_overlay_alpha);
+        out.val[1] = blend_channel_neon(vadd_u8(b.val[1], white), inverse_alpha, green, o.val[1], inverse_overlay_alpha);
+        out.val[2] = blend_channel_neon(vadd_u8(b.val[2], white), inverse_alpha, red, o.val[2], inverse_overlay_alpha);
+        out.val[3] = v255;
+        vst4_u8(reinterpret_cast<uint8_t*>(dst + i), out);
+    }
+
+    blend_row_scalar(dst + i, base + i, overlay + i, count - i, color);
+}
+
+#elif defined(__SSE2__) && Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+#include <emmintrin.h>
+
+static inline __m128i div255_round_sse2(__m128i t) {
+    const __m128i round = _mm_set1_epi16(128);
+    return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(t, _mm_srli_epi16(_mm_add_epi16(t, round), 8)), round), 8);
+}
+
+static inline __m128i broadcast_alpha_sse2(__m128i x) {
+    x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(3, 3, 3, 3));
+    return _mm_shufflehi_epi16(x, _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+// 2 pixels unpacked to 16-bit lanes. Every product stays below 65536, so unsigned math in epi16 lanes is safe.
+static inline __m128i blend_pixels_sse2(__m128i b, __m128i o, __m128i inverse_alpha, __m128i color) {
+    const __m128i v255 = _mm_set1_epi16(255);
+    __m128i p = _mm_add_epi16(b, _mm_sub_epi16(v255, broadcast_alpha_sse2(b)));
+    p = div255_round_sse2(_mm_add_epi16(_mm_mullo_epi16(p, inverse_alpha), color));
+    __m128i inverse_overlay_alpha = _mm_sub_epi16(v255, broadcast_alpha_sse2(o));
+    return _mm_add_epi16(o, div255_round_sse2(_mm_mullo_epi16(p, inverse_overlay_alpha)));
+}
+
+static void blend_row(QRgb* dst, const QRgb* base, const QRgb* overlay, int count, const ColorLayer &color) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i inverse_alpha = _mm_set1_epi16(color.inverse_alpha);
+    // Alpha ends up at 255 because the base is composited over white
+    const short alpha = (short)(255 * (255 - color.inverse_alpha));
+    const __m128i color_lanes = _mm_set_epi16(
+        alpha, (short)color.red, (short)color.green, (short)color.blue,
+        alpha, (short)color.red, (short)color.green, (short)color.blue
+    );
+
+    // 4 pixels at a time
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(base + i));
+        __m128i o = _mm_loadu_si128(reinterpret_cast<const __m128i*>(overlay + i));
+        __m128i low = blend_pixels_sse2(_mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(o, zero), inverse_alpha, color_lanes);
+        __m128i high = blend_pixels_sse2(_mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(o, zero), inverse_alpha, color_lanes);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(low, high));
+    }
+
+    blend_row_scalar(dst + i, base + i, overlay + i, count - i, color);
+}
+
+#else
+
+static void blend_row(QRgb* dst, const QRgb* base, const QRgb* overlay, int count, const ColorLayer &color) {
+    blend_row_scalar(dst, base, overlay, count, color);
+}
+
+#endif
+
+// Row of `layer` padded with `fill` when the layer doesn't cover the whole frame width
+static const QRgb* layer_row(const QImage &layer, int y, int width, QRgb fill, std::vector<QRgb> &scratch) {
+    if (layer.isNull() || y >= layer.height()) {
+        std::fill(scratch.begin(), scratch.end(), fill);
+        return scratch.data();
+    }
+
+    const QRgb* row = reinterpret_cast<const QRgb*>(layer.constScanLine(y));
+    if (layer.width() >= width) {
+        return row;
+    }
+
+    std::copy(row, row + layer.width(), scratch.begin());
+    std::fill(scratch.begin() + layer.width(), scratch.end(), fill);
+    return scratch.data();
+}
+
+// Parts of a row without overlay are the base and the color layer only
+static void blend_uncovered(QRgb* dst, const QRgb* base, int count, const ColorLayer &color, bool is_base_opaque, const QRgb* transparent) {
+    if (count <= 0) {
+        return;
+    }
+
+    if (is_base_opaque && color.inverse_alpha == 255) {
+        if (dst != base) {
+            memcpy(dst, base, count * sizeof(QRgb));
+        }
+        return;
+    }
+
+    blend_row(dst, base, transparent, count, color);
+}
+
+void composite_fused(QImage &frame, const QImage &base, const QColor &color_overlay, const QImage &overlay, const OverlaySpan* overlay_rows) {
+    int width = frame.width();
+    int height = frame.height();
+
+    // Blended in place when the base is the frame itself, holding another reference would copy it
+    bool in_place = &base == &frame;
+    uchar* bits = frame.bits();
+    int bytes_per_line = frame.bytesPerLine();
+
+    QImage base_layer = in_place ? QImage() : base;
+    if (!base_layer.isNull() && base_layer.format() != QImage::Format_RGB32 && base_layer.format() != QImage::Format_ARGB32_Premultiplied) {
+        base_layer = base_layer.convertToFormat(base_layer.hasAlphaChannel() ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32);
+    }
+
+    QImage overlay_layer = overlay;
+    if (!overlay_layer.isNull() && overlay_layer.format() != QImage::Format_ARGB32_Premultiplied) {
+        overlay_layer = overlay_layer.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    }
+
+    ColorLayer color = {255, 0, 0, 0};
+    if (color_overlay.isValid() && color_overlay.alpha() > 0) {
+        int alpha = color_overlay.alpha();
+        color.inverse_alpha = 255 - alpha;
+        color.red = color_overlay.red() * alpha;
+        color.green = color_overlay.green() * alpha;
+        color.blue = color_overlay.blue() * alpha;
+    }
+
+    std::vector<QRgb> base_scratch(width);
+    std::vector<QRgb> overlay_scratch(width);
+
+    // Spans only describe the overlay they were made for
+    if (overlay_layer.isNull() || overlay_layer.constBits() != overlay.constBits()) {
+        overlay_rows = nullptr;
+    }
+    // RGB32 pixels are opaque, so is the white filling the missing parts
+    bool is_base_opaque = in_place || base_layer.isNull() || base_layer.format() == QImage::Format_RGB32;
+    std::vector<QRgb> transparent(overlay_rows ? width : 0, 0);
+
+    for (int y = 0; y < height; ++y) {
+        QRgb* frame_row = reinterpret_cast<QRgb*>(bits + y * bytes_per_line);
+        // Missing parts of the base are white, missing parts of the overlay are transparent
+        const QRgb* base_row = in_place ? frame_row : layer_row(base_layer, y, width, 0xffffffff, base_scratch);
+
+        if (!overlay_rows) {
+            const QRgb* overlay_row = layer_row(overlay_layer, y, width, 0x00000000, overlay_scratch);
+            blend_row(frame_row, base_row, overlay_row, width, color);
+            continue;
+        }
+
+        // Only the visible span of the overlay is blended, or copied when it's opaque
+        int left = 0;
+        int right = 0;
+        if (y < overlay_layer.height()) {
+            left = qMin((int)overlay_rows[y].left, width);
+            right = qMin((int)overlay_rows[y].right, width);
+        }
+
+        blend_uncovered(frame_row, base_row, left, color, is_base_opaque, transparent.data());
+        if (left < right) {
+            const QRgb* overlay_row = reinterpret_cast<const QRgb*>(overlay_layer.constScanLine(y));
+            if (overlay_rows[y].is_opaque) {
+                memcpy(frame_row + left, overlay_row + left, (right - left) * sizeof(QRgb));
+            } else {
+                blend_row(frame_row + left, base_row + left, overlay_row + left, right - left, color);
+            }
+        }
+        blend_uncovered(frame_row + right, base_row + right, width - right, color, is_base_opaque, transparent.data());
+    }
+}
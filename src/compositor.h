@@ -0,0 +1,44 @@
+#pragma once
+
+#include <QColor>
+#include <QImage>
+#include <QPaintDevice>
+#include <QPixmap>
+#include <QVector>
+
+enum DITHER_MODE {
+    Off       = 0,
+    Ordered   = 1,  // 8x8 Bayer matrix
+    Diffusion = 2,  // Floyd-Steinberg
+};
+
+// Part of an overlay row that isn't fully transparent
+struct OverlaySpan {
+    quint16 left;
+    quint16 right;      // left == right when the whole row is transparent
+    quint16 is_opaque;  // every pixel in [left, right) is opaque
+    quint16 reserved;
+};
+
+// One span per row of a premultiplied overlay
+QVector<OverlaySpan> overlay_spans(const QImage &overlay);
+
+// Paint the layers on top of each other with QPainter.
+// `base_image` takes precedence over `base_pixmap`, both can be null.
+// `color_overlay` is skipped when it's invalid or fully transparent.
+void composite_layers(QPaintDevice *backing, QSize screen_size, const QImage &base_image, const QPixmap &base_pixmap, const QColor &color_overlay, const QImage &overlay);
+
+// Same layers blended in a single pass per row into an RGB32 `frame`, with NEON or SSE2 when available.
+// The result is within 2 levels per channel of composite_layers(), which rounds its blending differently.
+// `base` can be `frame` itself, to blend an RGB32 frame in place.
+// With the `overlay_rows` of the overlay, its transparent parts aren't blended and its opaque parts are copied.
+void composite_fused(QImage &frame, const QImage &base, const QColor &color_overlay, const QImage &overlay, const OverlaySpan* overlay_rows = nullptr);
+
+// Premultiplied luma and alpha of every pixel of `overlay`, interleaved, for composite_grayscale()
+QByteArray overlay_gray_planes(const QImage &overlay);
+
+// Same layers blended in 8-bit grayscale, then quantized to the 16 gray levels of e-ink panels.
+// Returns an Indexed8 image with a gray color table, taken from the frame pool.
+// `overlay_planes` are made from `overlay` when they are empty, `overlay_rows` skip its transparent parts.
+QImage composite_grayscale(QSize screen_size, const QImage &base, const QColor &color_overlay, const QImage &overlay, int dither,
+    const QByteArray &overlay_planes = QByteArray(), const OverlaySpan* overlay_rows = nullptr);
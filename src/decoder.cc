@@ -0,0 +1,485 @@
+#include "decoder.h"
+#include "area_scaler.h"
+#include <NickelHook.h>
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QImageReader>
+
+#include <zlib.h>
+
+#include <cstring>
+#include <memory>
+#include <vector>
+
+static const uchar PNG_SIGNATURE[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+// Larger PNG files are rejected, even a budget of several GB couldn't hold them
+constexpr int PNG_MAX_DIMENSION = 1 << 16;
+// Size of the blocks of compressed data read from PNG files
+constexpr int PNG_READ_SIZE = 64 * 1024;
+// Rough memory used by zlib to inflate a stream
+constexpr qint64 INFLATE_MEMORY = 48 * 1024;
+
+static qint64 decode_budget = 48 * 1024 * 1024;
+
+void decoder_configure(qint64 budget) {
+    decode_budget = budget;
+}
+
+static bool fits_budget(const QString &file_path, QSize source_size, qint64 bytes) {
+    if (bytes <= decode_budget) {
+        return true;
+    }
+
+    nh_log("Skipped %s (%dx%d), decoding it needs %lld KB but the budget is %lld KB",
+        qPrintable(file_path), source_size.width(), source_size.height(), bytes / 1024, decode_budget / 1024);
+    return false;
+}
+
+struct PngInfo {
+    int width = 0;
+    int height = 0;
+    int bit_depth = 0;
+    int color_type = 0;
+    int interlace = 0;
+    int channels = 0;
+
+    uchar palette[256][3];
+    int palette_size = 0;
+    uchar palette_alpha[256];
+    int palette_alpha_size = 0;
+
+    // Gray or RGB value that is fully transparent, from the tRNS chunk
+    bool has_transparent_color = false;
+    int transparent_color[3];
+
+    bool has_alpha() const {
+        return color_type == 4 || color_type == 6 || palette_alpha_size > 0 || has_transparent_color;
+    }
+};
+
+static inline quint32 read_be32(const uchar* data) {
+    return ((quint32)data[0] << 24) | ((quint32)data[1] << 16) | ((quint32)data[2] << 8) | data[3];
+}
+
+static bool parse_png_header(PngInfo &png, const uchar* data) {
+    png.width = read_be32(data);
+    png.height = read_be32(data + 4);
+    png.bit_depth = data[8];
+    png.color_type = data[9];
+    png.interlace = data[12];
+
+    if (png.width <= 0 || png.height <= 0 || png.width > PNG_MAX_DIMENSION || png.height > PNG_MAX_DIMENSION) {
+        return false;
+    }
+
+    int depth = png.bit_depth;
+    switch (png.color_type) {
+        case 0:
+            png.channels = 1;
+            return depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16;
+        case 3:
+            png.channels = 1;
+            return depth == 1 || depth == 2 || depth == 4 || depth == 8;
+        case 2:
+            png.channels = 3;
+            break;
+        case 4:
+            png.channels = 2;
+            break;
+        case 6:
+            png.channels = 4;
+            break;
+        default:
+            return false;
+    }
+
+    return depth == 8 || depth == 16;
+}
+
+// Raw value of sample `index` in a row
+static inline int read_sample(const uchar* data, int index, int depth) {
+    switch (depth) {
+        case 8:
+            return data[index];
+        case 16:
+            return (data[index * 2] << 8) | data[index * 2 + 1];
+        default: {
+            int bit = index * depth;
+            return (data[bit >> 3] >> (8 - depth - (bit & 7))) & ((1 << depth) - 1);
+        }
+    }
+}
+
+static inline int paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = qAbs(p - a);
+    int pb = qAbs(p - b);
+    int pc = qAbs(p - c);
+    if (pa <= pb && pa <= pc) {
+        return a;
+    }
+
+    return pb <= pc ? b : c;
+}
+
+static bool unfilter_row(int filter, uchar* row, const uchar* previous, int length, int bpp) {
+    switch (filter) {
+        case 0:
+            break;
+        case 1:
+            for (int i = bpp; i < length; ++i) {
+                row[i] += row[i - bpp];
+            }
+            break;
+        case 2:
+            for (int i = 0; i < length; ++i) {
+                row[i] += previous[i];
+            }
+            break;
+        case 3:
+            for (int i = 0; i < length; ++i) {
+                int left = i >= bpp ? row[i - bpp] : 0;
+                row[i] += (left + previous[i]) >> 1;
+            }
+            break;
+        case 4:
+            for (int i = 0; i < length; ++i) {
+                int left = i >= bpp ? row[i - bpp] : 0;
+                int upper_left = i >= bpp ? previous[i - bpp] : 0;
+                row[i] += paeth(left, previous[i], upper_left);
+            }
+            break;
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+// Unfiltered PNG row to premultiplied pixels, 16-bit samples are reduced to their high byte
+static void convert_png_row(const PngInfo &png, const QRgb* palette, const uchar* data, QRgb* out) {
+    int depth = png.bit_depth;
+    int step = depth == 16 ? 2 : 1;
+
+    switch (png.color_type) {
+        case 0: {
+            int max = (1 << depth) - 1;
+            for (int x = 0; x < png.width; ++x) {
+                int value = read_sample(data, x, depth);
+                int gray = depth == 16 ? value >> 8 : value * 255 / max;
+                bool transparent = png.has_transparent_color && value == png.transparent_color[0];
+                out[x] = transparent ? 0 : qRgb(gray, gray, gray);
+            }
+            break;
+        }
+        case 2:
+            for (int x = 0; x < png.width; ++x) {
+                const uchar* pixel = data + x * 3 * step;
+                bool transparent = png.has_transparent_color
+                    && read_sample(data, x * 3, depth) == png.transparent_color[0]
+                    && read_sample(data, x * 3 + 1, depth) == png.transparent_color[1]
+                    && read_sample(data, x * 3 + 2, depth) == png.transparent_color[2];
+                out[x] = transparent ? 0 : qRgb(pixel[0], pixel[step], pixel[2 * step]);
+            }
+            break;
+        case 3:
+            for (int x = 0; x < png.width; ++x) {
+                out[x] = palette[read_sample(data, x, depth)];
+            }
+            break;
+        case 4:
+            for (int x = 0; x < png.width; ++x) {
+                const uchar* pixel = data + x * 2 * step;
+                out[x] = qPremultiply(qRgba(pixel[0], pixel[0], pixel[0], pixel[step]));
+            }
+            break;
+        default:
+            for (int x = 0; x < png.width; ++x) {
+                const uchar* pixel = data + x * 4 * step;
+                out[x] = qPremultiply(qRgba(pixel[0], pixel[step], pixel[2 * step], pixel[3 * step]));
+            }
+            break;
+    }
+}
+
+struct Inflater {
+    z_stream stream;
+    bool is_ready;
+
+    Inflater() {
+        memset(&stream, 0, sizeof(stream));
+        is_ready = inflateInit(&stream) == Z_OK;
+    }
+
+    ~Inflater() {
+        if (is_ready) {
+            inflateEnd(&stream);
+        }
+    }
+};
+
+// Decode a non-interlaced PNG file by rows, straight into the scaled image.
+// Returns false when the file isn't a PNG that can be decoded this way, `image` stays null when it fails.
+static bool decode_png(const QString &file_path, QSize target_size, QImage &image) {
+    QFile file(file_path);
+    uchar signature[8];
+    if (!file.open(QIODevice::ReadOnly) || file.read(reinterpret_cast<char*>(signature), 8) != 8 || memcmp(signature, PNG_SIGNATURE, 8) != 0) {
+        return false;
+    }
+
+    PngInfo png;
+    bool has_header = false;
+    Inflater inflater;
+    if (!inflater.is_ready) {
+        return false;
+    }
+
+    std::vector<uchar> current;
+    std::vector<uchar> previous;
+    std::vector<QRgb> pixels;
+    QRgb palette[256];
+    std::unique_ptr<AreaScaler> scaler;
+    std::vector<uchar> chunk(PNG_READ_SIZE);
+    int stride = 0;
+    int bpp = 0;
+    int filled = 0;
+    int rows_done = 0;
+
+    while (rows_done < png.height || !has_header) {
+        uchar chunk_header[8];
+        if (file.read(reinterpret_cast<char*>(chunk_header), 8) != 8) {
+            break;
+        }
+
+        quint32 length = read_be32(chunk_header);
+        const uchar* type = chunk_header + 4;
+        if (length > 0x7fffffff) {
+            break;
+        }
+
+        bool is_idat = memcmp(type, "IDAT", 4) == 0;
+        if (!is_idat) {
+            if (memcmp(type, "IEND", 4) == 0) {
+                break;
+            }
+
+            QByteArray data;
+            bool is_needed = memcmp(type, "IHDR", 4) == 0 || memcmp(type, "PLTE", 4) == 0 || memcmp(type, "tRNS", 4) == 0;
+            if (is_needed) {
+                data = file.read(length);
+                if ((quint32)data.size() != length) {
+                    break;
+                }
+            }
+            if (!file.seek(file.pos() + (is_needed ? 0 : length) + 4)) {
+                break;
+            }
+
+            const uchar* bytes = reinterpret_cast<const uchar*>(data.constData());
+            if (memcmp(type, "IHDR", 4) == 0) {
+                if (length != 13 || !parse_png_header(png, bytes)) {
+                    nh_log("Invalid PNG header in %s", qPrintable(file_path));
+                    return true;
+                }
+                if (png.interlace != 0) {
+                    // Interlaced passes need the whole image
+                    return false;
+                }
+                has_header = true;
+            } else if (memcmp(type, "PLTE", 4) == 0) {
+                png.palette_size = qMin(256, (int)length / 3);
+                memcpy(png.palette, bytes, png.palette_size * 3);
+            } else if (memcmp(type, "tRNS", 4) == 0) {
+                if (png.color_type == 3) {
+                    png.palette_alpha_size = qMin(256, (int)length);
+                    memcpy(png.palette_alpha, bytes, png.palette_alpha_size);
+                } else if ((png.color_type == 0 && length >= 2) || (png.color_type == 2 && length >= 6)) {
+                    png.has_transparent_color = true;
+                    for (int c = 0; c < png.channels; ++c) {
+                        png.transparent_color[c] = (bytes[c * 2] << 8) | bytes[c * 2 + 1];
+                    }
+                }
+            }
+            continue;
+        }
+
+        if (!has_header) {
+            break;
+        }
+
+        if (!scaler) {
+            // Everything before the first IDAT chunk is known now
+            QSize source_size(png.width, png.height);
+            QSize scaled_size = source_size.scaled(target_size, Qt::KeepAspectRatioByExpanding);
+            stride = ((qint64)png.width * png.channels * png.bit_depth + 7) / 8;
+            bpp = qMax(1, png.channels * png.bit_depth / 8);
+
+            qint64 bytes = (qint64)scaled_size.width() * scaled_size.height() * 4
+                + 2 * (stride + 1) + (qint64)png.width * 4
+                + AreaScaler::memory(png.width, png.height, scaled_size) + PNG_READ_SIZE + INFLATE_MEMORY;
+            if (!fits_budget(file_path, source_size, bytes)) {
+                return true;
+            }
+
+            image = QImage(scaled_size, png.has_alpha() ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32);
+            if (image.isNull()) {
+                return true;
+            }
+
+            for (int i = 0; i < 256; ++i) {
+                // Missing palette entries are black
+                bool is_valid = i < png.palette_size;
+                int alpha = i < png.palette_alpha_size ? png.palette_alpha[i] : 255;
+                palette[i] = is_valid ? qPremultiply(qRgba(png.palette[i][0], png.palette[i][1], png.palette[i][2], alpha)) : qRgb(0, 0, 0);
+            }
+
+            current.assign(stride + 1, 0);
+            previous.assign(stride + 1, 0);
+            pixels.resize(png.width);
+            scaler.reset(new AreaScaler(png.width, png.height, image));
+        }
+
+        // Inflate the chunk block by block, rows are handled as soon as they are complete
+        quint32 remaining = length;
+        while (remaining > 0 && rows_done < png.height) {
+            int block = file.read(reinterpret_cast<char*>(chunk.data()), qMin(remaining, (quint32)PNG_READ_SIZE));
+            if (block <= 0) {
+                break;
+            }
+            remaining -= block;
+
+            z_stream &stream = inflater.stream;
+            stream.next_in = chunk.data();
+            stream.avail_in = block;
+            for (;;) {
+                stream.next_out = current.data() + filled;
+                stream.avail_out = stride + 1 - filled;
+                int result = inflate(&stream, Z_NO_FLUSH);
+                if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+                    nh_log("Corrupted PNG data in %s", qPrintable(file_path));
+                    image = QImage();
+                    return true;
+                }
+
+                // zlib can still have output left when the row is full, even without input
+                bool is_full = stream.avail_out == 0;
+                filled = stride + 1 - stream.avail_out;
+                if (is_full) {
+                    if (!unfilter_row(current[0], current.data() + 1, previous.data() + 1, stride, bpp)) {
+                        nh_log("Invalid PNG filter in %s", qPrintable(file_path));
+                        image = QImage();
+                        return true;
+                    }
+                    convert_png_row(png, palette, current.data() + 1, pixels.data());
+                    scaler->add_row(pixels.data());
+                    current.swap(previous);
+                    filled = 0;
+                    ++rows_done;
+                }
+
+                if (result != Z_OK || rows_done >= png.height || (stream.avail_in == 0 && !is_full)) {
+                    break;
+                }
+            }
+        }
+
+        if (remaining > 0 && rows_done < png.height) {
+            break;
+        }
+        file.seek(file.pos() + remaining + 4);
+    }
+
+    if (rows_done < png.height) {
+        nh_log("Truncated PNG file %s", qPrintable(file_path));
+        image = QImage();
+    }
+
+    return true;
+}
+
+// Decode with Qt. JPEG files are shrunk by libjpeg while decoding, other formats are decoded at full size.
+static QImage decode_with_reader(QImageReader &reader, const QString &file_path, QSize target_size) {
+    QSize source_size = reader.size();
+    if (!reader.canRead() || source_size.isEmpty()) {
+        return QImage();
+    }
+
+    QSize scaled_size = source_size.scaled(target_size, Qt::KeepAspectRatioByExpanding);
+    bool is_jpeg = reader.format() == "jpeg";
+
+    // Largest libjpeg shrink factor that still leaves at least the scaled size
+    int denom = is_jpeg ? 8 : 1;
+    while (denom > 1 && (source_size.width() / denom < scaled_size.width() || source_size.height() / denom < scaled_size.height())) {
+        denom /= 2;
+    }
+
+    QSize decoded_size(source_size.width() / denom, source_size.height() / denom);
+    // libjpeg rounds up, Qt then resizes that to the requested size once more
+    QSize rounded_size((source_size.width() + denom - 1) / denom, (source_size.height() + denom - 1) / denom);
+    qint64 bytes = (qint64)rounded_size.width() * rounded_size.height() * 4;
+    if (rounded_size != decoded_size) {
+        bytes += (qint64)decoded_size.width() * decoded_size.height() * 4;
+    }
+    if (decoded_size != scaled_size) {
+        bytes += (qint64)scaled_size.width() * scaled_size.height() * 4 + AreaScaler::memory(decoded_size.width(), decoded_size.height(), scaled_size) + (qint64)decoded_size.width() * 4;
+    }
+    if (!fits_budget(file_path, source_size, bytes)) {
+        return QImage();
+    }
+
+    if (denom > 1) {
+        reader.setScaledSize(decoded_size);
+    }
+
+    QImage decoded = reader.read();
+    if (decoded.isNull()) {
+        return QImage();
+    }
+
+    bool has_alpha = decoded.hasAlphaChannel();
+    QImage::Format format = has_alpha ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32;
+    if (decoded.size() == scaled_size) {
+        return decoded.convertToFormat(format);
+    }
+
+    QImage image(scaled_size, format);
+    if (image.isNull()) {
+        return image;
+    }
+
+    // libjpeg shrinks by powers of 2, the scaled size comes from the original size
+    area_scale_into(decoded, scaled_size, image);
+    return image;
+}
+
+QImage decode_scaled(const QString &file_path, QSize target_size) {
+    QElapsedTimer timer;
+    timer.start();
+
+    QImage image;
+    if (!decode_png(file_path, target_size, image)) {
+        QImageReader reader(file_path);
+        image = decode_with_reader(reader, file_path, target_size);
+    }
+
+    if (!image.isNull()) {
+        nh_log("Decoded %s in %lld ms", qPrintable(file_path), timer.elapsed());
+    }
+
+    return image;
+}
+
+QImage decode_scaled(QIODevice *device, const QString &file_path, QSize target_size) {
+    QElapsedTimer timer;
+    timer.start();
+
+    QImageReader reader(device);
+    QImage image = decode_with_reader(reader, file_path, target_size);
+    if (!image.isNull()) {
+        nh_log("Decoded %s from memory in %lld ms", qPrintable(file_path), timer.elapsed());
+    }
+
+    return image;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <QIODevice>
+#include <QImage>
+#include <QSize>
+#include <QString>
+
+// Decoding of wallpapers and overlays scaled to cover the screen, within a memory budget.
+// JPEG files are shrunk by libjpeg while decoding (1/2, 1/4 or 1/8), PNG files are decoded row by row
+// and averaged into the scaled image on the fly, so the full-size image is never held in memory.
+
+// Peak number of bytes one decode may use, images that would need more are rejected
+void decoder_configure(qint64 budget);
+
+// Returns an RGB32 image, or ARGB32_Premultiplied when it has transparency, scaled to cover `target_size`.
+// Returns a null image when the file can't be decoded within the budget.
+QImage decode_scaled(const QString &file_path, QSize target_size);
+
+// Same with the encoded file already in `device`, decoded with Qt. `file_path` only names it in the logs.
+QImage decode_scaled(QIODevice *device, const QString &file_path, QSize target_size);
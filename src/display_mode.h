@@ -0,0 +1,10 @@
+#pragma once
+
+// What a sleep frame is made of, combined as flags
+
+enum DISPLAY_MODE {
+    None      = 0b00000,
+    Overlay   = 0b00001,
+    Book      = 0b00010,
+    Wallpaper = 0b00100,
+};
@@ -0,0 +1,196 @@
+#include "file_index.h"
+#include "onboard.h"
+#include "sleep_stats.h"
+#include <NickelHook.h>
+
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QHash>
+#include <QSaveFile>
+#include <QSet>
+
+constexpr const char* FILE_INDEX_PATH = NICKEL_SCREENSAVER_ONBOARD "/.adds/screensaver/.cache/file_index";
+constexpr quint32 FILE_INDEX_MAGIC = 0x3149534e; // "NSI1"
+
+struct FolderIndex {
+    qint64 mtime = -1;
+    qint64 scanned_at = -1;
+    QStringList files;
+    QStringList bag;
+    QString last_file;
+};
+
+QDataStream &operator<<(QDataStream &out, const FolderIndex &index) {
+    return out << index.mtime << index.scanned_at << index.files << index.bag << index.last_file;
+}
+
+QDataStream &operator>>(QDataStream &in, FolderIndex &index) {
+    return in >> index.mtime >> index.scanned_at >> index.files >> index.bag >> index.last_file;
+}
+
+static QHash<QString, FolderIndex> folder_indexes;
+static bool is_loaded = false;
+static bool is_dirty = false;
+
+static void load_indexes() {
+    is_loaded = true;
+
+    QFile file(FILE_INDEX_PATH);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return;
+    }
+
+    QDataStream in(&file);
+    in.setVersion(QDataStream::Qt_5_2);
+    quint32 magic;
+    in >> magic;
+    if (magic != FILE_INDEX_MAGIC) {
+        return;
+    }
+
+    in >> folder_indexes;
+    if (in.status() != QDataStream::Ok) {
+        folder_indexes.clear();
+    }
+}
+
+static void refill_bag(FolderIndex &index) {
+    index.bag = index.files;
+
+    // Fisher-Yates shuffle
+    for (int i = index.bag.size() - 1; i > 0; --i) {
+        index.bag.swap(i, qrand() % (i + 1));
+    }
+
+    // Don't show the same file twice in a row across rounds
+    if (index.bag.size() > 1 && index.bag.last() == index.last_file) {
+        index.bag.swap(0, index.bag.size() - 1);
+    }
+}
+
+static void update_files(FolderIndex &index, const QStringList &files, qint64 mtime) {
+    QSet<QString> old_files = QSet<QString>::fromList(index.files);
+    QSet<QString> new_files = QSet<QString>::fromList(files);
+
+    // Keep the current round, drop removed files and add new ones
+    QStringList bag;
+    for (const QString &file : index.bag) {
+        if (new_files.contains(file)) {
+            bag.append(file);
+        }
+    }
+    for (const QString &file : files) {
+        if (!old_files.contains(file)) {
+            bag.insert(qrand() % (bag.size() + 1), file);
+        }
+    }
+
+    index.files = files;
+    index.bag = bag;
+    index.mtime = mtime;
+    index.scanned_at = QDateTime::currentMSecsSinceEpoch();
+    is_dirty = true;
+}
+
+static QString pick(FolderIndex &index, const QString &dir_path, int mode) {
+    if (index.files.isEmpty()) {
+        return "";
+    }
+
+    QString file;
+    if (mode == SELECTION_MODE::Shuffle) {
+        if (index.bag.isEmpty()) {
+            refill_bag(index);
+            is_dirty = true;
+        }
+        // Only taken out once it's shown
+        file = index.bag.last();
+    } else {
+        file = index.files.at(qrand() % index.files.size());
+    }
+
+    return dir_path + '/' + file;
+}
+
+QString file_index_pick(const QString &dir_path, const QStringList &filters, int mode) {
+    QFileInfo dir_info(dir_path);
+    sleep_stats_count_fs(1);
+    if (!dir_info.isDir()) {
+        return "";
+    }
+
+    if (!is_loaded) {
+        load_indexes();
+    }
+
+    FolderIndex &index = folder_indexes[dir_path + '|' + filters.join('|')];
+
+    // Rescan when the folder has changed, or could have changed within the mtime resolution
+    qint64 mtime = dir_info.lastModified().toMSecsSinceEpoch();
+    if (mtime != index.mtime || onboard_mtime_ambiguous(mtime, index.scanned_at)) {
+        update_files(index, QDir(dir_path).entryList(filters, QDir::Files), mtime);
+        sleep_stats_count_fs(1);
+    }
+
+    return pick(index, dir_path, mode);
+}
+
+QString file_index_pick_listed(const QString &dir_path, const QStringList &filters, const QStringList &files, int mode) {
+    if (!is_loaded) {
+        load_indexes();
+    }
+
+    // Same index as the folder's, so the shuffle round goes on.
+    // Its mtime is forgotten, so the folder is rescanned when files are picked from it again.
+    FolderIndex &index = folder_indexes[dir_path + '|' + filters.join('|')];
+    if (files != index.files || index.mtime != -1) {
+        update_files(index, files, -1);
+    }
+
+    return pick(index, dir_path, mode);
+}
+
+void file_index_shown(const QString &file_path) {
+    int slash = file_path.lastIndexOf('/');
+    if (slash < 0) {
+        return;
+    }
+
+    if (!is_loaded) {
+        load_indexes();
+    }
+
+    // Every index of the folder, whatever its filters
+    QString prefix = file_path.left(slash) + '|';
+    QString name = file_path.mid(slash + 1);
+    for (auto it = folder_indexes.begin(); it != folder_indexes.end(); ++it) {
+        if (it.key().startsWith(prefix) && it.value().files.contains(name)) {
+            it.value().bag.removeOne(name);
+            it.value().last_file = name;
+            is_dirty = true;
+        }
+    }
+}
+
+void file_index_flush() {
+    if (!is_dirty) {
+        return;
+    }
+
+    QDir().mkpath(QFileInfo(FILE_INDEX_PATH).path());
+
+    QSaveFile file(FILE_INDEX_PATH);
+    if (!file.open(QIODevice::WriteOnly)) {
+        nh_log("Couldn't write file index");
+        return;
+    }
+
+    QDataStream out(&file);
+    out.setVersion(QDataStream::Qt_5_2);
+    out << FILE_INDEX_MAGIC << folder_indexes;
+    if (file.commit()) {
+        is_dirty = false;
+    }
+}
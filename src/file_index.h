@@ -0,0 +1,23 @@
+#pragma once
+
+#include <QString>
+#include <QStringList>
+
+enum SELECTION_MODE {
+    Random  = 0,
+    Shuffle = 1,  // Show every file once before repeating
+};
+
+// Folder listings are kept in memory and only rescanned when the folder's mtime changes.
+// Returns the full path of the picked file, or an empty string if there is none.
+// In shuffle mode the file stays in the bag until file_index_shown(), so a frame that is thrown away doesn't skip it.
+QString file_index_pick(const QString &dir_path, const QStringList &filters, int mode);
+
+// Same, from a listing that doesn't come from the folder itself, like the files of a bundle
+QString file_index_pick_listed(const QString &dir_path, const QStringList &filters, const QStringList &files, int mode);
+
+// The frame made from `file_path`, as returned by a pick, was shown: take it out of its shuffle bag
+void file_index_shown(const QString &file_path);
+
+// Save the listings and shuffle bags, call it outside of the sleep path
+void file_index_flush();
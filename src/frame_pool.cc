@@ -0,0 +1,171 @@
+#include "frame_pool.h"
+#include <NickelHook.h>
+
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QMutexLocker>
+
+#include <cstdlib>
+
+// Enough for the RGB frame and the grayscale one
+constexpr int MAX_IDLE_BUFFERS = 2;
+
+// Pixel data allocated here, freed by free_buffer() once no image references it
+struct PoolBuffer {
+    qint64 bytes;
+    bool is_live;
+};
+
+struct FramePool {
+    // The last reference to a buffer can be dropped on any thread
+    QMutex mutex;
+    QList<QImage> idle_buffers;
+    // Buffers allocated here, images from elsewhere (e.g. memory-mapped cache entries) aren't kept
+    QHash<const uchar*, PoolBuffer> buffers;
+    qint64 live_bytes = 0;
+    qint64 peak_bytes = 0;
+    qint64 allocated_bytes = 0;
+};
+
+// Never destroyed, pooled images can outlive this file's statics at exit (e.g. in the composition cache)
+static FramePool &pool() {
+    static FramePool* pool = new FramePool;
+    return *pool;
+}
+
+// Cleanup function of the pooled images, runs when the last image using the buffer goes away,
+// including images that were dropped or reassigned without frame_pool_release()
+static void free_buffer(void* data) {
+    {
+        FramePool &p = pool();
+        QMutexLocker locker(&p.mutex);
+        auto it = p.buffers.find(static_cast<const uchar*>(data));
+        if (it != p.buffers.end()) {
+            if (it->is_live) {
+                p.live_bytes = qMax((qint64)0, p.live_bytes - it->bytes);
+            }
+            p.buffers.erase(it);
+        }
+    }
+
+    free(data);
+}
+
+static QImage allocate_buffer(QSize size, QImage::Format format) {
+    // Same row alignment as QImage's own buffers
+    int bytes_per_line = QImage(size.width(), 1, format).bytesPerLine();
+    if (bytes_per_line <= 0 || size.height() <= 0) {
+        return QImage();
+    }
+
+    uchar* data = static_cast<uchar*>(malloc((size_t)bytes_per_line * size.height()));
+    if (!data) {
+        return QImage();
+    }
+
+    return QImage(data, size.width(), size.height(), bytes_per_line, format, free_buffer, data);
+}
+
+QImage frame_pool_acquire(QSize size, QImage::Format format) {
+    FramePool &p = pool();
+    QMutexLocker locker(&p.mutex);
+
+    QImage image;
+    for (int i = 0; i < p.idle_buffers.size(); ++i) {
+        const QImage &buffer = p.idle_buffers.at(i);
+        if (buffer.size() == size && buffer.format() == format) {
+            image = p.idle_buffers.takeAt(i);
+            break;
+        }
+    }
+
+    if (image.isNull()) {
+        image = allocate_buffer(size, format);
+        if (image.isNull()) {
+            nh_log("Couldn't allocate a %dx%d frame", size.width(), size.height());
+            return image;
+        }
+
+        p.buffers.insert(image.constBits(), PoolBuffer { image.byteCount(), false });
+        p.allocated_bytes += image.byteCount();
+        nh_log("Allocated a %dx%d frame (%d bytes)", size.width(), size.height(), image.byteCount());
+    }
+
+    p.buffers[image.constBits()].is_live = true;
+    p.live_bytes += image.byteCount();
+    p.peak_bytes = qMax(p.peak_bytes, p.live_bytes);
+    return image;
+}
+
+void frame_pool_release(QImage &image) {
+    // Destroyed after the lock is released, the last reference runs free_buffer()
+    QList<QImage> dropped;
+    dropped.append(image);
+    image = QImage();
+
+    FramePool &p = pool();
+    QMutexLocker locker(&p.mutex);
+
+    const QImage &released = dropped.first();
+    auto it = p.buffers.find(released.constBits());
+    if (released.isNull() || it == p.buffers.end()) {
+        return;
+    }
+
+    if (it->is_live) {
+        it->is_live = false;
+        p.live_bytes = qMax((qint64)0, p.live_bytes - it->bytes);
+    }
+
+    // Still shown somewhere, writing to it would copy it anyway. It's freed with its last reference.
+    if (!released.isDetached()) {
+        return;
+    }
+
+    if (p.idle_buffers.size() >= MAX_IDLE_BUFFERS) {
+        dropped.append(p.idle_buffers.takeFirst());
+    }
+    p.idle_buffers.append(released);
+}
+
+void frame_pool_trim(int max_idle) {
+    QList<QImage> dropped;
+
+    FramePool &p = pool();
+    QMutexLocker locker(&p.mutex);
+    while (p.idle_buffers.size() > qMax(0, max_idle)) {
+        dropped.append(p.idle_buffers.takeFirst());
+    }
+}
+
+qint64 frame_pool_idle_bytes() {
+    FramePool &p = pool();
+    QMutexLocker locker(&p.mutex);
+
+    qint64 bytes = 0;
+    for (const QImage &buffer : p.idle_buffers) {
+        bytes += buffer.byteCount();
+    }
+
+    return bytes;
+}
+
+void frame_pool_begin() {
+    FramePool &p = pool();
+    QMutexLocker locker(&p.mutex);
+    p.peak_bytes = p.live_bytes;
+    p.allocated_bytes = 0;
+}
+
+qint64 frame_pool_peak() {
+    FramePool &p = pool();
+    QMutexLocker locker(&p.mutex);
+    return p.peak_bytes;
+}
+
+qint64 frame_pool_allocated() {
+    FramePool &p = pool();
+    QMutexLocker locker(&p.mutex);
+    return p.allocated_bytes;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <QImage>
+#include <QSize>
+
+// Full-screen buffers reused from one sleep to the next instead of being allocated every time.
+// Only buffers that aren't referenced anywhere else are reused, so writing to them never detaches.
+
+// Returns a writable image, reusing an idle buffer with the same size and format when there is one.
+// The content is undefined.
+QImage frame_pool_acquire(QSize size, QImage::Format format);
+
+// Give `image` back to the pool and make it null. It's only kept when nothing else references it.
+// A pooled image dropped or reassigned without it stops counting as live once its buffer is freed.
+void frame_pool_release(QImage &image);
+
+// Free idle buffers until at most `max_idle` are left, the oldest first
+void frame_pool_trim(int max_idle);
+
+// Bytes held by idle buffers
+qint64 frame_pool_idle_bytes();
+
+// Start counting the peak of full-screen buffer memory
+void frame_pool_begin();
+
+// Highest number of bytes held by buffers acquired since frame_pool_begin(), idle ones excluded
+qint64 frame_pool_peak();
+
+// Bytes allocated by frame_pool_acquire() since frame_pool_begin(), 0 when every buffer was reused
+qint64 frame_pool_allocated();
@@ -0,0 +1,148 @@
+#include "frame_widget.h"
+#include "compositor.h"
+#include "sleep_stats.h"
+#include <NickelHook.h>
+
+#include <QEvent>
+#include <QPaintEvent>
+#include <QPainter>
+#include <QPointer>
+#include <QVector>
+
+constexpr const char* FRAME_WIDGET_NAME = "NickelScreensaverOverlay";
+// Size of the blocks of overlay_region()
+constexpr int REGION_BLOCK = 16;
+
+FrameWidget::FrameWidget(QWidget *parent) : QWidget(parent) {
+    setObjectName(FRAME_WIDGET_NAME);
+    // Never takes the taps meant for the sleep view
+    setAttribute(Qt::WA_TransparentForMouseEvents, true);
+}
+
+void FrameWidget::show_image(const QImage &frame) {
+    image = frame;
+    overlay = QPixmap();
+    setAttribute(Qt::WA_OpaquePaintEvent, true);
+    clearMask();
+    update();
+}
+
+void FrameWidget::show_overlay(const QPixmap &frame, const QRegion &visible) {
+    overlay = frame;
+    image = QImage();
+    setAttribute(Qt::WA_OpaquePaintEvent, false);
+    if (visible.isEmpty()) {
+        clearMask();
+    } else {
+        setMask(visible);
+    }
+    update();
+}
+
+void FrameWidget::release() {
+    image = QImage();
+    overlay = QPixmap();
+}
+
+void FrameWidget::paintEvent(QPaintEvent *event) {
+    QPainter painter(this);
+    for (const QRect &rect : event->region().rects()) {
+        if (!image.isNull()) {
+            painter.drawImage(rect, image, rect);
+        } else if (!overlay.isNull()) {
+            painter.drawPixmap(rect, overlay, rect);
+        }
+    }
+}
+
+// Deleted along with its view when Nickel deletes it
+static QPointer<FrameWidget> widget;
+
+FrameWidget* frame_widget(QWidget *view) {
+    if (!widget) {
+        widget = new FrameWidget(view);
+    } else if (widget->parentWidget() != view) {
+        widget->setParent(view);
+    }
+    widget->setGeometry(view->rect());
+
+    return widget;
+}
+
+void frame_widget_release() {
+    if (!widget) {
+        return;
+    }
+
+    widget->hide();
+    widget->release();
+    // Kept out of the view, so Nickel deleting it doesn't delete the widget
+    widget->setParent(nullptr);
+}
+
+QRegion overlay_region(const QImage &overlay) {
+    QVector<OverlaySpan> rows = overlay_spans(overlay);
+
+    QVector<QRect> rects;
+    for (int top = 0; top < rows.size(); top += REGION_BLOCK) {
+        int bottom = qMin(top + REGION_BLOCK, rows.size());
+        int left = overlay.width();
+        int right = 0;
+        for (int y = top; y < bottom; ++y) {
+            if (rows[y].left < rows[y].right) {
+                left = qMin(left, (int)rows[y].left);
+                right = qMax(right, (int)rows[y].right);
+            }
+        }
+        if (left >= right) {
+            continue;
+        }
+
+        left = left / REGION_BLOCK * REGION_BLOCK;
+        right = qMin((right + REGION_BLOCK - 1) / REGION_BLOCK * REGION_BLOCK, overlay.width());
+        rects.append(QRect(left, top, right - left, bottom - top));
+    }
+
+    // Rects are sorted top to bottom and don't overlap, as setRects() expects
+    QRegion region;
+    region.setRects(rects.constData(), rects.size());
+    return region;
+}
+
+// Paints the watched widget itself, so the time includes the paint
+class PaintTimer : public QObject {
+public:
+    void watch(QWidget *target, const QElapsedTimer &shown) {
+        if (watched) {
+            watched->removeEventFilter(this);
+        }
+        watched = target;
+        timer = shown;
+        target->installEventFilter(this);
+    }
+
+protected:
+    bool eventFilter(QObject *object, QEvent *event) override {
+        if (object != watched || event->type() != QEvent::Paint) {
+            return false;
+        }
+
+        object->removeEventFilter(this);
+        watched = nullptr;
+        object->event(event);
+
+        qint64 ns = timer.nsecsElapsed();
+        nh_log("First paint of the frame %lld ms after the sleep view was shown", ns / 1000000);
+        sleep_stats_add_committed(SLEEP_STAGE::Paint, ns);
+        return true;
+    }
+
+private:
+    QPointer<QWidget> watched;
+    QElapsedTimer timer;
+};
+
+void frame_widget_time_paint(QWidget *target, const QElapsedTimer &shown) {
+    static PaintTimer* paint_timer = new PaintTimer();
+    paint_timer->watch(target, shown);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <QElapsedTimer>
+#include <QImage>
+#include <QPixmap>
+#include <QRegion>
+#include <QWidget>
+
+// Shows the frame of a sleep on top of a sleep view. The image or pixmap is painted as it is, without
+// converting it, and only in the parts Qt asks for. A single one is made, then moved from view to view.
+class FrameWidget : public QWidget {
+public:
+    explicit FrameWidget(QWidget *parent = nullptr);
+
+    // Opaque frame covering the view, nothing under it is painted
+    void show_image(const QImage &frame);
+
+    // Overlay with transparent parts, only `visible` is painted and the view shows through the rest
+    void show_overlay(const QPixmap &frame, const QRegion &visible);
+
+    // Drop the frame, so its buffer can go back to the frame pool
+    void release();
+
+protected:
+    void paintEvent(QPaintEvent *event) override;
+
+private:
+    QImage image;
+    QPixmap overlay;
+};
+
+// The frame widget moved into `view` and covering it, made the first time or when its last view was deleted
+FrameWidget* frame_widget(QWidget *view);
+
+// Hide the frame widget and take it out of its view, it stays alive for the next sleep
+void frame_widget_release();
+
+// Parts of a premultiplied overlay that aren't transparent, in blocks of 16x16 pixels so it stays a few rects
+QRegion overlay_region(const QImage &overlay);
+
+// Log and record the time from `shown` to the end of the first paint of `widget`, as the paint stage of the sleep
+void frame_widget_time_paint(QWidget *widget, const QElapsedTimer &shown);
@@ -0,0 +1,173 @@
+#include "framebuffer.h"
+#include <NickelHook.h>
+
+#include <fcntl.h>
+#include <linux/fb.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <vector>
+
+// 8-bit gray stored as 255 - value, see mxc_epdc_fb
+constexpr int GRAYSCALE_8BIT_INVERTED = 2;
+
+bool framebuffer_read_info(int fd, FramebufferInfo &info) {
+    struct fb_var_screeninfo var_info;
+    struct fb_fix_screeninfo fix_info;
+    if (ioctl(fd, FBIOGET_VSCREENINFO, &var_info) != 0 || ioctl(fd, FBIOGET_FSCREENINFO, &fix_info) != 0) {
+        return false;
+    }
+
+    info.width = var_info.xres;
+    info.height = var_info.yres;
+    info.x_offset = var_info.xoffset;
+    info.y_offset = var_info.yoffset;
+    info.bits_per_pixel = var_info.bits_per_pixel;
+    info.line_length = fix_info.line_length;
+    info.grayscale = var_info.grayscale;
+    info.rotate = var_info.rotate;
+    info.red = {(int)var_info.red.offset, (int)var_info.red.length};
+    info.green = {(int)var_info.green.offset, (int)var_info.green.length};
+    info.blue = {(int)var_info.blue.offset, (int)var_info.blue.length};
+    info.size = fix_info.smem_len;
+
+    return true;
+}
+
+// Channel value to its 8-bit value, shifted into place in a QRgb
+static bool make_channel_table(const FramebufferChannel &channel, int bits_per_pixel, int shift, std::vector<QRgb> &table) {
+    if (channel.length <= 0 || channel.length > 16 || channel.offset < 0 || channel.offset + channel.length > bits_per_pixel) {
+        return false;
+    }
+
+    int max = (1 << channel.length) - 1;
+    table.resize(max + 1);
+    for (int value = 0; value <= max; ++value) {
+        table[value] = (QRgb)((value * 255 + max / 2) / max) << shift;
+    }
+
+    return true;
+}
+
+static inline quint32 read_pixel(const uchar* pixel, int bytes_per_pixel) {
+    // Little-endian, like the devices
+    switch (bytes_per_pixel) {
+    case 1:
+        return pixel[0];
+    case 2:
+        return pixel[0] | (pixel[1] << 8);
+    case 3:
+        return pixel[0] | (pixel[1] << 8) | (pixel[2] << 16);
+    default:
+        return pixel[0] | (pixel[1] << 8) | (pixel[2] << 16) | ((quint32)pixel[3] << 24);
+    }
+}
+
+bool framebuffer_copy(const uchar* data, const FramebufferInfo &info, QRect region, QImage &frame) {
+    QSize screen_size(info.width, info.height);
+    if (!data || frame.isNull() || frame.format() != QImage::Format_RGB32
+            || region.isEmpty() || !QRect(QPoint(0, 0), screen_size).contains(region)) {
+        return false;
+    }
+
+    // How a rotated framebuffer is laid out depends on the driver, it isn't guessed
+    if (info.rotate != FB_ROTATE_UR) {
+        return false;
+    }
+
+    int bytes_per_pixel = info.bits_per_pixel / 8;
+    if (info.bits_per_pixel % 8 != 0 || bytes_per_pixel < 1 || bytes_per_pixel > 4) {
+        return false;
+    }
+
+    // Every visible pixel must be inside the mapped memory
+    qint64 stride = info.line_length;
+    qint64 end = (qint64)(info.y_offset + info.height - 1) * stride + (qint64)(info.x_offset + info.width) * bytes_per_pixel;
+    if (info.width <= 0 || info.height <= 0 || stride < (qint64)info.width * bytes_per_pixel || end > info.size) {
+        return false;
+    }
+
+    std::vector<QRgb> red_table, green_table, blue_table;
+    int red_mask = 0, green_mask = 0, blue_mask = 0;
+    if (bytes_per_pixel == 1) {
+        // 8-bit framebuffers are gray, whatever the channels say
+        red_table.resize(256);
+        for (int value = 0; value < 256; ++value) {
+            int gray = info.grayscale == GRAYSCALE_8BIT_INVERTED ? 255 - value : value;
+            red_table[value] = qRgb(gray, gray, gray);
+        }
+        red_mask = 0xff;
+    } else {
+        if (!make_channel_table(info.red, info.bits_per_pixel, 16, red_table)
+                || !make_channel_table(info.green, info.bits_per_pixel, 8, green_table)
+                || !make_channel_table(info.blue, info.bits_per_pixel, 0, blue_table)) {
+            return false;
+        }
+        red_mask = (1 << info.red.length) - 1;
+        green_mask = (1 << info.green.length) - 1;
+        blue_mask = (1 << info.blue.length) - 1;
+    }
+
+    // Unrotated, row by row
+    qint64 origin = (qint64)info.y_offset * stride + (qint64)info.x_offset * bytes_per_pixel;
+
+    // Nearest pixel, anchored at the top left and cropped like the rendered capture
+    QSize scaled_size = region.size().scaled(frame.size(), Qt::KeepAspectRatioByExpanding);
+    std::vector<qint64> x_offsets(frame.width());
+    for (int x = 0; x < frame.width(); ++x) {
+        x_offsets[x] = (qint64)(region.x() + (qint64)x * region.width() / scaled_size.width()) * bytes_per_pixel;
+    }
+
+    for (int y = 0; y < frame.height(); ++y) {
+        int screen_y = region.y() + (qint64)y * region.height() / scaled_size.height();
+        const uchar* row = data + origin + screen_y * stride;
+        QRgb* out = reinterpret_cast<QRgb*>(frame.scanLine(y));
+
+        if (bytes_per_pixel == 1) {
+            for (int x = 0; x < frame.width(); ++x) {
+                out[x] = red_table[row[x_offsets[x]]];
+            }
+            continue;
+        }
+
+        for (int x = 0; x < frame.width(); ++x) {
+            quint32 pixel = read_pixel(row + x_offsets[x], bytes_per_pixel);
+            out[x] = 0xff000000
+                | red_table[(pixel >> info.red.offset) & red_mask]
+                | green_table[(pixel >> info.green.offset) & green_mask]
+                | blue_table[(pixel >> info.blue.offset) & blue_mask];
+        }
+    }
+
+    return true;
+}
+
+bool framebuffer_capture(const char* device_path, QSize screen_size, QRect region, QImage &frame) {
+    int fd = open(device_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    FramebufferInfo info;
+    bool is_valid = framebuffer_read_info(fd, info);
+    if (is_valid && QSize(info.width, info.height) != screen_size) {
+        nh_log("%s shows a %dx%d screen instead of %dx%d", device_path, info.width, info.height, screen_size.width(), screen_size.height());
+        is_valid = false;
+    }
+    if (is_valid && info.rotate != FB_ROTATE_UR) {
+        nh_log("%s is rotated (%d)", device_path, info.rotate);
+        is_valid = false;
+    }
+
+    void* data = is_valid ? mmap(nullptr, info.size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    bool is_copied = framebuffer_copy(static_cast<const uchar*>(data), info, region, frame);
+    munmap(data, info.size);
+
+    return is_copied;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <QImage>
+#include <QRect>
+#include <QSize>
+
+// Reads the page straight from the Linux framebuffer, which already holds what the e-ink screen shows.
+// Only unrotated framebuffers are read, rows in memory being rows on the screen. A rotated one is refused
+// and the page is rendered instead.
+
+struct FramebufferChannel {
+    int offset;
+    int length;
+};
+
+// Layout of the framebuffer memory, from FBIOGET_VSCREENINFO and FBIOGET_FSCREENINFO
+struct FramebufferInfo {
+    int width;           // xres, visible pixels per row
+    int height;          // yres
+    int x_offset;        // first visible pixel, when panned
+    int y_offset;
+    int bits_per_pixel;  // 8 (gray), 16, 24 or 32
+    int line_length;     // bytes per row
+    int grayscale;       // 2 when 8-bit gray is inverted
+    int rotate;          // FB_ROTATE_*, only FB_ROTATE_UR (0) is read
+    FramebufferChannel red;
+    FramebufferChannel green;
+    FramebufferChannel blue;
+    qint64 size;         // smem_len
+};
+
+bool framebuffer_read_info(int fd, FramebufferInfo &info);
+
+// Convert `region` of the screen shown by the mapped framebuffer `data` into an RGB32 `frame`, scaled to cover it.
+// Fails when the framebuffer is rotated.
+bool framebuffer_copy(const uchar* data, const FramebufferInfo &info, QRect region, QImage &frame);
+
+// Map `device_path` and copy `region` into `frame`. Fails when the framebuffer doesn't show a `screen_size` screen.
+bool framebuffer_capture(const char* device_path, QSize screen_size, QRect region, QImage &frame);
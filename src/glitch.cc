@@ -0,0 +1,447 @@
+#include "glitch.h"
+
+#include <QBuffer>
+#include <QByteArray>
+
+#include <algorithm>
+#include <cstring>
+
+// JPEG encodes 4:2:0 images in 16x16 MCUs
+constexpr int GLITCH_BLOCK_SIZE = 16;
+
+// Runs of noise written over the scan data
+constexpr int GLITCH_NOISE_LENGTH = 97;  // prime number
+constexpr uchar GLITCH_NOISE_BYTE = 1;
+
+bool jpeg_entropy_segments(const uchar* data, qint64 size, std::vector<JpegSegment> &segments) {
+    segments.clear();
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+        return false;
+    }
+
+    qint64 pos = 2;
+    while (pos < size) {
+        if (data[pos] != 0xFF) {
+            return false;
+        }
+        // Any number of fill bytes may come before a marker
+        while (pos < size && data[pos] == 0xFF) {
+            ++pos;
+        }
+        if (pos >= size) {
+            return false;
+        }
+
+        uchar marker = data[pos++];
+        if (marker == 0xD9) {
+            // EOI
+            break;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            // TEM and RSTn have no length
+            continue;
+        }
+
+        if (pos + 2 > size) {
+            return false;
+        }
+        int length = (data[pos] << 8) | data[pos + 1];
+        if (length < 2 || pos + length > size) {
+            return false;
+        }
+        pos += length;
+        if (marker != 0xDA) {
+            continue;
+        }
+
+        // SOS: the scan data runs until a marker other than a stuffed zero or a restart marker
+        qint64 start = pos;
+        while (pos < size) {
+            if (data[pos] != 0xFF) {
+                ++pos;
+                continue;
+            }
+
+            qint64 next = pos + 1;
+            while (next < size && data[next] == 0xFF) {
+                ++next;
+            }
+            if (next >= size) {
+                break;
+            }
+            if (data[next] == 0x00) {
+                pos = next + 1;
+            } else if (data[next] >= 0xD0 && data[next] <= 0xD7) {
+                if (pos > start) {
+                    segments.push_back({start, pos});
+                }
+                pos = next + 1;
+                start = pos;
+            } else {
+                break;
+            }
+        }
+        if (pos > start) {
+            segments.push_back({start, pos});
+        }
+    }
+
+    return !segments.empty();
+}
+
+bool glitch_jpeg_data(uchar* data, qint64 size, int iterations) {
+    std::vector<JpegSegment> segments;
+    if (!jpeg_entropy_segments(data, size, segments)) {
+        return false;
+    }
+
+    qint64 total = 0;
+    for (const JpegSegment &segment : segments) {
+        total += segment.end - segment.start;
+    }
+
+    iterations = qMax(1, iterations);
+    for (int i = 0; i < iterations; ++i) {
+        // Every byte of scan data is as likely to be hit, whatever segment it's in
+        qint64 offset = (qint64)qrand() % total;
+        const JpegSegment* segment = segments.data();
+        while (offset >= segment->end - segment->start) {
+            offset -= segment->end - segment->start;
+            ++segment;
+        }
+
+        qint64 end = qMin(segment->start + offset + GLITCH_NOISE_LENGTH, segment->end);
+        for (qint64 pos = segment->start + offset; pos < end; ++pos) {
+            // Keep 0xFF 0x00 pairs, so no marker appears or disappears
+            if (data[pos] == 0xFF || (pos > segment->start && data[pos - 1] == 0xFF)) {
+                continue;
+            }
+            data[pos] = GLITCH_NOISE_BYTE;
+        }
+    }
+
+    return true;
+}
+
+// The noise of the Book mode jpeg engine: runs anywhere in the scan data of the first scan, 0xFF bytes included.
+// Qt encodes a single baseline scan, and the look of these glitches is kept as it always was.
+static bool glitch_encoded_copy(QByteArray &ba, int iterations) {
+    std::vector<JpegSegment> segments;
+    if (!jpeg_entropy_segments(reinterpret_cast<const uchar*>(ba.constData()), ba.size(), segments)) {
+        return false;
+    }
+
+    // Up to EOI, whatever restart markers split it into
+    qint64 scan_start = segments.front().start;
+    qint64 safe_range = ba.size() - 2 - scan_start - GLITCH_NOISE_LENGTH;
+    if (safe_range <= 0) {
+        return false;
+    }
+
+    static const QByteArray noise(GLITCH_NOISE_LENGTH, (char)GLITCH_NOISE_BYTE);
+    iterations = qMax(1, iterations);
+    for (int i = 0; i < iterations; ++i) {
+        ba.replace((int)(scan_start + qrand() % safe_range), GLITCH_NOISE_LENGTH, noise);
+    }
+
+    return true;
+}
+
+QImage glitch_image(const QImage& source, int iterations, int quality) {
+    // Encode to JPEG, then corrupt its scan data
+    QByteArray ba;
+    QBuffer buffer(&ba);
+    buffer.open(QIODevice::WriteOnly);
+    source.save(&buffer, "JPG", quality);
+
+    if (!glitch_encoded_copy(ba, iterations)) {
+        return source;
+    }
+
+    QImage glitched;
+    if (!glitched.loadFromData(ba, "JPG")) {
+        return source;
+    }
+
+    return glitched;
+}
+
+// Value added to the first 3 bytes of every pixel, saturated. Emulates a corrupted DC coefficient.
+typedef int ChannelTints[3];
+
+static void tint_row_scalar(uchar* row, int pixels, const ChannelTints &tints) {
+    for (int x = 0; x < pixels; ++x) {
+        row[0] = (uchar)qBound(0, row[0] + tints[0], 255);
+        row[1] = (uchar)qBound(0, row[1] + tints[1], 255);
+        row[2] = (uchar)qBound(0, row[2] + tints[2], 255);
+        row += 4;
+    }
+}
+
+// Move one byte of every pixel `offset` pixels to the right, for the pixels from `offset` to `end`.
+// Right to left, so every byte is read before it's overwritten.
+static void offset_channel_scalar(uchar* row, int end, int channel, int offset) {
+    for (int x = end - 1; x >= offset; --x) {
+        row[x * 4 + channel] = row[(x - offset) * 4 + channel];
+    }
+}
+
+#if (defined(__ARM_NEON__) || defined(__ARM_NEON)) || defined(__SSE2__)
+// A tint is a saturating add of its positive part and subtract of its negative part, for each byte of 4 pixels
+static void tint_lanes(const ChannelTints &tints, uchar add[16], uchar sub[16]) {
+    for (int i = 0; i < 16; ++i) {
+        int tint = i % 4 < 3 ? tints[i % 4] : 0;
+        add[i] = (uchar)qBound(0, tint, 255);
+        sub[i] = (uchar)qBound(0, -tint, 255);
+    }
+}
+#endif
+
+#if (defined(__ARM_NEON__) || defined(__ARM_NEON))
+#include <arm_neon.h>
+
+static void tint_row(uchar* row, int pixels, const ChannelTints &tints) {
+    uchar add_lanes[16], sub_lanes[16];
+    tint_lanes(tints, add_lanes, sub_lanes);
+    const uint8x16_t add = vld1q_u8(add_lanes);
+    const uint8x16_t sub = vld1q_u8(sub_lanes);
+
+    // 4 pixels at a time
+    int x = 0;
+    for (; x + 4 <= pixels; x += 4) {
+        uint8x16_t values = vld1q_u8(row + x * 4);
+        vst1q_u8(row + x * 4, vqsubq_u8(vqaddq_u8(values, add), sub));
+    }
+    tint_row_scalar(row + x * 4, pixels - x, tints);
+}
+
+static void offset_channel_row(uchar* row, int width, int channel, int offset) {
+    uchar mask_lanes[16] = {};
+    for (int i = channel; i < 16; i += 4) {
+        mask_lanes[i] = 0xff;
+    }
+    const uint8x16_t mask = vld1q_u8(mask_lanes);
+
+    // 4 pixels at a time from the right, their source is read before anything left of them is written
+    int x = width;
+    for (; x - 4 >= offset; x -= 4) {
+        uint8x16_t source = vld1q_u8(row + (x - 4 - offset) * 4);
+        uint8x16_t values = vld1q_u8(row + (x - 4) * 4);
+        vst1q_u8(row + (x - 4) * 4, vbslq_u8(mask, source, values));
+    }
+    offset_channel_scalar(row, x, channel, offset);
+}
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+static void tint_row(uchar* row, int pixels, const ChannelTints &tints) {
+    uchar add_lanes[16], sub_lanes[16];
+    tint_lanes(tints, add_lanes, sub_lanes);
+    const __m128i add = _mm_loadu_si128(reinterpret_cast<const __m128i*>(add_lanes));
+    const __m128i sub = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sub_lanes));
+
+    // 4 pixels at a time
+    int x = 0;
+    for (; x + 4 <= pixels; x += 4) {
+        __m128i* pixel = reinterpret_cast<__m128i*>(row + x * 4);
+        _mm_storeu_si128(pixel, _mm_subs_epu8(_mm_adds_epu8(_mm_loadu_si128(pixel), add), sub));
+    }
+    tint_row_scalar(row + x * 4, pixels - x, tints);
+}
+
+static void offset_channel_row(uchar* row, int width, int channel, int offset) {
+    uchar mask_lanes[16] = {};
+    for (int i = channel; i < 16; i += 4) {
+        mask_lanes[i] = 0xff;
+    }
+    const __m128i mask = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mask_lanes));
+
+    // 4 pixels at a time from the right, their source is read before anything left of them is written
+    int x = width;
+    for (; x - 4 >= offset; x -= 4) {
+        __m128i source = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + (x - 4 - offset) * 4));
+        __m128i* pixel = reinterpret_cast<__m128i*>(row + (x - 4) * 4);
+        __m128i values = _mm_loadu_si128(pixel);
+        _mm_storeu_si128(pixel, _mm_or_si128(_mm_and_si128(mask, source), _mm_andnot_si128(mask, values)));
+    }
+    offset_channel_scalar(row, x, channel, offset);
+}
+
+#else
+
+static void tint_row(uchar* row, int pixels, const ChannelTints &tints) {
+    tint_row_scalar(row, pixels, tints);
+}
+
+static void offset_channel_row(uchar* row, int width, int channel, int offset) {
+    offset_channel_scalar(row, width, channel, offset);
+}
+
+#endif
+
+// Shift every block from `start` onwards by `shift` blocks in raster order, then tint them.
+// That's what a corrupted entropy-coded segment does to the rest of a JPEG image.
+static void shift_blocks(QImage &image, int start, int shift, const ChannelTints &tints) {
+    int blocks_x = image.width() / GLITCH_BLOCK_SIZE;
+    int blocks_y = image.height() / GLITCH_BLOCK_SIZE;
+    int block_bytes = GLITCH_BLOCK_SIZE * 4;
+    int bytes_per_line = image.bytesPerLine();
+    uchar* bits = image.bits();
+
+    int start_y = start / blocks_x;
+    // Bottom-up, so blocks are read before they're overwritten
+    for (int by = blocks_y - 1; by >= start_y; --by) {
+        int x0 = by == start_y ? start % blocks_x : 0;
+
+        for (int y = 0; y < GLITCH_BLOCK_SIZE; ++y) {
+            uchar* row = bits + (by * GLITCH_BLOCK_SIZE + y) * bytes_per_line;
+
+            // Blocks coming from the same block row
+            int first = qMax(x0, shift);
+            if (first < blocks_x) {
+                memmove(row + first * block_bytes, row + (first - shift) * block_bytes, (blocks_x - first) * block_bytes);
+            }
+
+            // Blocks wrapping around from the previous block row
+            int last = qMin(shift, blocks_x);
+            if (x0 < last) {
+                const uchar* prev_row = row - GLITCH_BLOCK_SIZE * bytes_per_line;
+                memcpy(row + x0 * block_bytes, prev_row + (blocks_x - shift + x0) * block_bytes, (last - x0) * block_bytes);
+            }
+
+            tint_row(row + x0 * block_bytes, (blocks_x - x0) * GLITCH_BLOCK_SIZE, tints);
+        }
+    }
+}
+
+// Rotate rows horizontally by `offset` pixels
+static void displace_rows(QImage &image, int top, int rows, int offset) {
+    int row_bytes = image.width() * 4;
+    int offset_bytes = offset * 4;
+    int bottom = qMin(top + rows, image.height());
+    int bytes_per_line = image.bytesPerLine();
+    uchar* bits = image.bits();
+
+    QByteArray scratch(row_bytes, Qt::Uninitialized);
+    for (int y = top; y < bottom; ++y) {
+        uchar* row = bits + y * bytes_per_line;
+        memcpy(scratch.data(), row, row_bytes);
+        memcpy(row + offset_bytes, scratch.constData(), row_bytes - offset_bytes);
+        memcpy(row, scratch.constData() + row_bytes - offset_bytes, offset_bytes);
+    }
+}
+
+// Shift one color channel of the rows to the right
+static void offset_channel(QImage &image, int top, int rows, int channel, int offset) {
+    int width = image.width();
+    int bottom = qMin(top + rows, image.height());
+    int bytes_per_line = image.bytesPerLine();
+    uchar* bits = image.bits();
+
+    for (int y = top; y < bottom; ++y) {
+        offset_channel_row(bits + y * bytes_per_line, width, channel, offset);
+    }
+}
+
+// Repeat the last pixel column of a block over the rest of its block row
+static void smear_block(QImage &image, int bx, int by) {
+    int width = image.width();
+    int from = (bx + 1) * GLITCH_BLOCK_SIZE;
+    if (from >= width) {
+        return;
+    }
+
+    int bytes_per_line = image.bytesPerLine();
+    uchar* bits = image.bits();
+
+    for (int y = by * GLITCH_BLOCK_SIZE; y < (by + 1) * GLITCH_BLOCK_SIZE; ++y) {
+        quint32* row = reinterpret_cast<quint32*>(bits + y * bytes_per_line);
+        std::fill(row + from, row + width, row[from - 1]);
+    }
+}
+
+// `image` must be RGB32
+static void glitch_pixels(QImage &image, int iterations) {
+    int blocks_x = image.width() / GLITCH_BLOCK_SIZE;
+    int blocks_y = image.height() / GLITCH_BLOCK_SIZE;
+    int total_blocks = blocks_x * blocks_y;
+    if (blocks_x < 2 || total_blocks < blocks_x + 1) {
+        return;
+    }
+
+    iterations = qMax(1, iterations);
+
+    ChannelTints tints;
+    for (int i = 0; i < iterations; ++i) {
+        // Same as one noise splice of the JPEG engine
+        int shift = 1 + qrand() % (blocks_x - 1);
+        int start = shift + qrand() % (total_blocks - shift);
+        for (int c = 0; c < 3; ++c) {
+            tints[c] = qrand() % 97 - 48;
+        }
+        shift_blocks(image, start, shift, tints);
+
+        // Smaller artifacts around the corrupted block
+        int top = (start / blocks_x) * GLITCH_BLOCK_SIZE;
+        switch (qrand() % 4) {
+            case 0:
+                // Scanline displacement
+                displace_rows(image, top + qrand() % GLITCH_BLOCK_SIZE, 1 + qrand() % 4, 1 + qrand() % (image.width() - 1));
+                break;
+            case 1:
+                // Block shift
+                displace_rows(image, top, GLITCH_BLOCK_SIZE * (1 + qrand() % 4), 1 + qrand() % (image.width() - 1));
+                break;
+            case 2:
+                // Channel offset
+                offset_channel(image, top, GLITCH_BLOCK_SIZE * (1 + qrand() % 4), qrand() % 3, 1 + qrand() % GLITCH_BLOCK_SIZE);
+                break;
+            default:
+                smear_block(image, start % blocks_x, start / blocks_x);
+                break;
+        }
+    }
+}
+
+QImage glitch_image_pixels(const QImage& source, int iterations) {
+    QImage image = source.convertToFormat(QImage::Format_RGB32);
+    glitch_pixels(image, iterations);
+    return image;
+}
+
+QImage glitch_pixmap(const QPixmap& source, int engine, int iterations, int quality) {
+    QImage img = source.toImage();
+    if (engine == GLITCH_ENGINE::Pixel) {
+        return glitch_image_pixels(img, iterations);
+    }
+
+    return glitch_image(img, iterations, quality);
+}
+
+void glitch_frame(QImage &frame, int engine, int iterations, int quality) {
+    if (engine == GLITCH_ENGINE::Pixel) {
+        if (frame.format() != QImage::Format_RGB32) {
+            frame = frame.convertToFormat(QImage::Format_RGB32);
+        }
+        glitch_pixels(frame, iterations);
+        return;
+    }
+
+    // The JPEG engine always decodes into a new image
+    QImage glitched = glitch_image(frame, iterations, quality);
+    if (glitched.isNull() || glitched.constBits() == frame.constBits()) {
+        return;
+    }
+    glitched = glitched.convertToFormat(QImage::Format_RGB32);
+
+    if (glitched.size() != frame.size() || frame.format() != QImage::Format_RGB32) {
+        frame = glitched;
+        return;
+    }
+
+    // Copied back so `frame` keeps its buffer
+    for (int y = 0; y < frame.height(); ++y) {
+        memcpy(frame.scanLine(y), glitched.constScanLine(y), frame.width() * 4);
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <QImage>
+#include <QPixmap>
+
+#include <vector>
+
+enum GLITCH_ENGINE {
+    Jpeg  = 0,  // Corrupt the scan data of a JPEG encoded copy
+    Pixel = 1,  // Emulate the same artifacts directly on pixel rows
+};
+
+// Entropy-coded data of a JPEG scan, between two markers
+struct JpegSegment {
+    qint64 start;
+    qint64 end;
+};
+
+// Walk the marker segments of a JPEG stream and list the entropy-coded data of every scan, split at restart markers.
+// Returns false when `data` isn't a JPEG stream or has no scan.
+bool jpeg_entropy_segments(const uchar* data, qint64 size, std::vector<JpegSegment> &segments);
+
+// Overwrite runs of scan data with noise. Marker bytes, stuffed zeros, restart markers and EOI are never touched,
+// so the stream still decodes. Returns false when `data` has no scan data.
+bool glitch_jpeg_data(uchar* data, qint64 size, int iterations);
+
+// Glitch a JPEG encoded copy of `source`. Unlike glitch_jpeg_data(), the noise can land on any byte of the scan,
+// like it always did for the page.
+QImage glitch_image(const QImage& source, int iterations, int quality = 90);
+QImage glitch_image_pixels(const QImage& source, int iterations);
+
+QImage glitch_pixmap(const QPixmap& source, int engine, int iterations, int quality = 90);
+
+// Glitch an RGB32 frame in place. Only the jpeg engine needs a temporary copy.
+void glitch_frame(QImage &frame, int engine, int iterations, int quality = 90);
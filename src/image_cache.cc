@@ -0,0 +1,252 @@
+#include "image_cache.h"
+#include "onboard.h"
+#include "sleep_stats.h"
+#include <NickelHook.h>
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QList>
+#include <QMutex>
+#include <QSaveFile>
+#include <QStringList>
+
+#include <utime.h>
+
+constexpr const char* IMAGE_CACHE_PATH = NICKEL_SCREENSAVER_ONBOARD "/.adds/screensaver/.cache";
+constexpr quint32 IMAGE_CACHE_MAGIC = 0x3143534e; // "NSC1"
+
+// Pixel data starts right after the header, followed by `extra_size` bytes of extra data
+struct ImageCacheHeader {
+    quint32 magic;
+    quint32 format;
+    qint32 width;
+    qint32 height;
+    qint32 bytes_per_line;
+    quint32 extra_size;
+    quint32 reserved[2];
+};
+static_assert(sizeof(ImageCacheHeader) == 32, "ImageCacheHeader must keep pixel data 32-bit aligned");
+
+static bool cache_enabled = true;
+static qint64 cache_budget = 64 * 1024 * 1024;
+static int cache_hits = 0;
+static int cache_misses = 0;
+struct PendingEntry {
+    QString key;
+    QImage image;
+    QByteArray extra;
+};
+
+static QList<PendingEntry> pending_entries;
+// Entries read since the last flush, their mtime is updated then so eviction drops the least recently used
+static QStringList used_keys;
+// Lookups and inserts also run on worker threads
+static QMutex cache_mutex;
+
+// Only formats without a color table are stored
+static bool is_cached_format(quint32 format) {
+    return format == QImage::Format_RGB32 || format == QImage::Format_ARGB32 || format == QImage::Format_ARGB32_Premultiplied;
+}
+
+static void count_lookup(bool is_hit) {
+    QMutexLocker locker(&cache_mutex);
+    if (is_hit) {
+        cache_hits++;
+    } else {
+        cache_misses++;
+    }
+}
+
+static QString cache_file_path(const QString &key) {
+    return QString(IMAGE_CACHE_PATH) + '/' + key + ".raw";
+}
+
+static void close_cache_file(void* info) {
+    // Deleting the QFile also unmaps the pixel data
+    delete static_cast<QFile*>(info);
+}
+
+void image_cache_configure(bool enabled, qint64 budget) {
+    cache_enabled = enabled && budget > 0;
+    cache_budget = budget;
+
+    if (!cache_enabled) {
+        QMutexLocker locker(&cache_mutex);
+        pending_entries.clear();
+        used_keys.clear();
+    }
+}
+
+QString image_cache_key(const QString &file_path, QSize screen_size, const char* variant) {
+    QFileInfo info(file_path);
+    sleep_stats_count_fs(1);
+    QString identity = file_path
+        + '|' + QString::number(info.lastModified().toMSecsSinceEpoch())
+        + '|' + QString::number(info.size())
+        + '|' + QString::number(screen_size.width()) + 'x' + QString::number(screen_size.height())
+        + '|' + variant;
+
+    return QString::fromLatin1(QCryptographicHash::hash(identity.toUtf8(), QCryptographicHash::Md5).toHex());
+}
+
+QImage image_cache_lookup(const QString &key, QByteArray *extra) {
+    if (!cache_enabled) {
+        return QImage();
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    QFile* file = new QFile(cache_file_path(key));
+    sleep_stats_count_fs(1);
+    if (!file->open(QIODevice::ReadOnly)) {
+        delete file;
+        count_lookup(false);
+        return QImage();
+    }
+
+    QImage image;
+    qint64 file_size = file->size();
+    const uchar* data = file_size > (qint64)sizeof(ImageCacheHeader) ? file->map(0, file_size) : nullptr;
+    if (data) {
+        const ImageCacheHeader* header = reinterpret_cast<const ImageCacheHeader*>(data);
+        // Damaged or written by another version, the stride must hold a row and the pixels must fit the mapping
+        bool valid = header->magic == IMAGE_CACHE_MAGIC
+            && is_cached_format(header->format)
+            && header->width > 0 && header->height > 0
+            && (qint64)header->bytes_per_line >= (qint64)header->width * 4
+            && (qint64)header->bytes_per_line * header->height + (qint64)sizeof(ImageCacheHeader) + header->extra_size == file_size;
+        if (valid) {
+            if (extra) {
+                const char* extra_data = reinterpret_cast<const char*>(data) + file_size - header->extra_size;
+                *extra = QByteArray(extra_data, header->extra_size);
+            }
+
+            image = QImage(
+                data + sizeof(ImageCacheHeader),
+                header->width,
+                header->height,
+                header->bytes_per_line,
+                (QImage::Format)header->format,
+                close_cache_file,
+                file
+            );
+        }
+    }
+
+    if (image.isNull()) {
+        delete file;
+        // Corrupted or truncated entry
+        QFile::remove(cache_file_path(key));
+        sleep_stats_count_fs(0, 1);
+        count_lookup(false);
+        return QImage();
+    }
+
+    count_lookup(true);
+    {
+        QMutexLocker locker(&cache_mutex);
+        if (!used_keys.contains(key)) {
+            used_keys.append(key);
+        }
+    }
+    nh_log("Image cache hit in %lld ms (hits: %d, misses: %d)", timer.elapsed(), cache_hits, cache_misses);
+    return image;
+}
+
+void image_cache_insert(const QString &key, const QImage &image, const QByteArray &extra) {
+    if (!cache_enabled || image.isNull() || image.byteCount() > cache_budget) {
+        return;
+    }
+
+    QMutexLocker locker(&cache_mutex);
+    pending_entries.append({key, image, extra});
+}
+
+static bool write_cache_entry(const QString &key, QImage image, const QByteArray &extra) {
+    if (!is_cached_format(image.format())) {
+        image = image.convertToFormat(image.hasAlphaChannel() ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32);
+    }
+
+    ImageCacheHeader header = {
+        IMAGE_CACHE_MAGIC,
+        (quint32)image.format(),
+        image.width(),
+        image.height(),
+        image.bytesPerLine(),
+        (quint32)extra.size(),
+        {0, 0},
+    };
+
+    QSaveFile file(cache_file_path(key));
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(image.constBits()), image.byteCount());
+    file.write(extra);
+    return file.commit();
+}
+
+static void evict_cache_entries() {
+    // Most recently used first, remove everything past the budget
+    QDir dir(IMAGE_CACHE_PATH);
+    QFileInfoList entries = dir.entryInfoList(QStringList() << "*.raw", QDir::Files, QDir::Time);
+
+    qint64 total_size = 0;
+    int evicted = 0;
+    for (const QFileInfo &entry : entries) {
+        total_size += entry.size();
+        if (total_size > cache_budget && QFile::remove(entry.filePath())) {
+            evicted++;
+        }
+    }
+
+    if (evicted > 0) {
+        nh_log("Image cache evicted %d entries", evicted);
+    }
+}
+
+void image_cache_flush() {
+    QList<PendingEntry> entries;
+    QStringList used;
+    {
+        QMutexLocker locker(&cache_mutex);
+        entries.swap(pending_entries);
+        used.swap(used_keys);
+    }
+    if (entries.isEmpty() && used.isEmpty()) {
+        return;
+    }
+
+    // Not written on the sleep path, the hits only update the mtime now
+    for (const QString &key : used) {
+        utime(QFile::encodeName(cache_file_path(key)).constData(), nullptr);
+    }
+
+    if (entries.isEmpty()) {
+        return;
+    }
+
+    QDir().mkpath(IMAGE_CACHE_PATH);
+    for (const PendingEntry &entry : entries) {
+        if (!write_cache_entry(entry.key, entry.image, entry.extra)) {
+            nh_log("Couldn't write image cache entry %s", qPrintable(entry.key));
+        }
+    }
+
+    evict_cache_entries();
+}
+
+int image_cache_hits() {
+    return cache_hits;
+}
+
+int image_cache_misses() {
+    return cache_misses;
+}
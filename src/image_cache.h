@@ -0,0 +1,26 @@
+#pragma once
+
+#include <QByteArray>
+#include <QImage>
+#include <QSize>
+#include <QString>
+
+// On-disk cache of decoded images already scaled to the screen size.
+// Entries are raw pixel buffers, memory-mapped back into a QImage on lookup.
+
+void image_cache_configure(bool enabled, qint64 budget);
+
+// Key for `file_path` scaled to `screen_size`, changes when the file is modified
+QString image_cache_key(const QString &file_path, QSize screen_size, const char* variant);
+
+// Returns a null image on miss. `extra` receives the data stored with the image, if any.
+QImage image_cache_lookup(const QString &key, QByteArray *extra = nullptr);
+
+// Entries are only queued here, call image_cache_flush() outside of the sleep path to write them.
+// The flush also marks the entries read since the last one as used, the least recently used go past the budget.
+// `extra` is a small block of data stored after the pixels.
+void image_cache_insert(const QString &key, const QImage &image, const QByteArray &extra = QByteArray());
+void image_cache_flush();
+
+int image_cache_hits();
+int image_cache_misses();
@@ -0,0 +1,139 @@
+#include "kobo_dir.h"
+#include "onboard.h"
+#include "sleep_stats.h"
+#include <NickelHook.h>
+
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QStringList>
+
+#include <cstring>
+
+constexpr const char* KOBO_SCREENSAVER_PATH = NICKEL_SCREENSAVER_ONBOARD "/.kobo/screensaver";
+constexpr const char* SCREENSAVER_PATH      = NICKEL_SCREENSAVER_ONBOARD "/.adds/screensaver";
+constexpr const char* BLANK_FILE_NAME       = "nickel-screensaver.png";
+
+// Black 1x1 PNG file
+static const unsigned char blank_screensaver[] = {
+    0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a, 0x00, 0x00, 0x00, 0x0d,
+    0x49, 0x48, 0x44, 0x52, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01,
+    0x08, 0x00, 0x00, 0x00, 0x00, 0x3a, 0x7e, 0x9b, 0x55, 0x00, 0x00, 0x00,
+    0x0d, 0x49, 0x44, 0x41, 0x54, 0x78, 0xda, 0x01, 0x02, 0x00, 0xfd, 0xff,
+    0x00, 0x00, 0x00, 0x02, 0x00, 0x01, 0x53, 0x2b, 0x9c, 0x30, 0x00, 0x00,
+    0x00, 0x00, 0x49, 0x45, 0x4e, 0x44, 0xae, 0x42, 0x60, 0x82,
+};
+
+// mtime of the blank screensaver when its content was last checked, -1 when unknown
+static qint64 verified_mtime = -1;
+
+static QString blank_path() {
+    return QString(KOBO_SCREENSAVER_PATH) + '/' + BLANK_FILE_NAME;
+}
+
+void kobo_dir_clean() {
+    QDir kobo_dir(KOBO_SCREENSAVER_PATH);
+    QStringList entries = kobo_dir.entryList(QDir::AllEntries | QDir::Hidden | QDir::System | QDir::NoDotAndDotDot, QDir::Unsorted);
+    sleep_stats_count_fs(1);
+
+    entries.removeOne(BLANK_FILE_NAME);
+    if (entries.isEmpty()) {
+        return;
+    }
+
+    nh_log("Cleaning %s (%d entries)", KOBO_SCREENSAVER_PATH, entries.size());
+
+    // Don't move Nickel Screensaver's files
+    static const QStringList exclude = {
+        "_settings.ini",
+        "nickel-screensaver.jpg",
+    };
+    for (const QString &name : entries) {
+        QFileInfo entry(kobo_dir.filePath(name));
+        sleep_stats_count_fs(1);
+
+        // Move old overlay files to .adds/screensaver, without overriding a file with the same name
+        if (entry.isFile() && !entry.isHidden() && !exclude.contains(name)) {
+            QString dest_path = QString(SCREENSAVER_PATH) + '/' + name;
+            sleep_stats_count_fs(1);
+            if (!QFile::exists(dest_path)) {
+                sleep_stats_count_fs(0, 1);
+                if (QFile::rename(entry.filePath(), dest_path)) {
+                    continue;
+                }
+            }
+        }
+
+        sleep_stats_count_fs(0, 1);
+        if (entry.isDir() && !entry.isSymLink()) {
+            QDir(entry.filePath()).removeRecursively();
+        } else {
+            QFile::remove(entry.filePath());
+        }
+    }
+}
+
+// Same size and bytes as blank_screensaver
+static bool is_blank_valid(const QString &file_path) {
+    QFile file(file_path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QByteArray data = file.read(sizeof(blank_screensaver) + 1);
+    return data.size() == (int)sizeof(blank_screensaver) && memcmp(data.constData(), blank_screensaver, sizeof(blank_screensaver)) == 0;
+}
+
+static bool write_blank_screensaver(const QString &file_path) {
+    QFile file(file_path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+
+    qint64 written = file.write(reinterpret_cast<const char*>(blank_screensaver), sizeof(blank_screensaver));
+    file.close();
+
+    return written == (qint64)sizeof(blank_screensaver);
+}
+
+void kobo_dir_set_blank(bool is_needed) {
+    QString file_path = blank_path();
+    QFileInfo info(file_path);
+    sleep_stats_count_fs(1);
+
+    if (!is_needed) {
+        verified_mtime = -1;
+        if (info.exists()) {
+            sleep_stats_count_fs(0, 1);
+            QFile::remove(file_path);
+        }
+        return;
+    }
+
+    qint64 mtime = info.exists() ? info.lastModified().toMSecsSinceEpoch() : -1;
+    if (mtime >= 0 && info.size() == (qint64)sizeof(blank_screensaver)) {
+        // Unchanged since it was last checked
+        if (mtime == verified_mtime) {
+            return;
+        }
+
+        sleep_stats_count_fs(1);
+        if (is_blank_valid(file_path)) {
+            verified_mtime = mtime;
+            return;
+        }
+    }
+
+    nh_log("Writing %s", qPrintable(file_path));
+    sleep_stats_count_fs(0, 1);
+    if (!write_blank_screensaver(file_path)) {
+        nh_log("Couldn't write %s", qPrintable(file_path));
+        verified_mtime = -1;
+        return;
+    }
+
+    QFileInfo written(file_path);
+    sleep_stats_count_fs(1);
+    verified_mtime = written.lastModified().toMSecsSinceEpoch();
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+// Nickel's .kobo/screensaver folder, on the FAT32 partition. It should only hold the blank screensaver,
+// which is kept between sleeps and only removed by a sleep that doesn't hand off a frame.
+// Nothing is written while the folder is already in that state.
+
+// Move files copied into the folder to .adds/screensaver and remove everything else but the blank screensaver.
+// Costs a single listing when there is nothing to clean.
+void kobo_dir_clean();
+
+// Make sure the blank screensaver exists, so Nickel shows it until the frame is handed off, or that it doesn't.
+// It's only rewritten when missing or corrupt.
+void kobo_dir_set_blank(bool is_needed);
@@ -0,0 +1,163 @@
+#include "memory_policy.h"
+#include "frame_pool.h"
+#include "sleep_stats.h"
+#include <NickelHook.h>
+
+#include <QFile>
+#include <QList>
+
+#include <unistd.h>
+#include <zlib.h>
+
+const char* const MEMORY_MODE_NAMES[MEMORY_MODE::ModeCount] = {"auto", "keep", "compact", "release"};
+
+// Below these, the prepared frame is compacted, then nothing is kept at all.
+// A full-screen RGB32 frame is 10 MB on 1404x1872 screens.
+constexpr qint64 COMPACT_BELOW_BYTES = 192LL * 1024 * 1024;
+constexpr qint64 RELEASE_BELOW_BYTES = 64LL * 1024 * 1024;
+
+qint64 memory_policy_available() {
+    // procfs files have no size, read them whole
+    QFile meminfo("/proc/meminfo");
+    if (!meminfo.open(QIODevice::ReadOnly)) {
+        return -1;
+    }
+    QList<QByteArray> lines = meminfo.readAll().split('\n');
+
+    // MemAvailable is only there since Linux 3.14, older kernels get an estimate
+    qint64 available = -1;
+    qint64 estimate = 0;
+    for (const QByteArray &line : lines) {
+        int colon = line.indexOf(':');
+        if (colon < 0) {
+            continue;
+        }
+
+        QByteArray key = line.left(colon);
+        qint64 bytes = line.mid(colon + 1).simplified().split(' ').value(0).toLongLong() * 1024;
+        if (key == "MemAvailable") {
+            available = bytes;
+        } else if (key == "MemFree" || key == "Buffers" || key == "Cached") {
+            estimate += bytes;
+        }
+    }
+
+    return available >= 0 ? available : estimate;
+}
+
+qint64 memory_policy_resident() {
+    QFile statm("/proc/self/statm");
+    if (!statm.open(QIODevice::ReadOnly)) {
+        return 0;
+    }
+
+    return statm.readAll().split(' ').value(1).toLongLong() * sysconf(_SC_PAGESIZE);
+}
+
+int memory_policy_mode(int setting) {
+    if (setting != MEMORY_MODE::Auto) {
+        return setting;
+    }
+
+    qint64 available = memory_policy_available();
+    sleep_stats_count_fs(1);
+    if (available < 0) {
+        return MEMORY_MODE::Keep;
+    }
+
+    if (available < RELEASE_BELOW_BYTES) {
+        return MEMORY_MODE::Release;
+    } else if (available < COMPACT_BELOW_BYTES) {
+        return MEMORY_MODE::Compact;
+    }
+    return MEMORY_MODE::Keep;
+}
+
+// One byte per pixel into `gray`, false as soon as a pixel isn't gray
+static bool pack_gray(const QImage &frame, uchar* gray) {
+    int width = frame.width();
+    for (int y = 0; y < frame.height(); ++y) {
+        const QRgb* row = reinterpret_cast<const QRgb*>(frame.constScanLine(y));
+        for (int x = 0; x < width; ++x) {
+            int v = qBlue(row[x]);
+            if (qRed(row[x]) != v || qGreen(row[x]) != v) {
+                return false;
+            }
+            *gray++ = v;
+        }
+    }
+
+    return true;
+}
+
+CompactFrame memory_policy_compact(const QImage &frame) {
+    CompactFrame compact;
+    if (frame.isNull()) {
+        return compact;
+    }
+
+    compact.size = frame.size();
+    compact.format = frame.format();
+    compact.color_table = frame.colorTable();
+
+    // e-ink frames are mostly gray already, then a quarter of the pixels has to be deflated
+    QByteArray gray;
+    if (frame.format() == QImage::Format_RGB32) {
+        gray.resize(frame.width() * frame.height());
+        compact.is_gray = pack_gray(frame, reinterpret_cast<uchar*>(gray.data()));
+    }
+
+    const uchar* raw = compact.is_gray ? reinterpret_cast<const uchar*>(gray.constData()) : frame.constBits();
+    compact.raw_size = compact.is_gray ? gray.size() : frame.byteCount();
+
+    uLongf data_size = compressBound(compact.raw_size);
+    compact.data.resize(data_size);
+    if (compress2(reinterpret_cast<Bytef*>(compact.data.data()), &data_size, raw, compact.raw_size, Z_BEST_SPEED) != Z_OK) {
+        nh_log("Couldn't compact a %dx%d frame", frame.width(), frame.height());
+        return CompactFrame();
+    }
+    compact.data.resize(data_size);
+    compact.data.squeeze();
+
+    return compact;
+}
+
+QImage memory_policy_expand(const CompactFrame &compact) {
+    if (compact.data.isEmpty()) {
+        return QImage();
+    }
+
+    QImage frame = frame_pool_acquire(compact.size, compact.format);
+    if (frame.isNull()) {
+        return frame;
+    }
+    if (!compact.color_table.isEmpty()) {
+        frame.setColorTable(compact.color_table);
+    }
+
+    // Gray pixels are inflated into the last quarter of the frame, then spread from the front.
+    // Pixel i is written at 4i, never past the gray byte 3n + i that is read for it.
+    uchar* bits = frame.bits();
+    uchar* raw = compact.is_gray ? bits + frame.byteCount() - compact.raw_size : bits;
+    bool is_valid = compact.is_gray
+        ? frame.bytesPerLine() == frame.width() * 4 && compact.raw_size == frame.width() * frame.height()
+        : compact.raw_size == frame.byteCount();
+
+    uLongf raw_size = compact.raw_size;
+    if (!is_valid || uncompress(raw, &raw_size, reinterpret_cast<const Bytef*>(compact.data.constData()), compact.data.size()) != Z_OK
+            || raw_size != (uLongf)compact.raw_size) {
+        nh_log("Couldn't expand a %dx%d frame", compact.size.width(), compact.size.height());
+        frame_pool_release(frame);
+        return QImage();
+    }
+
+    if (compact.is_gray) {
+        QRgb* pixels = reinterpret_cast<QRgb*>(bits);
+        for (int i = 0; i < compact.raw_size; ++i) {
+            int v = raw[i];
+            pixels[i] = qRgb(v, v, v);
+        }
+    }
+
+    return frame;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <QByteArray>
+#include <QImage>
+#include <QSize>
+#include <QVector>
+
+// What the screensaver keeps in memory while the device is awake, Nickel runs in the same process.
+// The mode is picked from /proc/meminfo unless a setting forces it.
+
+enum MEMORY_MODE {
+    Auto      = 0,  // from the memory available
+    Keep      = 1,  // the prepared frame, one idle frame buffer, composited layer and overlay stay, for the fastest sleep
+    Compact   = 2,  // the prepared frame is kept compressed, idle frame buffers are freed
+    Release   = 3,  // nothing is kept or prepared while awake, frames are composited in grayscale
+    ModeCount,
+};
+
+extern const char* const MEMORY_MODE_NAMES[MEMORY_MODE::ModeCount];
+
+// Frame kept deflated, with one byte per pixel when an RGB32 frame is all gray
+struct CompactFrame {
+    QSize size;
+    QImage::Format format = QImage::Format_Invalid;
+    QVector<QRgb> color_table;
+    bool is_gray = false;
+    int raw_size = 0;
+    QByteArray data;
+};
+
+// Bytes that can be allocated without swapping, -1 when /proc/meminfo can't be read
+qint64 memory_policy_available();
+
+// Resident bytes of the whole process, Nickel included, 0 when unknown
+qint64 memory_policy_resident();
+
+// `setting` itself, or the mode for the memory available when it's MEMORY_MODE::Auto
+int memory_policy_mode(int setting);
+
+CompactFrame memory_policy_compact(const QImage &frame);
+
+// The full frame again, taken from the frame pool. Null when `compact` is empty or damaged.
+QImage memory_policy_expand(const CompactFrame &compact);
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <QtGlobal>
+
+// Root of the user storage, host builds point it to a scratch folder
+#ifndef NICKEL_SCREENSAVER_ONBOARD
+    #define NICKEL_SCREENSAVER_ONBOARD "/mnt/onboard"
+#endif
+
+// FAT stores mtime with a 2s resolution
+constexpr qint64 MTIME_RESOLUTION_MS = 2000;
+
+// Whether a file or folder read at `read_at` could have changed since without its `mtime` changing.
+// Only when it was read within the resolution of its mtime, an mtime far off, like a clock in local time
+// against UTC, doesn't make it read again on every sleep.
+inline bool onboard_mtime_ambiguous(qint64 mtime, qint64 read_at) {
+    return qAbs(mtime - read_at) < MTIME_RESOLUTION_MS;
+}
@@ -0,0 +1,130 @@
+#include "overlay_cache.h"
+#include "image_cache.h"
+#include <NickelHook.h>
+
+#include <QList>
+#include <QMutex>
+
+#include <cstring>
+
+// Each one is a full-screen buffer
+constexpr int MEMORY_ENTRIES = 2;
+
+struct OverlayEntry {
+    QString key;
+    ScaledOverlay overlay;
+};
+
+static bool cache_enabled = true;
+// Most recently used first
+static QList<OverlayEntry> memory_entries;
+// Overlays are loaded on worker threads
+static QMutex entries_mutex;
+
+static ScaledOverlay remember(const QString &key, ScaledOverlay overlay, bool with_gray) {
+    if (with_gray && overlay.gray.isEmpty()) {
+        overlay.gray = overlay_gray_planes(overlay.image);
+    }
+    if (!cache_enabled) {
+        return overlay;
+    }
+
+    QMutexLocker locker(&entries_mutex);
+    for (int i = 0; i < memory_entries.size(); ++i) {
+        if (memory_entries.at(i).key == key) {
+            memory_entries.removeAt(i);
+            break;
+        }
+    }
+    memory_entries.prepend({key, overlay});
+    while (memory_entries.size() > MEMORY_ENTRIES) {
+        memory_entries.removeLast();
+    }
+
+    return overlay;
+}
+
+void overlay_cache_configure(bool enabled) {
+    cache_enabled = enabled;
+    if (!enabled) {
+        QMutexLocker locker(&entries_mutex);
+        memory_entries.clear();
+    }
+}
+
+ScaledOverlay overlay_cache_find(const QString &key, bool with_gray) {
+    QMutexLocker locker(&entries_mutex);
+    for (int i = 0; i < memory_entries.size(); ++i) {
+        if (memory_entries.at(i).key == key) {
+            memory_entries.move(i, 0);
+            ScaledOverlay &overlay = memory_entries.first().overlay;
+            // Made the first time the grayscale compositor needs them
+            if (with_gray && overlay.gray.isEmpty()) {
+                overlay.gray = overlay_gray_planes(overlay.image);
+            }
+            nh_log("Overlay found in memory");
+            return overlay;
+        }
+    }
+
+    return ScaledOverlay();
+}
+
+ScaledOverlay overlay_cache_lookup(const QString &key, bool with_gray) {
+    ScaledOverlay overlay = overlay_cache_find(key, with_gray);
+    if (!overlay.image.isNull()) {
+        return overlay;
+    }
+
+    QByteArray extra;
+    overlay.image = image_cache_lookup(key, &extra);
+    if (overlay.image.isNull()) {
+        return overlay;
+    }
+
+    if (overlay.image.format() != QImage::Format_ARGB32_Premultiplied) {
+        return overlay_cache_insert(key, overlay.image, with_gray);
+    }
+
+    int rows_size = overlay.image.height() * (int)sizeof(OverlaySpan);
+    if (extra.size() != rows_size) {
+        // Written before spans were stored, or with another layout
+        return overlay_cache_insert(key, overlay.image, with_gray);
+    }
+
+    overlay.rows.resize(overlay.image.height());
+    memcpy(overlay.rows.data(), extra.constData(), rows_size);
+    return remember(key, overlay, with_gray);
+}
+
+ScaledOverlay overlay_cache_insert(const QString &key, const QImage &image, bool with_gray) {
+    ScaledOverlay overlay;
+    overlay.image = image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    overlay.rows = overlay_spans(overlay.image);
+
+    QByteArray extra(reinterpret_cast<const char*>(overlay.rows.constData()), overlay.rows.size() * (int)sizeof(OverlaySpan));
+    image_cache_insert(key, overlay.image, extra);
+    return remember(key, overlay, with_gray);
+}
+
+ScaledOverlay overlay_cache_keep(const QString &key, const ScaledOverlay &overlay, bool with_gray) {
+    return remember(key, overlay, with_gray);
+}
+
+void overlay_cache_trim(int max_entries) {
+    QMutexLocker locker(&entries_mutex);
+    while (memory_entries.size() > qMax(0, max_entries)) {
+        memory_entries.removeLast();
+    }
+}
+
+qint64 overlay_cache_bytes() {
+    QMutexLocker locker(&entries_mutex);
+    qint64 bytes = 0;
+    for (const OverlayEntry &entry : memory_entries) {
+        const ScaledOverlay &overlay = entry.overlay;
+        bytes += overlay.image.byteCount() + overlay.gray.size() + overlay.rows.size() * (qint64)sizeof(OverlaySpan);
+    }
+
+    return bytes;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "compositor.h"
+
+#include <QImage>
+#include <QString>
+#include <QVector>
+
+// Overlays already premultiplied at the screen size, with the span of every row that needs blending.
+// The most recent ones stay in memory, the others are kept in the image cache with their spans.
+
+struct ScaledOverlay {
+    QImage image;                // ARGB32_Premultiplied
+    QVector<OverlaySpan> rows;   // one per row of `image`
+    QByteArray gray;             // overlay_gray_planes() of `image`, only made for the grayscale compositor
+};
+
+void overlay_cache_configure(bool enabled);
+
+// Returns a null image on miss. The memory entries are searched first, then the image cache.
+// With `with_gray`, the gray planes are made once and kept in memory along with the overlay.
+ScaledOverlay overlay_cache_lookup(const QString &key, bool with_gray = false);
+
+// Same, only in memory
+ScaledOverlay overlay_cache_find(const QString &key, bool with_gray = false);
+
+// Convert `image` if needed, measure its spans and keep it in memory. It's written to disk by image_cache_flush().
+ScaledOverlay overlay_cache_insert(const QString &key, const QImage &image, bool with_gray = false);
+
+// Keep an overlay that is stored elsewhere, like in the bundle, in memory only
+ScaledOverlay overlay_cache_keep(const QString &key, const ScaledOverlay &overlay, bool with_gray = false);
+
+// Drop the least recently used overlays from memory until at most `max_entries` are left, the image cache keeps them
+void overlay_cache_trim(int max_entries);
+
+// Bytes held by the overlays in memory, with their spans and gray planes
+qint64 overlay_cache_bytes();
@@ -0,0 +1,527 @@
+#include "pipeline.h"
+#include "bundle.h"
+#include "composition_cache.h"
+#include "compositor.h"
+#include "decoder.h"
+#include "file_index.h"
+#include "frame_pool.h"
+#include "glitch.h"
+#include "image_cache.h"
+#include "sleep_stats.h"
+#include "worker_pool.h"
+#include <NickelHook.h>
+
+#include <QBuffer>
+#include <QElapsedTimer>
+#include <QFile>
+
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+QString pick_random_file(QDir dir, QStringList filters, int selection_mode) {
+    // The bundle's listing needs no folder scan
+    QStringList files;
+    if (bundle_list(dir.path(), filters, files)) {
+        return file_index_pick_listed(dir.path(), filters, files, selection_mode);
+    }
+
+    // Uses the cached listing unless the folder has changed
+    return file_index_pick(dir.path(), filters, selection_mode);
+}
+
+void configure_pipeline(const ScreensaverSettings &settings) {
+    image_cache_configure(settings.cache_enabled, (qint64)settings.cache_size * 1024 * 1024);
+    decoder_configure((qint64)settings.decode_budget * 1024 * 1024);
+    overlay_cache_configure(settings.cache_enabled);
+    composition_cache_configure(settings.cache_enabled);
+}
+
+QImage load_scaled_image(const QString& file_path, QSize screen_size) {
+    SleepStageTimer stage_timer(SLEEP_STAGE::Decode);
+
+    // Already scaled in the bundle
+    QImage image = bundle_image(file_path);
+    if (!image.isNull()) {
+        return image;
+    }
+
+    QString cache_key = image_cache_key(file_path, screen_size, "image");
+    image = image_cache_lookup(cache_key);
+    if (!image.isNull()) {
+        return image;
+    }
+
+    // Never holds the full-size image, oversized files are skipped
+    QElapsedTimer timer;
+    timer.start();
+    image = decode_scaled(file_path, screen_size);
+    nh_log("Image cache miss, decoded in %lld ms (hits: %d, misses: %d)", timer.elapsed(), image_cache_hits(), image_cache_misses());
+    if (!image.isNull()) {
+        image_cache_insert(cache_key, image);
+    }
+
+    return image;
+}
+
+// The file mapped copy-on-write, only the pages the glitch writes to are copied
+static QImage decode_glitched_jpeg(const QString& file_path, QSize screen_size, int iterations) {
+    int fd = open(QFile::encodeName(file_path).constData(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return QImage();
+    }
+
+    struct stat info;
+    bool is_valid = fstat(fd, &info) == 0 && info.st_size > 4 && info.st_size < INT_MAX;
+    void* data = is_valid ? mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED) {
+        return QImage();
+    }
+
+    QImage image;
+    if (glitch_jpeg_data(static_cast<uchar*>(data), info.st_size, iterations)) {
+        QByteArray bytes = QByteArray::fromRawData(static_cast<const char*>(data), info.st_size);
+        QBuffer buffer(&bytes);
+        buffer.open(QIODevice::ReadOnly);
+        image = decode_scaled(&buffer, file_path, screen_size);
+    }
+    munmap(data, info.st_size);
+
+    return image;
+}
+
+QImage load_glitched_image(const QString& file_path, QSize screen_size, int iterations, int engine, int quality) {
+    QImage image;
+    {
+        SleepStageTimer stage_timer(SLEEP_STAGE::Decode);
+        image = decode_glitched_jpeg(file_path, screen_size, iterations);
+    }
+    if (!image.isNull()) {
+        return image;
+    }
+
+    // Not a JPEG file, the cached or bundled image is glitched in a copy
+    image = load_scaled_image(file_path, screen_size);
+    if (!image.isNull()) {
+        SleepStageTimer stage_timer(SLEEP_STAGE::Glitch);
+        glitch_frame(image, engine, iterations, quality);
+    }
+
+    return image;
+}
+
+// Overlays are cached already scaled and premultiplied, with the rows they cover
+ScaledOverlay load_scaled_overlay(const QString& file_path, QSize screen_size, bool with_gray) {
+    SleepStageTimer stage_timer(SLEEP_STAGE::Decode);
+
+    QString cache_key = image_cache_key(file_path, screen_size, "overlay");
+    ScaledOverlay overlay = overlay_cache_find(cache_key, with_gray);
+    if (!overlay.image.isNull()) {
+        return overlay;
+    }
+
+    // Stored premultiplied in the bundle, with its spans
+    QByteArray rows;
+    overlay.image = bundle_image(file_path, &rows);
+    if (!overlay.image.isNull()) {
+        if (overlay.image.format() != QImage::Format_ARGB32_Premultiplied) {
+            overlay.image = overlay.image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+        }
+        if (rows.size() == overlay.image.height() * (int)sizeof(OverlaySpan)) {
+            overlay.rows.resize(overlay.image.height());
+            memcpy(overlay.rows.data(), rows.constData(), rows.size());
+        } else {
+            overlay.rows = overlay_spans(overlay.image);
+        }
+        return overlay_cache_keep(cache_key, overlay, with_gray);
+    }
+
+    overlay = overlay_cache_lookup(cache_key, with_gray);
+    if (!overlay.image.isNull()) {
+        return overlay;
+    }
+
+    QImage image = decode_scaled(file_path, screen_size);
+    if (image.isNull()) {
+        return overlay;
+    }
+
+    return overlay_cache_insert(cache_key, image, with_gray);
+}
+
+SleepPlan pick_plan(const QString &screensaver_path, QSize screen_size, bool is_reading, int selection_mode) {
+    SleepPlan plan;
+
+    // Files are picked from the bundle when there's one for this screen
+    bundle_open(screensaver_path, screen_size);
+
+    QDir screensaver_dir(screensaver_path);
+    QDir wallpaper_dir(screensaver_path + "/wallpaper");
+    QDir wallpaper_overlay_dir(screensaver_path + "/wallpaper/overlay");
+
+    plan.display_mode = is_reading ? DISPLAY_MODE::Book : DISPLAY_MODE::Wallpaper;
+
+    // Pick a random overlay file
+    QString random_file;
+    if (is_reading) {
+        random_file = pick_random_file(screensaver_dir, QStringList() << "*.png" << "*.jpg", selection_mode);
+    } else {
+        // Only accept PNG file in wallpaper's overlay folder
+        random_file = pick_random_file(wallpaper_overlay_dir, QStringList() << "*.png", selection_mode);
+    }
+    if (!random_file.isEmpty()) {
+        plan.picked_files << random_file;
+        if (random_file.endsWith(".png")) {
+            // Add Overlay mode
+            plan.display_mode |= DISPLAY_MODE::Overlay;
+            plan.overlay_file = random_file;
+        } else {
+            // To Wallpaper only mode
+            plan.display_mode = DISPLAY_MODE::Wallpaper;
+            plan.wallpaper_file = random_file;
+        }
+    }
+
+    if ((plan.display_mode & DISPLAY_MODE::Wallpaper) && plan.wallpaper_file.isEmpty()) {
+        // Find a random wallpaper in screensaver/wallpaper/
+        QString random_file = pick_random_file(wallpaper_dir, QStringList() << "*.png" << "*.jpg" << "cover", selection_mode);
+        if (!random_file.isEmpty()) {
+            plan.picked_files << random_file;
+        }
+        if (random_file.isEmpty()) {
+            if (plan.overlay_file.isEmpty()) {
+                // No overlay+wallpaper -> switch to None mode
+                plan.display_mode = DISPLAY_MODE::None;
+            } else {
+                // Has overlay but not wallpaper -> Set to overlay cover mode
+                plan.is_overlay_wallpaper = true;
+                plan.display_mode &= ~DISPLAY_MODE::Wallpaper;
+            }
+        } else {
+            if (random_file.endsWith("/cover")) {
+                plan.is_overlay_wallpaper = true;
+                plan.display_mode &= ~DISPLAY_MODE::Wallpaper;
+            } else {
+                plan.wallpaper_file = random_file;
+            }
+        }
+    }
+
+    return plan;
+}
+
+// Layers decoded on the worker threads for the plan with these files
+struct PlanLayers {
+    QString wallpaper_file;
+    QString overlay_file;
+    QSize screen_size;
+    int wallpaper_glitch = 0;
+    QImage wallpaper;
+    ScaledOverlay overlay;
+};
+
+// Each start has its own layers and jobs, a dropped start is never waited for and its results are thrown away
+struct StartedLayers {
+    QSharedPointer<PlanLayers> layers;
+    QSharedPointer<WorkerJob> wallpaper_job;
+    QSharedPointer<WorkerJob> overlay_job;
+};
+
+static StartedLayers started;
+
+// Layers of a plan that can be taken from the composition cache, empty when they change every time
+struct LayerKeys {
+    QString tint;   // the wallpaper under the color overlay
+    QString frame;  // every layer, the frame or the overlay of cover mode
+};
+
+static QColor plan_color_overlay(const SleepPlan &plan, const ScreensaverSettings &settings) {
+    bool is_book = plan.display_mode & DISPLAY_MODE::Book;
+    const QString &color_overlay_hex = is_book ? settings.book_color_overlay : settings.wallpaper_color_overlay;
+    int color_overlay_alpha = is_book ? settings.book_color_overlay_alpha : settings.wallpaper_color_overlay_alpha;
+
+    QColor color_overlay;
+    if (!color_overlay_hex.isEmpty() && color_overlay_alpha > 0) {
+        color_overlay.setNamedColor("#" + color_overlay_hex);
+        if (color_overlay.isValid()) {
+            color_overlay.setAlpha(color_overlay_alpha * 255 / 100);
+        }
+    }
+
+    return color_overlay;
+}
+
+// Each layer is keyed by the identity of its files, the settings it uses and the layer below it
+static LayerKeys plan_layer_keys(const SleepPlan &plan, const ScreensaverSettings &settings, QSize screen_size, const QColor &color_overlay) {
+    LayerKeys keys;
+    if (!settings.cache_enabled || !(plan.display_mode & DISPLAY_MODE::Overlay) || plan.overlay_file.isEmpty()) {
+        return keys;
+    }
+
+    QString overlay = image_cache_key(plan.overlay_file, screen_size, "overlay");
+    QString color = color_overlay.isValid() && color_overlay.alpha() > 0 ? QString::number(color_overlay.rgba(), 16) : QString();
+    if (plan.is_overlay_wallpaper) {
+        QString size = QString("%1x%2").arg(screen_size.width()).arg(screen_size.height());
+        keys.frame = composition_cache_key("cover", QStringList() << size << color << overlay);
+        return keys;
+    }
+
+    // The page and a glitched wallpaper are different every time
+    if ((plan.display_mode & DISPLAY_MODE::Book) || plan.wallpaper_file.isEmpty() || plan.wallpaper_glitch > 0) {
+        return keys;
+    }
+
+    QString wallpaper = image_cache_key(plan.wallpaper_file, screen_size, "image");
+    if (settings.grayscale_enabled) {
+        // The color overlay is blended in grayscale, only the whole frame is kept
+        keys.frame = composition_cache_key("gray", QStringList() << wallpaper << color << overlay << QString::number(settings.grayscale_dither));
+        return keys;
+    }
+
+    if (!color.isEmpty()) {
+        keys.tint = composition_cache_key("tint", QStringList() << wallpaper << color);
+    }
+    keys.frame = composition_cache_key("rgb", QStringList() << (keys.tint.isEmpty() ? wallpaper : keys.tint) << overlay);
+    return keys;
+}
+
+static QImage load_plan_wallpaper(const QString &file_path, QSize screen_size, int glitch, const ScreensaverSettings &settings) {
+    if (glitch > 0) {
+        return load_glitched_image(file_path, screen_size, glitch, settings.glitch_engine, settings.glitch_quality);
+    }
+
+    return load_scaled_image(file_path, screen_size);
+}
+
+void cancel_plan_layers() {
+    if (started.wallpaper_job) {
+        started.wallpaper_job->cancel();
+    }
+    if (started.overlay_job) {
+        started.overlay_job->cancel();
+    }
+    started = StartedLayers();
+}
+
+bool plan_layers_ready() {
+    return (!started.wallpaper_job || started.wallpaper_job->is_done())
+        && (!started.overlay_job || started.overlay_job->is_done());
+}
+
+void start_plan_layers(const SleepPlan &plan, const ScreensaverSettings &settings, QSize screen_size) {
+    cancel_plan_layers();
+
+    // Layers under a cached one aren't decoded
+    LayerKeys keys = plan_layer_keys(plan, settings, screen_size, plan_color_overlay(plan, settings));
+    bool is_cached = composition_cache_contains(keys.frame);
+
+    QSharedPointer<PlanLayers> layers(new PlanLayers());
+    if (!is_cached && !composition_cache_contains(keys.tint)) {
+        layers->wallpaper_file = plan.wallpaper_file;
+    }
+    if (!is_cached && (plan.display_mode & DISPLAY_MODE::Overlay)) {
+        layers->overlay_file = plan.overlay_file;
+    }
+    layers->screen_size = screen_size;
+    layers->wallpaper_glitch = plan.wallpaper_glitch;
+    started.layers = layers;
+
+    // Grayscale frames blend the gray planes of the overlay, cover mode blends its pixels
+    bool with_gray = settings.grayscale_enabled && !plan.is_overlay_wallpaper;
+
+    // Each task only writes its own layer
+    if (!layers->wallpaper_file.isEmpty()) {
+        QString file_path = layers->wallpaper_file;
+        int glitch = layers->wallpaper_glitch;
+        started.wallpaper_job = worker_pool_start([layers, file_path, screen_size, glitch, settings]() {
+            layers->wallpaper = load_plan_wallpaper(file_path, screen_size, glitch, settings);
+        });
+    }
+    if (!layers->overlay_file.isEmpty()) {
+        QString file_path = layers->overlay_file;
+        started.overlay_job = worker_pool_start([layers, file_path, screen_size, with_gray]() {
+            layers->overlay = load_scaled_overlay(file_path, screen_size, with_gray);
+        });
+    }
+}
+
+// Wait for the layers started for `plan`, or decode the ones it needs now when they weren't started
+static PlanLayers take_plan_layers(const SleepPlan &plan, const ScreensaverSettings &settings, QSize screen_size, bool needs_wallpaper, bool needs_overlay) {
+    // A job still queued behind other work runs here instead of waiting for it
+    if (started.wallpaper_job) {
+        started.wallpaper_job->finish();
+    }
+    if (started.overlay_job) {
+        started.overlay_job->finish();
+    }
+
+    PlanLayers layers;
+    if (started.layers && started.layers->screen_size == screen_size) {
+        layers = *started.layers;
+    }
+    layers.screen_size = screen_size;
+
+    if (layers.wallpaper_file != plan.wallpaper_file || layers.wallpaper_glitch != plan.wallpaper_glitch) {
+        layers.wallpaper_file = plan.wallpaper_file;
+        layers.wallpaper_glitch = plan.wallpaper_glitch;
+        layers.wallpaper = QImage();
+    }
+    if (needs_wallpaper && layers.wallpaper.isNull() && !plan.wallpaper_file.isEmpty()) {
+        layers.wallpaper = load_plan_wallpaper(plan.wallpaper_file, screen_size, plan.wallpaper_glitch, settings);
+    }
+
+    QString overlay_file = (plan.display_mode & DISPLAY_MODE::Overlay) ? plan.overlay_file : QString();
+    if (layers.overlay_file != overlay_file) {
+        layers.overlay_file = overlay_file;
+        layers.overlay = ScaledOverlay();
+    }
+    if (needs_overlay && layers.overlay.image.isNull() && !overlay_file.isEmpty()) {
+        layers.overlay = load_scaled_overlay(overlay_file, screen_size, settings.grayscale_enabled && !plan.is_overlay_wallpaper);
+    }
+
+    started = StartedLayers();
+    return layers;
+}
+
+void glitch_screenshot(const ScreensaverSettings &settings, QImage &frame) {
+    if (!settings.glitch_enabled || frame.isNull()) {
+        return;
+    }
+
+    glitch_frame(frame, settings.glitch_engine, settings.glitch_iterations, settings.glitch_quality);
+}
+
+void render_plan(const SleepPlan &plan, const ScreensaverSettings &settings, QSize screen_size, QImage &image, QPixmap &overlay_out) {
+    QColor color_overlay = plan_color_overlay(plan, settings);
+    LayerKeys keys = plan_layer_keys(plan, settings, screen_size, color_overlay);
+
+    // Shown before with the same files and settings
+    if (plan.is_overlay_wallpaper) {
+        QPixmap cached = composition_cache_lookup_pixmap(keys.frame);
+        if (!cached.isNull()) {
+            take_plan_layers(plan, settings, screen_size, false, false);
+            overlay_out = cached;
+            return;
+        }
+    } else {
+        QImage cached = composition_cache_lookup(keys.frame);
+        if (!cached.isNull()) {
+            take_plan_layers(plan, settings, screen_size, false, false);
+            frame_pool_release(image);
+            image = cached;
+            return;
+        }
+    }
+
+    // Only the overlay changed, the wallpaper under the color overlay is reused
+    QImage tint = composition_cache_lookup(keys.tint);
+
+    // Join the decoding started by start_plan_layers()
+    PlanLayers layers = take_plan_layers(plan, settings, screen_size, tint.isNull(), true);
+
+    // If not overlay mode -> only load the wallpaper file
+    if (!(plan.display_mode & DISPLAY_MODE::Overlay)) {
+        if (!plan.wallpaper_file.isEmpty()) {
+            frame_pool_release(image);
+            image = layers.wallpaper;
+            if (SleepSample* sample = sleep_stats_current()) {
+                sample->wallpaper_size = image.size();
+            }
+        }
+
+        return;
+    }
+
+    QImage wallpaper_image;
+    if (plan.display_mode & DISPLAY_MODE::Wallpaper and !plan.wallpaper_file.isEmpty()) {
+        wallpaper_image = layers.wallpaper;
+        if (SleepSample* sample = sleep_stats_current()) {
+            sample->wallpaper_size = wallpaper_image.size();
+        }
+    }
+
+    // Image overlay layer
+    bool is_book = plan.display_mode & DISPLAY_MODE::Book;
+    const ScaledOverlay &scaled_overlay = layers.overlay;
+    if (!plan.overlay_file.isEmpty()) {
+        if (SleepSample* sample = sleep_stats_current()) {
+            sample->overlay_size = scaled_overlay.image.size();
+        }
+    }
+    const QImage &overlay = scaled_overlay.image;
+
+    if (!wallpaper_image.isNull()) {
+        nh_log("wallpaper_image %d %d", wallpaper_image.width(), wallpaper_image.height());
+    }
+
+    SleepStageTimer stage_timer(SLEEP_STAGE::Composite);
+    QElapsedTimer timer;
+    timer.start();
+
+    // Cover mode needs the alpha channel, so it's painted with QPainter
+    if (plan.is_overlay_wallpaper) {
+        if (overlay_out.isNull() || overlay_out.size() != screen_size) {
+            overlay_out = QPixmap(screen_size);
+        }
+        overlay_out.fill(Qt::transparent);
+        composite_layers(&overlay_out, screen_size, QImage(), QPixmap(), color_overlay, overlay);
+        if (!overlay.isNull()) {
+            composition_cache_insert(keys.frame, overlay_out);
+        }
+
+        nh_log("Composited cover overlay in %lld ms", timer.elapsed());
+        return;
+    }
+
+    // The captured page is blended in place, layers are drawn at (0, 0) and the parts outside of the screen are cropped
+    bool in_place = is_book && !image.isNull() && image.size() == screen_size && image.format() == QImage::Format_RGB32;
+
+    if (settings.grayscale_enabled) {
+        QImage gray = composite_grayscale(screen_size, in_place ? image : wallpaper_image, color_overlay, overlay, settings.grayscale_dither,
+            scaled_overlay.gray, scaled_overlay.rows.constData());
+        frame_pool_release(image);
+        image = gray;
+        if (!wallpaper_image.isNull() && !overlay.isNull()) {
+            composition_cache_insert(keys.frame, image);
+        }
+
+        // 1 byte per pixel for the frame, luma + alpha planes for the overlay
+        nh_log("Composited grayscale frame in %lld ms (%d bytes)", timer.elapsed(), image.byteCount() + (overlay.isNull() ? 0 : 2 * overlay.width() * overlay.height()));
+        return;
+    }
+
+    // Combine overlay & wallpaper into target image
+    if (in_place) {
+        composite_fused(image, image, color_overlay, overlay, scaled_overlay.rows.constData());
+    } else {
+        // The wallpaper under the color overlay is kept on its own, so changing the overlay only blends the overlay
+        QImage base = wallpaper_image;
+        QColor base_color = color_overlay;
+        if (!keys.tint.isEmpty() && (!tint.isNull() || !wallpaper_image.isNull())) {
+            if (tint.isNull()) {
+                tint = frame_pool_acquire(screen_size, QImage::Format_RGB32);
+                composite_fused(tint, wallpaper_image, color_overlay, QImage());
+                composition_cache_insert(keys.tint, tint);
+            }
+            base = tint;
+            base_color = QColor();
+        }
+
+        if (image.isNull() || image.size() != screen_size || image.format() != QImage::Format_RGB32 || !image.isDetached()) {
+            frame_pool_release(image);
+            image = frame_pool_acquire(screen_size, QImage::Format_RGB32);
+        }
+        composite_fused(image, base, base_color, overlay, scaled_overlay.rows.constData());
+        // A layer that couldn't be decoded might be next time
+        if (!base.isNull() && !overlay.isNull()) {
+            composition_cache_insert(keys.frame, image);
+        }
+    }
+
+    // 4 bytes per pixel for the frame and the overlay
+    nh_log("Composited RGB frame in %lld ms (%d bytes)", timer.elapsed(), image.byteCount() + overlay.byteCount());
+}
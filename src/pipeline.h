@@ -0,0 +1,62 @@
+#pragma once
+
+#include "display_mode.h"
+#include "overlay_cache.h"
+#include "settings.h"
+
+#include <QDir>
+#include <QImage>
+#include <QPixmap>
+#include <QSize>
+#include <QString>
+#include <QStringList>
+
+// Everything between picking the files and the final frame.
+// Only nh_log() is needed from NickelHook, so it can also be built for the host.
+
+struct SleepPlan {
+    int display_mode = DISPLAY_MODE::None;
+    bool is_overlay_wallpaper = false;
+    QString overlay_file;
+    QString wallpaper_file;
+    // Glitch iterations of the wallpaper, 0 when it isn't glitched
+    int wallpaper_glitch = 0;
+    // Every file picked, "cover" included, for file_index_shown() once the frame is shown
+    QStringList picked_files;
+};
+
+QString pick_random_file(QDir dir, QStringList filters, int selection_mode);
+// Apply the cache and decoder settings
+void configure_pipeline(const ScreensaverSettings &settings);
+
+QImage load_scaled_image(const QString& file_path, QSize screen_size);
+// Glitch a JPEG wallpaper from its original bytes: the scan data is corrupted in a private mapping of the file
+// and decoded scaled by libjpeg, so nothing is encoded. Other files are glitched by `engine` once decoded.
+QImage load_glitched_image(const QString& file_path, QSize screen_size, int iterations, int engine, int quality);
+// With `with_gray`, the gray planes of the grayscale compositor come with it
+ScaledOverlay load_scaled_overlay(const QString& file_path, QSize screen_size, bool with_gray = false);
+
+// Pick the files of the next screensaver in `screensaver_path`, or in its bundle built for `screen_size`
+SleepPlan pick_plan(const QString &screensaver_path, QSize screen_size, bool is_reading, int selection_mode);
+
+// Decode the wallpaper and the overlay of `plan` on the worker threads, while the GUI thread captures the page.
+// render_plan() waits for them, it decodes them itself when they weren't started.
+// Layers under one kept by the composition cache aren't decoded.
+// A start replaces the previous one, whose jobs are cancelled and whose results are dropped.
+void start_plan_layers(const SleepPlan &plan, const ScreensaverSettings &settings, QSize screen_size);
+
+// Drop the layers being decoded, a job already running finishes on its own and isn't waited for
+void cancel_plan_layers();
+
+// Whether the layers started last are decoded, without waiting
+bool plan_layers_ready();
+
+// Glitch the captured page in place, does nothing when glitching is disabled
+void glitch_screenshot(const ScreensaverSettings &settings, QImage &frame);
+
+// Composite the layers of a plan into `image`, or into `overlay_out` in cover mode.
+// In Book mode `image` holds the captured page and is blended in place.
+// New frames come from the frame pool, `image` is reused when it's already a detached RGB32 frame.
+// Frames that don't depend on the page are kept in the composition cache, along with the wallpaper under
+// the color overlay, and reused when the same files and settings come back.
+void render_plan(const SleepPlan &plan, const ScreensaverSettings &settings, QSize screen_size, QImage &image, QPixmap &overlay_out);
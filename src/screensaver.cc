@@ -1,50 +1,50 @@
 #include "screensaver.h"
+#include "bundle.h"
+#include "capture.h"
+#include "composition_cache.h"
+#include "file_index.h"
+#include "frame_pool.h"
+#include "frame_widget.h"
+#include "image_cache.h"
+#include "kobo_dir.h"
+#include "memory_policy.h"
+#include "onboard.h"
+#include "overlay_cache.h"
+#include "pipeline.h"
+#include "sleep_deadline.h"
+#include "sleep_lifecycle.h"
+#include "sleep_stats.h"
 #include <NickelHook.h>
 
 #include <QtGlobal>
 #include <QApplication>
 #include <QWidget>
-#include <QLabel>
-#include <QDesktopWidget>
 #include <QScreen>
 #include <QDir>
 #include <QTime>
-#include <QPainter>
 #include <QFile>
 #include <QSettings>
 #include <QFileInfo>
-#include <QBuffer>
-#include <QImageReader>
+#include <QTimer>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QEvent>
+#include <QList>
+#include <QPointer>
 
 typedef void N3PowerWorkflowManager;
 typedef void PowerViewController;
 typedef QWidget BookCoverDragonPowerView;
 
-constexpr const char* BOOK_COLOR_OVERLAY            = "Book/ColorOverlay";
-constexpr const char* BOOK_COLOR_OVERLAY_ALPHA      = "Book/ColorOverlayAlpha";
-constexpr const char* WALLPAPER_COLOR_OVERLAY       = "Wallpaper/ColorOverlay";
-constexpr const char* WALLPAPER_COLOR_OVERLAY_ALPHA = "Wallpaper/ColorOverlayAlpha";
+// Delay before running background work after the sleep view is shown
+constexpr int IDLE_DELAY_MS = 5000;
+// Delay between checks of the layers of the frame being prerendered
+constexpr int PRERENDER_POLL_MS = 50;
+// Spare frame buffers, composited layers and overlays kept in memory while awake in Keep mode
+constexpr int KEEP_IDLE_ENTRIES = 1;
 
-constexpr const char* GLITCH_ENABLED    = "Glitch/Enabled";
-constexpr const char* GLITCH_ITERATIONS = "Glitch/Iterations";
-constexpr const char* GLITCH_QUALITY    = "Glitch/Quality";
-
-enum DISPLAY_MODE {
-    None      = 0b00000,
-    Overlay   = 0b00001,
-    Book      = 0b00010,
-    Wallpaper = 0b00100,
-};
-
-// Black 1x1 PNG file
-unsigned char blank_screensaver[] = {
-    0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a, 0x00, 0x00, 0x00, 0x0d,
-    0x49, 0x48, 0x44, 0x52, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01,
-    0x08, 0x00, 0x00, 0x00, 0x00, 0x3a, 0x7e, 0x9b, 0x55, 0x00, 0x00, 0x00,
-    0x0d, 0x49, 0x44, 0x41, 0x54, 0x78, 0xda, 0x01, 0x02, 0x00, 0xfd, 0xff,
-    0x00, 0x00, 0x00, 0x02, 0x00, 0x01, 0x53, 0x2b, 0x9c, 0x30, 0x00, 0x00,
-    0x00, 0x00, 0x49, 0x45, 0x4e, 0x44, 0xae, 0x42, 0x60, 0x82,
-};
+constexpr const char* SCREENSAVER_PATH      = NICKEL_SCREENSAVER_ONBOARD "/.adds/screensaver";
+constexpr const char* KOBO_SCREENSAVER_PATH = NICKEL_SCREENSAVER_ONBOARD "/.kobo/screensaver";
 
 void (*N3PowerWorkflowManager_handleSleep)(N3PowerWorkflowManager* self);
 void (*N3PowerWorkflowManager_showSleepView)(N3PowerWorkflowManager* self);
@@ -64,33 +64,9 @@ struct nh_info nickelscreensaver = {
     .uninstall_flag = NICKEL_SCREENSAVER_DELETE_FILE,
 };
 
+// Rewrite the file with every setting validated, missing ones are added with their defaults
 void save_settings(QSettings &settings) {
-    // Book
-    QString book_color_overlay = settings.value(BOOK_COLOR_OVERLAY, "ffffff").toString();
-    settings.setValue(BOOK_COLOR_OVERLAY, book_color_overlay);
-
-    int book_color_overlay_alpha = qBound(0, settings.value(BOOK_COLOR_OVERLAY_ALPHA, 0).toInt(), 100);
-    settings.setValue(BOOK_COLOR_OVERLAY_ALPHA, book_color_overlay_alpha);
-
-    // Wallpaper
-    QString wallpaper_color_overlay = settings.value(WALLPAPER_COLOR_OVERLAY, "ffffff").toString();
-    settings.setValue(WALLPAPER_COLOR_OVERLAY, wallpaper_color_overlay);
-
-    int wallpaper_color_overlay_alpha = qBound(0, settings.value(WALLPAPER_COLOR_OVERLAY_ALPHA, 0).toInt(), 100);
-    settings.setValue(WALLPAPER_COLOR_OVERLAY_ALPHA, wallpaper_color_overlay_alpha);
-
-    // Glitch
-    bool glitch_enabled = settings.value(GLITCH_ENABLED, false).toBool();
-    settings.setValue(GLITCH_ENABLED, glitch_enabled);
-
-    int glitch_iterations = qBound(2, settings.value(GLITCH_ITERATIONS, 5).toInt(), 10);
-    settings.setValue(GLITCH_ITERATIONS, glitch_iterations);
-
-    int glitch_quality = qBound(10, settings.value(GLITCH_QUALITY, 10).toInt(), 100);
-    settings.setValue(GLITCH_QUALITY, glitch_quality);
-
-    // Save to file
-    settings.sync();
+    settings_write(settings, settings_read(settings));
 }
 
 int ns_init() {
@@ -98,23 +74,25 @@ int ns_init() {
     qsrand(QTime::currentTime().msec());
 
     // Setup folder structure
-    bool has_wallpaper_dir = QDir("/mnt/onboard/.adds/screensaver/wallpaper").exists();
-    QDir("/mnt/onboard/.adds/screensaver").mkpath("./wallpaper/overlay");
+    bool has_wallpaper_dir = QDir(QString(SCREENSAVER_PATH) + "/wallpaper").exists();
+    QDir(SCREENSAVER_PATH).mkpath("./wallpaper/overlay");
     if (!has_wallpaper_dir) {
         // Create "cover" file when "wallpaper" folder doesn't exist
-        QFile cover("/mnt/onboard/.adds/screensaver/wallpaper/cover");
+        QFile cover(QString(SCREENSAVER_PATH) + "/wallpaper/cover");
         cover.open(QIODevice::WriteOnly);
         cover.close();
     }
 
     // Setup settings
-    QSettings settings("/mnt/onboard/.adds/screensaver/_settings.ini", QSettings::IniFormat);
+    QSettings settings(SETTINGS_PATH, QSettings::IniFormat);
     save_settings(settings);
 
     return 0;
 }
 
 bool ns_uninstall() {
+    // Nickel would keep showing it
+    kobo_dir_set_blank(false);
     return true;
 }
 
@@ -190,401 +168,710 @@ NickelHook(
     .uninstall = &ns_uninstall,
 );
 
+// Wallpaper mode frame composited in the background after waking up
+struct PreparedFrame {
+    bool valid = false;
+    SleepPlan plan;
+    QString signature;
+    QImage image;
+    QPixmap overlay;
+    QRegion visible;
+    // Kept instead of the image and the overlay when memory is short
+    CompactFrame compact_image;
+    CompactFrame compact_overlay;
+};
+
+// Frame of one sleep, only handed off to the sleep view of the same generation.
 // Note: QImage and QPixmap are ref-counted, backing data is COW if more than one reference
-QImage screensaver_image;
-QPixmap overlay_pixmap;
-bool is_overlay_wallpaper = false;
+struct SleepFrame {
+    quint64 generation = 0;
+    bool is_overlay_wallpaper = false;
+    QImage image;
+    QPixmap overlay;
+    QRegion visible;  // parts of `overlay` that aren't transparent
+    QStringList files;  // picked for the frame, taken out of their shuffle bags once it's shown
+};
 
-QString pick_random_file(QDir dir, QStringList filters) {
-    if (!dir.exists()) {
-        return "";
+SleepFrame sleep_frame;
+
+PreparedFrame prepared_frame;
+QTimer* idle_timer = nullptr;
+
+// Frame being prerendered, waiting for its layers
+PreparedFrame prerendering_frame;
+ScreensaverSettings prerender_settings;
+int prerender_memory_mode = MEMORY_MODE::Auto;
+bool is_prerender_pending = false;
+QTimer* prerender_timer = nullptr;
+
+void finish_prerender();
+
+// Identity of everything a Wallpaper mode frame depends on
+QString prerender_signature(const SleepPlan &plan, QSize screen_size) {
+    QStringList paths;
+    paths << SETTINGS_PATH
+          << QString(SCREENSAVER_PATH) + "/wallpaper"
+          << QString(SCREENSAVER_PATH) + "/wallpaper/overlay"
+          << QString(SCREENSAVER_PATH) + '/' + BUNDLE_FILE_NAME
+          << plan.overlay_file
+          << plan.wallpaper_file;
+
+    QStringList parts;
+    parts << QString("%1x%2").arg(screen_size.width()).arg(screen_size.height());
+    for (const QString &path : paths) {
+        if (path.isEmpty()) {
+            continue;
+        }
+
+        QFileInfo info(path);
+        sleep_stats_count_fs(1);
+        parts << QString("%1:%2:%3").arg(path, QString::number(info.lastModified().toMSecsSinceEpoch()), QString::number(info.size()));
     }
 
-    QStringList files = dir.entryList(filters, QDir::Files);
-    if (files.isEmpty()) {
-        return "";
+    return parts.join('|');
+}
+
+// Only the compressed layers of the prepared frame are kept while awake
+void compact_prepared_frame(PreparedFrame &frame) {
+    QElapsedTimer timer;
+    timer.start();
+
+    if (!frame.image.isNull()) {
+        frame.compact_image = memory_policy_compact(frame.image);
+        if (!frame.compact_image.data.isEmpty()) {
+            frame_pool_release(frame.image);
+        }
+    }
+    if (!frame.overlay.isNull()) {
+        frame.compact_overlay = memory_policy_compact(frame.overlay.toImage());
+        if (!frame.compact_overlay.data.isEmpty()) {
+            frame.overlay = QPixmap();
+        }
     }
 
-    int idx = qrand() % files.size();
-    return dir.filePath(files.at(idx));
+    nh_log("Compacted the prepared frame to %d bytes in %lld ms", frame.compact_image.data.size() + frame.compact_overlay.data.size(), timer.elapsed());
 }
 
-bool write_blank_screensaver(const QString &file_path) {
-    QFile file(file_path);
-    if (!file.open(QIODevice::WriteOnly)) {
+// Expand the compressed layers of a prepared frame, returns false when they are damaged
+bool expand_prepared_frame(PreparedFrame &frame) {
+    if (!frame.compact_image.data.isEmpty()) {
+        frame.image = memory_policy_expand(frame.compact_image);
+        if (frame.image.isNull()) {
+            return false;
+        }
+    }
+    if (!frame.compact_overlay.data.isEmpty()) {
+        QImage overlay = memory_policy_expand(frame.compact_overlay);
+        if (overlay.isNull()) {
+            frame_pool_release(frame.image);
+            return false;
+        }
+        frame.overlay = QPixmap::fromImage(overlay);
+        frame_pool_release(overlay);
+    }
+
+    return true;
+}
+
+// A sleep takes over the worker threads, the frame being prerendered is dropped
+void cancel_prerender() {
+    if (!is_prerender_pending) {
+        return;
+    }
+
+    is_prerender_pending = false;
+    prerender_timer->stop();
+    prerendering_frame = PreparedFrame();
+    // Its decoding is dropped, the sleep doesn't wait for it
+    cancel_plan_layers();
+    nh_log("Prerendering cancelled");
+}
+
+// Start the next Wallpaper mode frame. Its layers are decoded on the worker threads, so Nickel's UI isn't blocked,
+// and finish_prerender() composites it once they are done. Returns false when nothing is prerendered.
+bool start_prerender(const ScreensaverSettings &settings, int memory_mode) {
+    cancel_prerender();
+    if (!settings.wallpaper_prerender || memory_mode == MEMORY_MODE::Release) {
+        prepared_frame = PreparedFrame();
         return false;
     }
 
-    qint64 written = file.write(reinterpret_cast<const char*>(blank_screensaver), sizeof(blank_screensaver));
-    file.close();
+    QSize screen_size = QGuiApplication::primaryScreen()->size();
+
+    PreparedFrame frame;
+    frame.plan = pick_plan(SCREENSAVER_PATH, screen_size, false, settings.selection_mode);
+    if (settings.glitch_enabled && settings.glitch_wallpaper) {
+        frame.plan.wallpaper_glitch = settings.glitch_iterations;
+    }
+    if (frame.plan.display_mode != DISPLAY_MODE::None) {
+        start_plan_layers(frame.plan, settings, screen_size);
+    }
+    frame.signature = prerender_signature(frame.plan, screen_size);
+
+    prerendering_frame = frame;
+    prerender_settings = settings;
+    prerender_memory_mode = memory_mode;
+    is_prerender_pending = true;
+
+    if (!prerender_timer) {
+        prerender_timer = new QTimer(qApp);
+        prerender_timer->setSingleShot(true);
+        prerender_timer->setInterval(PRERENDER_POLL_MS);
+        QObject::connect(prerender_timer, &QTimer::timeout, &finish_prerender);
+    }
+    prerender_timer->start();
+
+    return true;
+}
+
+// What the screensaver holds while the device is awake, next to what Nickel has
+void log_memory(int memory_mode) {
+    qint64 prepared_bytes = prepared_frame.image.byteCount() + prepared_frame.compact_image.data.size() + prepared_frame.compact_overlay.data.size();
+    if (!prepared_frame.overlay.isNull()) {
+        prepared_bytes += (qint64)prepared_frame.overlay.width() * prepared_frame.overlay.height() * prepared_frame.overlay.depth() / 8;
+    }
 
-    return written == sizeof(blank_screensaver);
+    // Layers can share their buffer with the prepared frame, they are counted in both
+    nh_log("Holding %lld KB while awake in %s mode: prepared frame %lld KB, idle frame buffers %lld KB, composited layers %lld KB, overlays %lld KB (process: %lld KB resident, %lld KB available)",
+        (prepared_bytes + frame_pool_idle_bytes() + composition_cache_bytes() + overlay_cache_bytes()) / 1024,
+        MEMORY_MODE_NAMES[memory_mode],
+        prepared_bytes / 1024,
+        frame_pool_idle_bytes() / 1024,
+        composition_cache_bytes() / 1024,
+        overlay_cache_bytes() / 1024,
+        memory_policy_resident() / 1024,
+        memory_policy_available() / 1024);
 }
 
-QImage glitch_image(const QImage& source, int iterations, int quality = 90) {
-    // 1. Convert QImage to JPEG byte array
-    QByteArray ba;
-    QBuffer buffer(&ba);
-    buffer.open(QIODevice::WriteOnly);
-    source.save(&buffer, "JPG", quality);
-
-    // 2. Find the Start of Scan (SOS) marker: 0xFF 0xDA
-    const uchar* data = (const uchar*)ba.constData();
-    int img_size = ba.size();
-    int scan_start = 0;
-    for (int i = 0; i < img_size - 4; ++i) {
-        if (data[i] == 0xFF && data[i + 1] == 0xDA) {
-            // Big-endian: high byte at i+2, low byte at i+3
-            int sos_header_length = (data[i + 2] << 8) | data[i + 3];
-            scan_start = i + 2 + sos_header_length;
-            break;
-        }
+// Idle frame buffers, composited layers and overlays make the next sleep faster, Keep mode holds one of each
+void trim_idle_memory(int memory_mode) {
+    int kept = memory_mode == MEMORY_MODE::Keep ? KEEP_IDLE_ENTRIES : 0;
+    composition_cache_trim(kept);
+    overlay_cache_trim(kept);
+    frame_pool_trim(kept);
+
+    log_memory(memory_mode);
+}
+
+// Work that shouldn't delay going to sleep
+void run_idle_work() {
+    if (!QDir(KOBO_SCREENSAVER_PATH).exists()) {
+        return;
+    }
+
+    void *mwc = MainWindowController_sharedInstance();
+    if (!mwc) {
+        return;
+    }
+
+    QWidget *current_view = MainWindowController_currentView(mwc);
+    if (!current_view) {
+        return;
     }
 
-    if (scan_start == 0 || scan_start >= img_size - 2) {
-        return source;
+    // Still going to sleep, try again after waking up
+    if (is_sleep_view(current_view->objectName())) {
+        idle_timer->start();
+        return;
     }
+    sleep_lifecycle_woke();
+
+    // The frame isn't shown anymore, its buffer goes back to the pool
+    frame_widget_release();
+    frame_pool_release(sleep_frame.image);
+    sleep_frame.overlay = QPixmap();
+
+    const ScreensaverSettings &settings = settings_current();
+    configure_pipeline(settings);
+    sleep_stats_configure(settings.stats_enabled, settings.sleep_budget > 0);
 
-    // 3. Apply the glitch logic
-    iterations = qMax(1, iterations);
+    int memory_mode = memory_policy_mode(settings.memory_mode);
+    bool is_prerendering = start_prerender(settings, memory_mode);
 
-    static int noise_length = 97;  // prime number
-    static QByteArray noise(noise_length, (char)1);
-    int data_size = img_size - scan_start - 2;  // Ignore EOI (End of Image), which is 2 bytes: 0xFFD9
-    int safe_range = data_size - noise_length;
-    if (safe_range <= 0) {
-        return source;
+    image_cache_flush();
+    file_index_flush();
+    sleep_stats_flush();
+
+    // Otherwise once the prerendered frame is done
+    if (!is_prerendering) {
+        trim_idle_memory(memory_mode);
     }
+}
 
-    for (int i = 0; i < iterations; ++i) {
-        int glitch_index = scan_start + (qrand() % safe_range);
-        ba.replace(glitch_index, noise_length, noise);
+// Composite the prerendered frame once its layers are decoded, only this part runs on the GUI thread
+void finish_prerender() {
+    if (!is_prerender_pending) {
+        return;
+    }
+    if (!plan_layers_ready()) {
+        prerender_timer->start();
+        return;
     }
 
-    QImage glitched;
-    if (!glitched.loadFromData(ba, "JPG")) {
-        return source;
+    PreparedFrame frame = prerendering_frame;
+    prerendering_frame = PreparedFrame();
+    is_prerender_pending = false;
+
+    QSize screen_size = QGuiApplication::primaryScreen()->size();
+    if (frame.plan.display_mode != DISPLAY_MODE::None) {
+        render_plan(frame.plan, prerender_settings, screen_size, frame.image, frame.overlay);
+        if (frame.plan.is_overlay_wallpaper && !frame.overlay.isNull()) {
+            frame.visible = overlay_region(frame.overlay.toImage());
+        }
     }
+    frame.valid = true;
+
+    if (prerender_memory_mode == MEMORY_MODE::Compact) {
+        compact_prepared_frame(frame);
+    }
+
+    prepared_frame = frame;
+    nh_log("Prepared next wallpaper frame");
 
-    return glitched;
+    // Layers decoded for the first time
+    image_cache_flush();
+    trim_idle_memory(prerender_memory_mode);
 }
 
-QImage glitch_pixmap(const QPixmap& source, int iterations, int quality = 90) {
-    QImage img = source.toImage();
-    return glitch_image(img, iterations, quality);
+// Whether the prerendered frame is still waiting for its layers
+bool prerender_pending() {
+    return is_prerender_pending;
 }
 
-QImage load_scaled_image(const QString& file_path, QSize screen_size) {
-    QImageReader reader(file_path);
-    if (reader.canRead()) {
-        QSize img_size = reader.size();
+void schedule_idle_work() {
+    if (!idle_timer) {
+        idle_timer = new QTimer(qApp);
+        idle_timer->setSingleShot(true);
+        idle_timer->setInterval(IDLE_DELAY_MS);
+        QObject::connect(idle_timer, &QTimer::timeout, &run_idle_work);
+    }
 
-        if (img_size != screen_size) {
-            img_size.scale(screen_size, Qt::KeepAspectRatioByExpanding);
-            reader.setScaledSize(img_size);
-        }
+    idle_timer->start();
+}
 
-        return reader.read();
+// Swap in the prepared frame, returns false when there is none or it's outdated.
+// An outdated frame is kept, it can still be shown when there's no time to make a new one.
+bool take_prepared_frame(QSize screen_size, SleepPlan &plan, bool accepts_outdated) {
+    if (!prepared_frame.valid) {
+        return false;
     }
 
-    return QImage();
+    if (!accepts_outdated && prepared_frame.signature != prerender_signature(prepared_frame.plan, screen_size)) {
+        nh_log("Prepared frame is outdated");
+        return false;
+    }
+
+    // A prepared frame is only shown once
+    PreparedFrame frame = prepared_frame;
+    prepared_frame = PreparedFrame();
+    if (!expand_prepared_frame(frame)) {
+        nh_log("Prepared frame is damaged");
+        return false;
+    }
+
+    plan = frame.plan;
+    if (plan.display_mode == DISPLAY_MODE::None) {
+        kobo_dir_set_blank(false);
+        return true;
+    }
+
+    sleep_frame.is_overlay_wallpaper = frame.plan.is_overlay_wallpaper;
+    sleep_frame.files = frame.plan.picked_files;
+    if (sleep_frame.is_overlay_wallpaper) {
+        sleep_frame.overlay = frame.overlay;
+        sleep_frame.visible = frame.visible;
+    } else {
+        sleep_frame.image = frame.image;
+    }
+    kobo_dir_set_blank(!sleep_frame.is_overlay_wallpaper);
+
+    return true;
+}
+
+// Returns whether the sleep view must be shown for the prepared frame
+bool use_prepared_frame(const SleepPlan &plan) {
+    if (SleepSample* sample = sleep_stats_current()) {
+        sample->display_mode = plan.display_mode;
+    }
+
+    return plan.display_mode & DISPLAY_MODE::Overlay;
 }
 
-void before_handle(N3PowerWorkflowManager* self) {
-    // Reset data
-    screensaver_image = QImage();
-    is_overlay_wallpaper = false;
+// Prepare the frame of `generation`. Returns whether Nickel's sleep view must be shown for it.
+bool before_handle(bool is_low_battery, quint64 generation) {
+    // The worker threads are needed now
+    cancel_prerender();
+
+    // Reset data, the frame buffer is reused when the sleep view doesn't hold it anymore
+    frame_pool_release(sleep_frame.image);
+    sleep_frame.generation = generation;
+    sleep_frame.is_overlay_wallpaper = false;
+    sleep_frame.visible = QRegion();
+    sleep_frame.files.clear();
 
-    QString screensaver_path   = "/mnt/onboard/.adds/screensaver";
-    QString kobo_screensaver_path = "/mnt/onboard/.kobo/screensaver";
+    QString screensaver_path   = SCREENSAVER_PATH;
+    QString kobo_screensaver_path = KOBO_SCREENSAVER_PATH;
     QDir screensaver_dir(screensaver_path);
     QDir kobo_screensaver_dir(kobo_screensaver_path);
 
     if (!kobo_screensaver_dir.exists()) {
         // Skip if Kobo's screensaver folder doesn't exist
-        return;
+        return false;
     }
 
     void *mwc = MainWindowController_sharedInstance();
 	if (!mwc) {
 		nh_log("Invalid MainWindowController");
-		return;
+		return false;
 	}
 
     QWidget *current_view = MainWindowController_currentView(mwc);
 	if (!current_view) {
 		nh_log("Invalid currentView");
-		return;
+		return false;
 	}
 
+    // A sleep view can still be current for a new sleep: woken up since, or powering off.
+    // Requests that belong to the sleep it shows got no generation.
     QString current_view_name = current_view->objectName();
 
-    // Don't show overlay again when the current view is Sleep view
-    if (current_view_name.contains("DragonPowerView")) {
-        return;
-    }
-
     // Enable transparent mode when reading
     bool is_reading = current_view_name == QStringLiteral("ReadingView");
 
-    // 1. Ensure folder structure
-    screensaver_dir.mkpath("./wallpaper");
-    QDir wallpaper_dir("/mnt/onboard/.adds/screensaver/wallpaper");
-    QDir wallpaper_overlay_dir("/mnt/onboard/.adds/screensaver/wallpaper/overlay");
-
-    // 2. Move old overlay_files from .kobo/screensaver to .adds/screensaver
-    QStringList exclude = {
-        "_settings.ini",
-        "nickel-screensaver.png",
-        "nickel-screensaver.jpg",
-    };
-    for (const QFileInfo &file : kobo_screensaver_dir.entryInfoList(QDir::Files)) {
-        // Don't move Nickel Screensaver's overlay_files
-        if (exclude.contains(file.fileName())) {
-            continue;
-        }
+    sleep_stats_begin();
+    frame_pool_begin();
+
+    {
+        SleepStageTimer stage_timer(SLEEP_STAGE::Migration);
 
-        QString dest_path = screensaver_path + '/' + file.fileName();
-        // Don't override file with the same name in .adds/screensaver
-        if (!QFile::exists(dest_path)) {
-            QFile::rename(file.filePath(), dest_path);
+        // 1. Ensure folder structure, only written when it's missing
+        sleep_stats_count_fs(1);
+        if (!QFileInfo(screensaver_path + "/wallpaper").isDir()) {
+            sleep_stats_count_fs(0, 1);
+            screensaver_dir.mkpath("./wallpaper");
         }
+
+        // 2. Move old overlay files from .kobo/screensaver to .adds/screensaver and remove the rest,
+        // the blank screensaver is kept
+        kobo_dir_clean();
     }
 
-    // 3. Empty .kobo/screensaver folder
-    kobo_screensaver_dir.removeRecursively();
-    kobo_screensaver_dir.mkpath(".");
+    QScreen* screen = QGuiApplication::primaryScreen();
+    QSize screen_size = screen->size();
+    if (SleepSample* sample = sleep_stats_current()) {
+        sample->frame_size = screen_size;
+    }
 
-    // Get settings
-    QSettings settings("/mnt/onboard/.adds/screensaver/_settings.ini", QSettings::IniFormat);
+    // 3. Get settings
+    ScreensaverSettings settings;
+    {
+        // Only parsed again when the file has changed
+        SleepStageTimer stage_timer(SLEEP_STAGE::Settings);
+        settings = settings_current();
+        configure_pipeline(settings);
+        sleep_stats_configure(settings.stats_enabled, settings.sleep_budget > 0);
+
+        // Little memory left, the frame is composited in grayscale into a buffer 4 times smaller
+        if (!settings.grayscale_enabled && memory_policy_mode(settings.memory_mode) == MEMORY_MODE::Release) {
+            nh_log("Low on memory, compositing in grayscale");
+            settings.grayscale_enabled = true;
+        }
+    }
 
-    // 4. Pick a random overlay
-    QStringList overlay_files;
-    QStringList wallpaper_files;
+    // There's little time and battery left to spend on a low battery power off
+    sleep_deadline_begin(settings.sleep_budget, is_low_battery ? settings.sleep_low_battery : SLEEP_LEVEL::Full);
 
-    QString overlay_file;
-    QString wallpaper_file;
+    // Wallpaper mode doesn't depend on the current page, use the prepared frame if there is one
+    SleepPlan plan;
+    if (!is_reading && sleep_deadline_level() <= SLEEP_LEVEL::LastFrame && take_prepared_frame(screen_size, plan, false)) {
+        return use_prepared_frame(plan);
+    }
 
-    QDesktopWidget* desktop_widget = QApplication::desktop();
-    QScreen* screen = QGuiApplication::primaryScreen();
-    QSize screen_size = screen->size();
+    // 4. Pick a random overlay
+    if (sleep_deadline_allows(SLEEP_LEVEL::Stock, {SLEEP_STAGE::Selection})) {
+        SleepStageTimer stage_timer(SLEEP_STAGE::Selection);
+        plan = pick_plan(screensaver_path, screen_size, is_reading, settings.selection_mode);
+    }
+    if (SleepSample* sample = sleep_stats_current()) {
+        sample->display_mode = plan.display_mode;
+    }
 
-    int display_mode = is_reading ? DISPLAY_MODE::Book : DISPLAY_MODE::Wallpaper;
+    if (plan.display_mode == DISPLAY_MODE::None) {
+        // Skip if no files found, Nickel shows its own screensaver
+        sleep_deadline_degrade(SLEEP_LEVEL::Stock, "nothing to show");
+        kobo_dir_set_blank(false);
+        return false;
+    }
 
-    // Pick a random overlay file
-    QString random_file;
-    if (is_reading) {
-        random_file = pick_random_file(screensaver_dir, QStringList() << "*.png" << "*.jpg");
+    // 5. Go down the ladder until what's left of the budget is enough
+    bool is_transparent = (plan.display_mode & DISPLAY_MODE::Overlay) && (plan.display_mode & DISPLAY_MODE::Book);
+    if (is_transparent) {
+        // The layers are decoded on the worker threads while the page is captured
+        sleep_deadline_allows(SLEEP_LEVEL::LastFrame, {SLEEP_STAGE::Composite}, {SLEEP_STAGE::Decode, SLEEP_STAGE::Screenshot});
     } else {
-        // Only accept PNG file in wallpaper's overlay folder
-        random_file = pick_random_file(wallpaper_overlay_dir, QStringList() << "*.png");
-    }
-    if (!random_file.isEmpty()) {
-        if (random_file.endsWith(".png")) {
-            // Add Overlay mode
-            display_mode |= DISPLAY_MODE::Overlay;
-            overlay_file = random_file;
-        } else {
-            // To Wallpaper only mode
-            display_mode = DISPLAY_MODE::Wallpaper;
-            wallpaper_file = random_file;
+        sleep_deadline_allows(SLEEP_LEVEL::LastFrame, {SLEEP_STAGE::Decode, SLEEP_STAGE::Composite});
+    }
+
+    if (sleep_deadline_level() == SLEEP_LEVEL::LastFrame) {
+        SleepPlan prepared_plan;
+        if (!is_reading && take_prepared_frame(screen_size, prepared_plan, true)) {
+            return use_prepared_frame(prepared_plan);
         }
+        sleep_deadline_degrade(SLEEP_LEVEL::Plain, "no prepared frame");
     }
 
-    if ((display_mode & DISPLAY_MODE::Wallpaper) && wallpaper_file.isEmpty()) {
-        // Find a random wallpaper in screensaver/wallpaper/
-        QString random_file = pick_random_file(wallpaper_dir, QStringList() << "*.png" << "*.jpg" << "cover");
-        if (random_file.isEmpty()) {
-            if (overlay_file.isEmpty()) {
-                // No overlay+wallpaper -> switch to None mode
-                display_mode = DISPLAY_MODE::None;
-            } else {
-                // Has overlay but not wallpaper -> Set to overlay cover mode
-                is_overlay_wallpaper = true;
-                display_mode &= ~DISPLAY_MODE::Wallpaper;
-            }
-        } else {
-            if (random_file.endsWith("/cover")) {
-                is_overlay_wallpaper = true;
-                display_mode &= ~DISPLAY_MODE::Wallpaper;
-            } else {
-                wallpaper_file = random_file;
-            }
+    if (sleep_deadline_level() == SLEEP_LEVEL::Plain) {
+        if (plan.overlay_file.isEmpty()) {
+            sleep_deadline_degrade(SLEEP_LEVEL::Stock, "no overlay");
+        } else if (sleep_deadline_allows(SLEEP_LEVEL::Stock, {SLEEP_STAGE::Decode})) {
+            // Cover mode: the overlay alone, on top of Nickel's own screensaver
+            plan.is_overlay_wallpaper = true;
+            plan.picked_files.removeOne(plan.wallpaper_file);
+            plan.wallpaper_file.clear();
+            is_transparent = false;
         }
     }
 
-    if (display_mode == DISPLAY_MODE::None) {
-        // Skip if no files found
-        return;
+    if (sleep_deadline_level() == SLEEP_LEVEL::Stock) {
+        kobo_dir_set_blank(false);
+        return false;
     }
 
-    // Write Tiny PNG
-    if (!is_overlay_wallpaper) {
-        write_blank_screensaver("/mnt/onboard/.kobo/screensaver/nickel-screensaver.png");
+    // The wallpaper is glitched while it's decoded
+    if (settings.glitch_enabled && settings.glitch_wallpaper && !plan.wallpaper_file.isEmpty()
+            && sleep_deadline_allows(SLEEP_LEVEL::NoGlitch, {SLEEP_STAGE::Decode, SLEEP_STAGE::Composite})) {
+        plan.wallpaper_glitch = settings.glitch_iterations;
     }
 
-    // If not overlay mode -> only load the wallpaper file
-    if (!(display_mode & DISPLAY_MODE::Overlay)) {
-        if (!wallpaper_file.isEmpty()) {
-            screensaver_image = load_scaled_image(wallpaper_file, screen_size);
+    // Decode the wallpaper and the overlay on the worker threads meanwhile
+    start_plan_layers(plan, settings, screen_size);
+
+    sleep_frame.is_overlay_wallpaper = plan.is_overlay_wallpaper;
+    sleep_frame.files = plan.picked_files;
+
+    // Tiny PNG shown until the frame is handed off, kept between sleeps
+    kobo_dir_set_blank(!sleep_frame.is_overlay_wallpaper);
+
+    // 6. Handle transparent mode
+    if (is_transparent) {
+        // Capture the current page straight into the frame, it's glitched and blended in place
+        {
+            SleepStageTimer stage_timer(SLEEP_STAGE::Screenshot);
+            sleep_frame.image = frame_pool_acquire(screen_size, QImage::Format_RGB32);
+            if (!capture_view(current_view, sleep_frame.image, settings.book_screenshot)) {
+                frame_pool_release(sleep_frame.image);
+            }
         }
 
-        return;
+        if (settings.glitch_enabled && sleep_deadline_allows(SLEEP_LEVEL::NoGlitch, {SLEEP_STAGE::Glitch, SLEEP_STAGE::Composite})) {
+            SleepStageTimer stage_timer(SLEEP_STAGE::Glitch);
+            glitch_screenshot(settings, sleep_frame.image);
+        }
     }
 
-    // 5. Handle transparent mode
-    QPixmap screenshot_pixmap;
-    QImage wallpaper_image;
-
-    bool glitch_enabled = settings.value(GLITCH_ENABLED, false).toBool();
-    int glitch_iterations = qBound(2, settings.value(GLITCH_ITERATIONS, 5).toInt(), 10);
-    int glitch_quality = qBound(10, settings.value(GLITCH_QUALITY, 80).toInt(), 100);
+    // 7. Combine overlay & wallpaper into target image, once they are decoded
+    render_plan(plan, settings, screen_size, sleep_frame.image, sleep_frame.overlay);
+    // Measured now, so the hand-off only sets the widget's mask
+    if (sleep_frame.is_overlay_wallpaper && !sleep_frame.overlay.isNull()) {
+        sleep_frame.visible = overlay_region(sleep_frame.overlay.toImage());
+    }
 
-    if (display_mode & DISPLAY_MODE::Book) {
-        // Take screenshot of the current screen if reading
-        QRect geometry = current_view->geometry();
-        screenshot_pixmap = screen->grabWindow(
-            desktop_widget->winId(),
-            geometry.left(),
-            geometry.top(),
-            geometry.width(),
-            geometry.height()
-        );
+    // 8. Done
+    return plan.display_mode & DISPLAY_MODE::Overlay;
+}
 
-        if (glitch_enabled) {
-            wallpaper_image = glitch_pixmap(screenshot_pixmap, glitch_iterations, glitch_quality);
-        }
-    } else if (display_mode & DISPLAY_MODE::Wallpaper and !wallpaper_file.isEmpty()) {
-        wallpaper_image = load_scaled_image(wallpaper_file, screen_size);
+// Show the frame of `generation` in the sleep view, `shown` started when the view was shown
+void hand_off_frame(QWidget *current_view, quint64 generation, const QElapsedTimer &shown) {
+    // Already handed off, unlocked before the view was shown, or left from an older sleep
+    if (generation == 0 || generation != sleep_frame.generation) {
+        return;
+    }
+    if (sleep_frame.overlay.isNull() && sleep_frame.image.isNull()) {
+        return;
     }
 
-    // 6. Combine overlay & wallpaper into target image
-    QPaintDevice *backing;
-    if (is_overlay_wallpaper) {
-        if (overlay_pixmap.isNull() || overlay_pixmap.size() != screen_size) {
-            overlay_pixmap = QPixmap(screen_size);
-        }
-        overlay_pixmap.fill(Qt::transparent);
-        backing = &overlay_pixmap;
-    } else {
-        if (screensaver_image.isNull() || screensaver_image.size() != screen_size) {
-            screensaver_image = QImage(screen_size, QImage::Format_RGB32);
+    // Take the frame of a previous sleep away, in case this one doesn't use the widget
+    frame_widget_release();
+
+    // Check if cover mode
+    QWidget* painted = nullptr;
+    QString current_view_name = current_view->objectName();
+    if (sleep_frame.is_overlay_wallpaper) {
+        if (!sleep_frame.overlay.isNull()) {
+            FrameWidget* overlay = frame_widget(current_view);
+            overlay->show_overlay(sleep_frame.overlay, sleep_frame.visible);
+            if (current_view_name != QStringLiteral("FramedDragonPowerView")) {
+                // Not reading Instapaper article
+                overlay->lower();
+            } else {
+                overlay->raise();
+            }
+            overlay->show();
+            painted = overlay;
         }
-        screensaver_image.fill(Qt::white);
-        backing = &screensaver_image;
-    }
-
-    QPainter painter(backing); // this will copy the image data if it's referenced somewhere else
-    painter.setRenderHint(QPainter::SmoothPixmapTransform, false);
-
-    // Draw wallpaper
-    if (!wallpaper_image.isNull()) {
-        nh_log("wallpaper_image %d %d", wallpaper_image.width(), wallpaper_image.height());
-        painter.drawImage(0, 0, wallpaper_image);
-    } else if (!screenshot_pixmap.isNull()) {
-        if (screenshot_pixmap.size() != screen_size) {
-            // Only scale if size mismatch
-            painter.drawPixmap(0, 0, screenshot_pixmap.scaled(screen_size, Qt::KeepAspectRatioByExpanding, Qt::FastTransformation));
-        } else {
-            painter.drawPixmap(0, 0, screenshot_pixmap);
+    } else if (!sleep_frame.image.isNull()) {
+        if (current_view_name == QStringLiteral("BookCoverDragonPowerView") && FullScreenDragonPowerView_setImage) {
+            FullScreenDragonPowerView_setImage(current_view, sleep_frame.image);
+            painted = current_view;
+        } else if (current_view_name == QStringLiteral("FramedDragonPowerView")) {
+            // Instapaper, the image is painted as it is instead of being copied into a pixmap
+            FrameWidget* overlay = frame_widget(current_view);
+            overlay->show_image(sleep_frame.image);
+            overlay->raise();
+            overlay->show();
+            painted = overlay;
         }
     }
 
-    // Draw color overlay layer
-    QColor color_overlay;
-    QString color_overlay_hex = settings.value(is_reading ? BOOK_COLOR_OVERLAY : WALLPAPER_COLOR_OVERLAY, "ffffff").toString();
-    int color_overlay_alpha = settings.value(is_reading ? BOOK_COLOR_OVERLAY_ALPHA : WALLPAPER_COLOR_OVERLAY_ALPHA, 0).toInt();
-    color_overlay_alpha = qBound(0, color_overlay_alpha, 100);
+    if (painted) {
+        frame_widget_time_paint(painted, shown);
 
-    if (!color_overlay_hex.isEmpty() && color_overlay_alpha > 0) {
-        color_overlay.setNamedColor("#" + color_overlay_hex);
-        if (color_overlay.isValid()) {
-            color_overlay.setAlpha(color_overlay_alpha * 255 / 100);
-            painter.fillRect(0, 0, screen_size.width(), screen_size.height(), color_overlay);
+        // The next sleep picks the next files of the shuffle bags
+        for (const QString &file : sleep_frame.files) {
+            file_index_shown(file);
         }
     }
 
-    // Draw image overlay
-    QPixmap overlay;
-    if (!overlay_file.isEmpty()) {
-        overlay.load(overlay_file);
-        if (!overlay.isNull()) {
-            if (overlay.size() != screen_size) {
-                // Only scales if different sizes
-                painter.drawPixmap(0, 0, overlay.scaled(screen_size, Qt::KeepAspectRatioByExpanding, Qt::FastTransformation));
-            } else {
-                painter.drawPixmap(0, 0, overlay);
-            }
+    // BookCoverDragonPowerView_setInfoPanelVisible(current_view, true);
+}
+
+// Ends the sleep as soon as the sleep view it was handed off to is hidden, without waiting for the idle work
+class SleepViewWatcher : public QObject {
+public:
+    void watch(QWidget *target) {
+        if (watched) {
+            watched->removeEventFilter(this);
         }
+        watched = target;
+        target->installEventFilter(this);
     }
 
-    painter.end();
+protected:
+    bool eventFilter(QObject *object, QEvent *event) override {
+        if (object == watched && event->type() == QEvent::Hide) {
+            object->removeEventFilter(this);
+            watched = nullptr;
+            sleep_lifecycle_hidden();
+        }
+        return false;
+    }
 
-    // 8. Done
-    N3PowerWorkflowManager_handleSleep(self);
-    // nh_log("Current view: %s", current_view_name.toStdString().c_str());
-    // nh_dump_log();
-}
+private:
+    QPointer<QWidget> watched;
+};
 
 void after_view_shown() {
-    // Remove blank screensaver
-    QFile file("/mnt/onboard/.kobo/screensaver/nickel-screensaver.png");
-    file.remove();
+    QElapsedTimer shown;
+    shown.start();
 
-    if (overlay_pixmap.isNull() && screensaver_image.isNull()) {
-        return;
-    }
+    // Write caches and prepare the next Wallpaper mode frame once the device is awake again
+    schedule_idle_work();
 
     void *mwc = MainWindowController_sharedInstance();
-    QWidget *current_view = MainWindowController_currentView(mwc);
+    QWidget *current_view = mwc ? MainWindowController_currentView(mwc) : nullptr;
     if (!current_view) {
         return;
     }
 
-    // Avoid adding overlay to the wrong view when unlocking the device instantly
-    // https://github.com/redphx/nickel-screensaver/issues/12
-    QString current_view_name = current_view->objectName();
-    if (!current_view_name.contains(QStringLiteral("DragonPowerView"))) {
+    // Only the first time the view of a sleep is shown
+    quint64 generation = sleep_lifecycle_shown(current_view->objectName());
+    if (generation == 0) {
         return;
     }
 
-    // Check if cover mode
-    if (is_overlay_wallpaper) {
-        if (!overlay_pixmap.isNull()) {
-            QLabel* overlay = new QLabel(current_view);
-            overlay->setPixmap(overlay_pixmap);
-            overlay->setGeometry(current_view->rect());
-            if (current_view_name != QStringLiteral("FramedDragonPowerView")) {
-                // Not reading Instapaper article
-                overlay->lower();
-            }
-            overlay->show();
-        }
-    } else if (!screensaver_image.isNull()) {
-        if (current_view_name == QStringLiteral("BookCoverDragonPowerView") && FullScreenDragonPowerView_setImage) {
-            FullScreenDragonPowerView_setImage(current_view, screensaver_image);
-        } else if (current_view_name == QStringLiteral("FramedDragonPowerView")) {
-            // Instapaper
-            QLabel* overlay = new QLabel(current_view);
-            overlay->setPixmap(QPixmap::fromImage(screensaver_image));
-            overlay->setGeometry(current_view->rect());
-            overlay->show();
+    {
+        SleepStageTimer stage_timer(SLEEP_STAGE::Handoff);
+        hand_off_frame(current_view, generation, shown);
+    }
+
+    static SleepViewWatcher* view_watcher = new SleepViewWatcher();
+    view_watcher->watch(current_view);
+
+    nh_log("Frame buffers: %lld bytes at peak, %lld bytes allocated", frame_pool_peak(), frame_pool_allocated());
+    if (SleepSample* sample = sleep_stats_current()) {
+        sample->frame_peak = frame_pool_peak();
+        nh_log("Filesystem calls: %d reads, %d writes", sample->fs_reads, sample->fs_writes);
+    }
+    sleep_stats_commit();
+}
+
+// Monotonic time for the sleep lifecycle
+qint64 lifecycle_ms() {
+    static QElapsedTimer clock;
+    if (!clock.isValid()) {
+        clock.start();
+    }
+
+    return clock.elapsed();
+}
+
+QString current_view_name() {
+    void *mwc = MainWindowController_sharedInstance();
+    QWidget *current_view = mwc ? MainWindowController_currentView(mwc) : nullptr;
+    return current_view ? current_view->objectName() : QString();
+}
+
+// Whether there's a frame to hand off to the sleep view
+bool has_sleep_frame() {
+    return sleep_frame.is_overlay_wallpaper ? !sleep_frame.overlay.isNull() : !sleep_frame.image.isNull();
+}
+
+// Prepare the frame when this is a new sleep. Returns whether Nickel's sleep view must be shown for it.
+bool prepare_sleep(quint64 generation, bool is_low_battery) {
+    // Without a frame to hand off, Nickel must not show the blank screensaver alone
+    if (generation == 0) {
+        // A frame being prepared, waiting for its view or shown keeps it
+        if (sleep_lifecycle_state() == SLEEP_STATE::Awake) {
+            kobo_dir_set_blank(false);
         }
+        return false;
     }
 
-    // BookCoverDragonPowerView_setInfoPanelVisible(current_view, true);
+    bool needs_sleep_view = before_handle(is_low_battery, generation);
+    if (!sleep_lifecycle_prepared(generation, lifecycle_ms())) {
+        frame_pool_release(sleep_frame.image);
+        kobo_dir_set_blank(false);
+        return false;
+    }
+    if (!has_sleep_frame()) {
+        kobo_dir_set_blank(false);
+    }
+
+    return needs_sleep_view;
+}
+
+// handleSleep calls made while a frame was being prepared, forwarded to Nickel after the call preparing it
+static QList<N3PowerWorkflowManager*> deferred_sleeps;
+
+void forward_deferred_sleeps() {
+    while (!deferred_sleeps.isEmpty()) {
+        N3PowerWorkflowManager_handleSleep(deferred_sleeps.takeFirst());
+    }
 }
 
 extern "C" __attribute__((visibility("default")))
 void hook_N3PowerWorkflowManager_handleSleep(N3PowerWorkflowManager* self) {
-    before_handle(self);
+    quint64 generation = sleep_lifecycle_request(current_view_name(), lifecycle_ms());
+    if (generation == 0 && sleep_lifecycle_state() == SLEEP_STATE::Preparing) {
+        // Re-entered, Nickel gets it once the outer call has shown the frame
+        deferred_sleeps.append(self);
+        return;
+    }
 
+    // Nickel shows the sleep view once, with the frame when there is one
+    prepare_sleep(generation, false);
     N3PowerWorkflowManager_handleSleep(self);
+    forward_deferred_sleeps();
 }
 
 extern "C" __attribute__((visibility("default")))
 void hook_N3PowerWorkflowManager_powerOff(N3PowerWorkflowManager* self, bool low_battery) {
-    before_handle(self);
+    // Powering off is never skipped, only the frame of a sleep being prepared is
+    quint64 generation = sleep_lifecycle_power_off();
+    if (prepare_sleep(generation, low_battery)) {
+        N3PowerWorkflowManager_handleSleep(self);
+    }
+    forward_deferred_sleeps();
 
     N3PowerWorkflowManager_powerOff(self, low_battery);
 }
@@ -0,0 +1,146 @@
+#include "settings.h"
+#include "onboard.h"
+#include "sleep_stats.h"
+#include <NickelHook.h>
+
+#include <QDateTime>
+#include <QFileInfo>
+
+static const char* CAPTURE_SOURCE_NAMES[] = {"framebuffer", "render"};
+static const char* GLITCH_ENGINE_NAMES[] = {"jpeg", "pixel"};
+static const char* SELECTION_MODE_NAMES[] = {"random", "shuffle"};
+static const char* DITHER_MODE_NAMES[] = {"off", "ordered", "diffusion"};
+
+static ScreensaverSettings current_settings;
+static qint64 loaded_mtime = -1;
+static qint64 loaded_size = -1;
+static qint64 loaded_at = -1;
+
+static QString read_string(QSettings &settings, const char* key, const QString &fallback) {
+    return settings.value(key, fallback).toString();
+}
+
+static int read_int(QSettings &settings, const char* key, int fallback, int min, int max) {
+    return qBound(min, settings.value(key, fallback).toInt(), max);
+}
+
+static bool read_bool(QSettings &settings, const char* key, bool fallback) {
+    return settings.value(key, fallback).toBool();
+}
+
+// Index of the value in `names`, or `fallback` when it isn't one of them
+static int read_choice(QSettings &settings, const char* key, const char* const* names, int count, int fallback) {
+    QString value = settings.value(key, names[fallback]).toString();
+    for (int i = 0; i < count; ++i) {
+        if (value == QLatin1String(names[i])) {
+            return i;
+        }
+    }
+
+    return fallback;
+}
+
+ScreensaverSettings settings_read(QSettings &settings) {
+    ScreensaverSettings defaults;
+    ScreensaverSettings values;
+
+    values.book_color_overlay = read_string(settings, BOOK_COLOR_OVERLAY, defaults.book_color_overlay);
+    values.book_color_overlay_alpha = read_int(settings, BOOK_COLOR_OVERLAY_ALPHA, defaults.book_color_overlay_alpha, 0, 100);
+    values.book_screenshot = read_choice(settings, BOOK_SCREENSHOT, CAPTURE_SOURCE_NAMES, 2, defaults.book_screenshot);
+
+    values.wallpaper_color_overlay = read_string(settings, WALLPAPER_COLOR_OVERLAY, defaults.wallpaper_color_overlay);
+    values.wallpaper_color_overlay_alpha = read_int(settings, WALLPAPER_COLOR_OVERLAY_ALPHA, defaults.wallpaper_color_overlay_alpha, 0, 100);
+    values.wallpaper_prerender = read_bool(settings, WALLPAPER_PRERENDER, defaults.wallpaper_prerender);
+
+    values.glitch_enabled = read_bool(settings, GLITCH_ENABLED, defaults.glitch_enabled);
+    values.glitch_iterations = read_int(settings, GLITCH_ITERATIONS, defaults.glitch_iterations, 2, 10);
+    values.glitch_quality = read_int(settings, GLITCH_QUALITY, defaults.glitch_quality, 10, 100);
+    values.glitch_engine = read_choice(settings, GLITCH_ENGINE_KEY, GLITCH_ENGINE_NAMES, 2, defaults.glitch_engine);
+    values.glitch_wallpaper = read_bool(settings, GLITCH_WALLPAPER, defaults.glitch_wallpaper);
+
+    values.selection_mode = read_choice(settings, SELECTION_MODE_KEY, SELECTION_MODE_NAMES, 2, defaults.selection_mode);
+
+    values.grayscale_enabled = read_bool(settings, GRAYSCALE_ENABLED, defaults.grayscale_enabled);
+    values.grayscale_dither = read_choice(settings, GRAYSCALE_DITHER, DITHER_MODE_NAMES, 3, defaults.grayscale_dither);
+
+    values.cache_enabled = read_bool(settings, CACHE_ENABLED, defaults.cache_enabled);
+    values.cache_size = read_int(settings, CACHE_SIZE, defaults.cache_size, 0, 1024);
+
+    values.decode_budget = read_int(settings, DECODE_BUDGET, defaults.decode_budget, 8, 256);
+
+    values.sleep_budget = read_int(settings, SLEEP_BUDGET, defaults.sleep_budget, 0, 10000);
+    values.sleep_low_battery = read_choice(settings, SLEEP_LOW_BATTERY, SLEEP_LEVEL_NAMES, SLEEP_LEVEL::LevelCount, defaults.sleep_low_battery);
+
+    values.memory_mode = read_choice(settings, MEMORY_MODE_KEY, MEMORY_MODE_NAMES, MEMORY_MODE::ModeCount, defaults.memory_mode);
+
+    values.stats_enabled = read_bool(settings, STATS_ENABLED, defaults.stats_enabled);
+
+    return values;
+}
+
+void settings_write(QSettings &settings, const ScreensaverSettings &values) {
+    // Book
+    settings.setValue(BOOK_COLOR_OVERLAY, values.book_color_overlay);
+    settings.setValue(BOOK_COLOR_OVERLAY_ALPHA, values.book_color_overlay_alpha);
+    settings.setValue(BOOK_SCREENSHOT, CAPTURE_SOURCE_NAMES[values.book_screenshot]);
+
+    // Wallpaper
+    settings.setValue(WALLPAPER_COLOR_OVERLAY, values.wallpaper_color_overlay);
+    settings.setValue(WALLPAPER_COLOR_OVERLAY_ALPHA, values.wallpaper_color_overlay_alpha);
+    settings.setValue(WALLPAPER_PRERENDER, values.wallpaper_prerender);
+
+    // Glitch
+    settings.setValue(GLITCH_ENABLED, values.glitch_enabled);
+    settings.setValue(GLITCH_ITERATIONS, values.glitch_iterations);
+    settings.setValue(GLITCH_QUALITY, values.glitch_quality);
+    settings.setValue(GLITCH_ENGINE_KEY, GLITCH_ENGINE_NAMES[values.glitch_engine]);
+    settings.setValue(GLITCH_WALLPAPER, values.glitch_wallpaper);
+
+    // Selection
+    settings.setValue(SELECTION_MODE_KEY, SELECTION_MODE_NAMES[values.selection_mode]);
+
+    // Grayscale
+    settings.setValue(GRAYSCALE_ENABLED, values.grayscale_enabled);
+    settings.setValue(GRAYSCALE_DITHER, DITHER_MODE_NAMES[values.grayscale_dither]);
+
+    // Cache
+    settings.setValue(CACHE_ENABLED, values.cache_enabled);
+    settings.setValue(CACHE_SIZE, values.cache_size);
+
+    // Decode
+    settings.setValue(DECODE_BUDGET, values.decode_budget);
+
+    // Sleep
+    settings.setValue(SLEEP_BUDGET, values.sleep_budget);
+    settings.setValue(SLEEP_LOW_BATTERY, SLEEP_LEVEL_NAMES[values.sleep_low_battery]);
+
+    // Memory
+    settings.setValue(MEMORY_MODE_KEY, MEMORY_MODE_NAMES[values.memory_mode]);
+
+    // Stats
+    settings.setValue(STATS_ENABLED, values.stats_enabled);
+
+    // Save to file
+    settings.sync();
+}
+
+const ScreensaverSettings& settings_current() {
+    QFileInfo info(SETTINGS_PATH);
+    sleep_stats_count_fs(1);
+    qint64 mtime = info.exists() ? info.lastModified().toMSecsSinceEpoch() : -1;
+    qint64 size = info.exists() ? info.size() : -1;
+
+    // Parse again when the file has changed, or could have changed within the mtime resolution
+    if (loaded_at < 0 || mtime != loaded_mtime || size != loaded_size || onboard_mtime_ambiguous(mtime, loaded_at)) {
+        QSettings settings(SETTINGS_PATH, QSettings::IniFormat);
+        current_settings = settings_read(settings);
+        sleep_stats_count_fs(1);
+
+        loaded_mtime = mtime;
+        loaded_size = size;
+        loaded_at = QDateTime::currentMSecsSinceEpoch();
+        nh_log("Loaded %s", SETTINGS_PATH);
+    }
+
+    return current_settings;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "capture.h"
+#include "compositor.h"
+#include "file_index.h"
+#include "glitch.h"
+#include "memory_policy.h"
+#include "onboard.h"
+#include "sleep_deadline.h"
+
+#include <QSettings>
+#include <QString>
+
+constexpr const char* SETTINGS_PATH = NICKEL_SCREENSAVER_ONBOARD "/.adds/screensaver/_settings.ini";
+
+constexpr const char* BOOK_COLOR_OVERLAY            = "Book/ColorOverlay";
+constexpr const char* BOOK_COLOR_OVERLAY_ALPHA      = "Book/ColorOverlayAlpha";
+constexpr const char* BOOK_SCREENSHOT               = "Book/Screenshot";
+constexpr const char* WALLPAPER_COLOR_OVERLAY       = "Wallpaper/ColorOverlay";
+constexpr const char* WALLPAPER_COLOR_OVERLAY_ALPHA = "Wallpaper/ColorOverlayAlpha";
+
+constexpr const char* WALLPAPER_PRERENDER           = "Wallpaper/Prerender";
+
+constexpr const char* GLITCH_ENABLED    = "Glitch/Enabled";
+constexpr const char* GLITCH_ITERATIONS = "Glitch/Iterations";
+constexpr const char* GLITCH_QUALITY    = "Glitch/Quality";
+constexpr const char* GLITCH_ENGINE_KEY = "Glitch/Engine";
+constexpr const char* GLITCH_WALLPAPER  = "Glitch/Wallpaper";
+
+constexpr const char* SELECTION_MODE_KEY = "Selection/Mode";
+
+constexpr const char* GRAYSCALE_ENABLED = "Grayscale/Enabled";
+constexpr const char* GRAYSCALE_DITHER  = "Grayscale/Dither";
+
+constexpr const char* CACHE_ENABLED = "Cache/Enabled";
+constexpr const char* CACHE_SIZE    = "Cache/Size";
+
+constexpr const char* DECODE_BUDGET = "Decode/Budget";
+
+constexpr const char* SLEEP_BUDGET      = "Sleep/Budget";
+constexpr const char* SLEEP_LOW_BATTERY = "Sleep/LowBattery";
+
+constexpr const char* MEMORY_MODE_KEY = "Memory/Mode";
+
+constexpr const char* STATS_ENABLED = "Stats/Enabled";
+
+// Validated values of _settings.ini, the initial values are the defaults
+struct ScreensaverSettings {
+    // Book
+    QString book_color_overlay = "ffffff";
+    int book_color_overlay_alpha = 0;          // 0 - 100
+    int book_screenshot = CAPTURE_SOURCE::Render;
+
+    // Wallpaper
+    QString wallpaper_color_overlay = "ffffff";
+    int wallpaper_color_overlay_alpha = 0;     // 0 - 100
+    bool wallpaper_prerender = false;
+
+    // Glitch
+    bool glitch_enabled = false;
+    int glitch_iterations = 5;                 // 2 - 10
+    int glitch_quality = 10;                   // 10 - 100
+    int glitch_engine = GLITCH_ENGINE::Jpeg;
+    bool glitch_wallpaper = false;
+
+    // Selection
+    int selection_mode = SELECTION_MODE::Random;
+
+    // Grayscale
+    bool grayscale_enabled = false;
+    int grayscale_dither = DITHER_MODE::Ordered;
+
+    // Cache
+    bool cache_enabled = true;
+    int cache_size = 64;                       // MB, 0 - 1024
+
+    // Decode
+    int decode_budget = 48;                    // MB, 8 - 256
+
+    // Sleep
+    int sleep_budget = 0;                      // ms, 0 (no limit) - 10000
+    int sleep_low_battery = SLEEP_LEVEL::Stock;
+
+    // Memory
+    int memory_mode = MEMORY_MODE::Auto;
+
+    // Stats
+    bool stats_enabled = false;
+};
+
+// Parse and clamp every value, missing or invalid ones fall back to the defaults
+ScreensaverSettings settings_read(QSettings &settings);
+
+// Write every value back, so the file always lists all the settings
+void settings_write(QSettings &settings, const ScreensaverSettings &values);
+
+// Settings of SETTINGS_PATH. The file is only parsed again when its mtime or size changes,
+// otherwise this costs a single stat().
+const ScreensaverSettings& settings_current();
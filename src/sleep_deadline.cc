@@ -0,0 +1,70 @@
+#include "sleep_deadline.h"
+#include "sleep_stats.h"
+#include <NickelHook.h>
+
+#include <QElapsedTimer>
+
+const char* const SLEEP_LEVEL_NAMES[SLEEP_LEVEL::LevelCount] = {"full", "no-glitch", "last-frame", "plain", "stock"};
+
+static QElapsedTimer sleep_timer;
+static qint64 budget_ns = 0;
+static int current_level = SLEEP_LEVEL::Full;
+
+static void set_level(int level) {
+    current_level = level;
+    if (SleepSample* sample = sleep_stats_current()) {
+        sample->level = level;
+    }
+}
+
+void sleep_deadline_begin(int budget_ms, int level) {
+    sleep_timer.start();
+    budget_ns = (qint64)budget_ms * 1000000;
+    set_level(level);
+
+    if (level != SLEEP_LEVEL::Full) {
+        nh_log("Sleep starts at the %s level", SLEEP_LEVEL_NAMES[level]);
+    }
+}
+
+int sleep_deadline_level() {
+    return current_level;
+}
+
+bool sleep_deadline_allows(int fallback, std::initializer_list<int> stages, std::initializer_list<int> parallel_stages) {
+    if (current_level >= fallback) {
+        return false;
+    }
+    if (budget_ns <= 0) {
+        return true;
+    }
+
+    qint64 needed_ns = 0;
+    for (int stage : stages) {
+        needed_ns += sleep_stats_estimate(stage);
+    }
+    qint64 parallel_ns = 0;
+    for (int stage : parallel_stages) {
+        parallel_ns = qMax(parallel_ns, sleep_stats_estimate(stage));
+    }
+    needed_ns += parallel_ns;
+
+    qint64 left_ns = budget_ns - sleep_timer.nsecsElapsed();
+    if (needed_ns <= left_ns) {
+        return true;
+    }
+
+    nh_log("Sleep degraded to the %s level, %lld ms left for %lld ms of work",
+        SLEEP_LEVEL_NAMES[fallback], qMax(left_ns, (qint64)0) / 1000000, needed_ns / 1000000);
+    set_level(fallback);
+    return false;
+}
+
+void sleep_deadline_degrade(int level, const char* reason) {
+    if (current_level >= level) {
+        return;
+    }
+
+    nh_log("Sleep degraded to the %s level, %s", SLEEP_LEVEL_NAMES[level], reason);
+    set_level(level);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <initializer_list>
+
+// Time budget of the sleep path. Before starting, a stage checks that the time it took in the previous
+// sleeps is still left, otherwise the sleep goes down the ladder to a cheaper level. It never goes back up.
+
+enum SLEEP_LEVEL {
+    Full      = 0,
+    NoGlitch  = 1,  // the page isn't glitched
+    LastFrame = 2,  // the prepared Wallpaper mode frame, even when it's outdated
+    Plain     = 3,  // only the overlay, on top of Nickel's own screensaver
+    Stock     = 4,  // Nickel's own screensaver
+    LevelCount,
+};
+
+extern const char* const SLEEP_LEVEL_NAMES[SLEEP_LEVEL::LevelCount];
+
+// Start the budget of a sleep at `level`, a budget of 0 ms never runs out
+void sleep_deadline_begin(int budget_ms, int level);
+
+int sleep_deadline_level();
+
+// Whether `stages`, one after the other, and `parallel_stages`, alongside each other so only the longest counts,
+// are expected to finish within the remaining budget.
+// Otherwise, or when the sleep is already at `fallback` or below, it goes down to `fallback` and returns false.
+bool sleep_deadline_allows(int fallback, std::initializer_list<int> stages, std::initializer_list<int> parallel_stages = {});
+
+// Go down to `level` whatever the budget, when the current level has nothing to show
+void sleep_deadline_degrade(int level, const char* reason);
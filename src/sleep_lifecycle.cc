@@ -0,0 +1,115 @@
+#include "sleep_lifecycle.h"
+#include <NickelHook.h>
+
+// A prepared frame whose sleep view never came is dropped after this long,
+// so a sleep Nickel gave up on doesn't turn every later request into a duplicate
+constexpr qint64 PREPARED_TIMEOUT_MS = 10000;
+
+static const char* STATE_NAMES[] = {"awake", "preparing", "prepared", "shown"};
+
+static int state = SLEEP_STATE::Awake;
+static quint64 generation = 0;
+static qint64 prepared_at = -1;
+// The sleep view of the last frame was hidden, a sleep view still named current is from before the wake
+static bool is_view_hidden = false;
+
+bool is_sleep_view(const QString &view_name) {
+    return view_name.contains(QStringLiteral("DragonPowerView"));
+}
+
+quint64 sleep_lifecycle_request(const QString &view_name, qint64 now_ms) {
+    switch (state) {
+    case SLEEP_STATE::Preparing:
+        // Re-entered while the frame is being made
+        nh_log("Sleep requested again while generation %llu is being prepared", generation);
+        return 0;
+
+    case SLEEP_STATE::Prepared:
+        if (now_ms - prepared_at < PREPARED_TIMEOUT_MS) {
+            return 0;
+        }
+        nh_log("Generation %llu was never shown", generation);
+        break;
+
+    case SLEEP_STATE::Shown:
+        if (is_sleep_view(view_name)) {
+            return 0;
+        }
+        // Woken up since, it's a new sleep
+        break;
+
+    default:
+        // Nickel's own sleep view, like when the mod was skipped
+        if (is_sleep_view(view_name) && !is_view_hidden) {
+            return 0;
+        }
+        break;
+    }
+
+    state = SLEEP_STATE::Preparing;
+    is_view_hidden = false;
+    return ++generation;
+}
+
+quint64 sleep_lifecycle_power_off() {
+    if (state == SLEEP_STATE::Preparing) {
+        nh_log("Power off request ignored, generation %llu is being prepared", generation);
+        return 0;
+    }
+
+    // The power off view replaces the sleep view, and the frame of a sleep that wasn't shown yet
+    state = SLEEP_STATE::Preparing;
+    is_view_hidden = false;
+    return ++generation;
+}
+
+bool sleep_lifecycle_prepared(quint64 prepared_generation, qint64 now_ms) {
+    if (prepared_generation != generation || state != SLEEP_STATE::Preparing) {
+        nh_log("Frame of generation %llu is stale (generation %llu, %s)", prepared_generation, generation, STATE_NAMES[state]);
+        return false;
+    }
+
+    state = SLEEP_STATE::Prepared;
+    prepared_at = now_ms;
+    return true;
+}
+
+quint64 sleep_lifecycle_shown(const QString &view_name) {
+    if (state != SLEEP_STATE::Prepared) {
+        return 0;
+    }
+
+    // Unlocked right away, the frame would land on the wrong view
+    // https://github.com/redphx/nickel-screensaver/issues/12
+    if (!is_sleep_view(view_name)) {
+        state = SLEEP_STATE::Awake;
+        return 0;
+    }
+
+    state = SLEEP_STATE::Shown;
+    return generation;
+}
+
+void sleep_lifecycle_woke() {
+    // A frame being prepared finishes its own sleep
+    if (state != SLEEP_STATE::Preparing) {
+        state = SLEEP_STATE::Awake;
+    }
+    is_view_hidden = false;
+}
+
+void sleep_lifecycle_hidden() {
+    // Only the view of the frame shown, a newer frame is waiting for a view of its own
+    if (state == SLEEP_STATE::Shown) {
+        state = SLEEP_STATE::Awake;
+        is_view_hidden = true;
+    }
+}
+
+int sleep_lifecycle_state() {
+    return state;
+}
+
+quint64 sleep_lifecycle_generation() {
+    return generation;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <QString>
+
+// Lifecycle of a sleep across the Nickel hooks, which can be called more than once per sleep and re-entered.
+// Every sleep gets a new generation. Its frame is prepared at most once and only handed off to the
+// sleep view of that same generation, so duplicate calls cost nothing and stale frames are never shown.
+
+enum SLEEP_STATE {
+    Awake     = 0,
+    Preparing = 1,  // before_handle() is making the frame of the current generation
+    Prepared  = 2,  // the frame is ready, waiting for the sleep view
+    Shown     = 3,  // the sleep view is shown, with the frame handed off
+};
+
+// Nickel was asked to sleep while `view_name` is the current view, at `now_ms` (monotonic).
+// Returns the generation whose frame must be prepared now, or 0 when this request belongs to the current sleep.
+quint64 sleep_lifecycle_request(const QString &view_name, qint64 now_ms);
+
+// Nickel was asked to power off. Returns the generation whose frame must be prepared now, or 0 when a frame is
+// being prepared already. A power off always gets its own frame, even when the view of a sleep is shown.
+quint64 sleep_lifecycle_power_off();
+
+// The frame of `generation` is ready, or there's nothing to show.
+// Returns false when it was superseded by a newer sleep, then it must be dropped.
+bool sleep_lifecycle_prepared(quint64 generation, qint64 now_ms);
+
+// Nickel shows `view_name` as the sleep view. Returns the generation whose frame must be handed off now,
+// or 0 when it was handed off already or the device was woken up before the view was shown.
+quint64 sleep_lifecycle_shown(const QString &view_name);
+
+// The current view isn't the sleep view anymore
+void sleep_lifecycle_woke();
+
+// The sleep view the frame was handed off to was hidden. The device is awake, unless a newer sleep started.
+void sleep_lifecycle_hidden();
+
+int sleep_lifecycle_state();
+quint64 sleep_lifecycle_generation();
+
+// Whether `view_name` is one of Nickel's sleep and power off views
+bool is_sleep_view(const QString &view_name);
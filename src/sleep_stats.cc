@@ -0,0 +1,264 @@
+#include "sleep_stats.h"
+#include "display_mode.h"
+#include "onboard.h"
+#include "sleep_deadline.h"
+#include <NickelHook.h>
+
+#include <QMutex>
+#include <QSaveFile>
+#include <QStringList>
+#include <QTextStream>
+
+#include <algorithm>
+#include <vector>
+
+constexpr const char* STATS_PATH = NICKEL_SCREENSAVER_ONBOARD "/.adds/screensaver/_stats";
+
+// Number of sleeps kept in memory
+constexpr int STATS_CAPACITY = 64;
+// Number of new sleeps before the stats file is written again
+constexpr int STATS_WRITE_INTERVAL = 8;
+
+static const char* STAGE_NAMES[SLEEP_STAGE::StageCount] = {
+    "migration",
+    "settings",
+    "selection",
+    "decode",
+    "screenshot",
+    "glitch",
+    "composite",
+    "handoff",
+    "paint",
+};
+
+// Stage times expected before any sleep was measured, in ns
+static const qint64 INITIAL_ESTIMATES[SLEEP_STAGE::StageCount] = {
+    10000000,   // migration
+    10000000,   // settings
+    20000000,   // selection
+    400000000,  // decode
+    100000000,  // screenshot
+    200000000,  // glitch
+    150000000,  // composite
+    50000000,   // handoff
+    50000000,   // paint
+};
+
+// Weight of the last sleep in the estimates, as a fraction 1 / n
+constexpr int ESTIMATE_WEIGHT = 4;
+// Estimates of skipped stages shrink by 1 / n every sleep, so a budget exceeded once doesn't skip them forever
+constexpr int ESTIMATE_DECAY = 8;
+
+static qint64 estimates[SLEEP_STAGE::StageCount];
+static bool has_estimates = false;
+
+static bool stats_enabled = false;
+// Stages are timed when the stats or the sleep budget need them
+static bool timing_enabled = false;
+static bool is_timing = false;
+static bool is_recording = false;
+// Stage times of the current sleep, the rest only when recording
+static SleepSample current_sample;
+// Decoding runs on worker threads too
+static QMutex sample_mutex;
+
+// Ring buffer of the most recent sleeps
+static SleepSample samples[STATS_CAPACITY];
+static int next_sample = 0;
+static int sample_count = 0;
+static int unwritten_count = 0;
+// The last sample is from the current sleep
+static bool has_committed = false;
+
+void sleep_stats_configure(bool enabled, bool needs_estimates) {
+    stats_enabled = enabled;
+    timing_enabled = enabled || needs_estimates;
+    if (!enabled) {
+        is_recording = false;
+    }
+}
+
+void sleep_stats_begin() {
+    has_committed = false;
+    is_recording = stats_enabled;
+
+    QMutexLocker locker(&sample_mutex);
+    is_timing = timing_enabled;
+    if (!is_timing) {
+        return;
+    }
+
+    current_sample = SleepSample();
+    std::fill(current_sample.stage_ns, current_sample.stage_ns + SLEEP_STAGE::StageCount, -1);
+    current_sample.display_mode = DISPLAY_MODE::None;
+    current_sample.level = SLEEP_LEVEL::Full;
+    current_sample.frame_peak = 0;
+    current_sample.fs_reads = 0;
+    current_sample.fs_writes = 0;
+}
+
+SleepSample* sleep_stats_current() {
+    return is_recording ? &current_sample : nullptr;
+}
+
+bool sleep_stats_timing() {
+    return is_timing;
+}
+
+void sleep_stats_add(int stage, qint64 ns) {
+    QMutexLocker locker(&sample_mutex);
+    if (is_timing) {
+        qint64 &stage_ns = current_sample.stage_ns[stage];
+        stage_ns = qMax(stage_ns, (qint64)0) + ns;
+    }
+}
+
+qint64 sleep_stats_estimate(int stage) {
+    QMutexLocker locker(&sample_mutex);
+    return has_estimates ? estimates[stage] : INITIAL_ESTIMATES[stage];
+}
+
+static void update_estimates() {
+    QMutexLocker locker(&sample_mutex);
+    if (!is_timing) {
+        return;
+    }
+
+    if (!has_estimates) {
+        std::copy(INITIAL_ESTIMATES, INITIAL_ESTIMATES + SLEEP_STAGE::StageCount, estimates);
+        has_estimates = true;
+    }
+    for (int stage = 0; stage < SLEEP_STAGE::StageCount; ++stage) {
+        qint64 ns = current_sample.stage_ns[stage];
+        if (ns >= 0) {
+            estimates[stage] += (ns - estimates[stage]) / ESTIMATE_WEIGHT;
+        } else {
+            estimates[stage] -= estimates[stage] / ESTIMATE_DECAY;
+        }
+    }
+    is_timing = false;
+}
+
+void sleep_stats_count_fs(int reads, int writes) {
+    if (!is_recording) {
+        return;
+    }
+
+    QMutexLocker locker(&sample_mutex);
+    current_sample.fs_reads += reads;
+    current_sample.fs_writes += writes;
+}
+
+void sleep_stats_commit() {
+    update_estimates();
+    if (!is_recording) {
+        return;
+    }
+
+    samples[next_sample] = current_sample;
+    next_sample = (next_sample + 1) % STATS_CAPACITY;
+    sample_count = qMin(sample_count + 1, STATS_CAPACITY);
+    unwritten_count++;
+    is_recording = false;
+    has_committed = true;
+}
+
+void sleep_stats_add_committed(int stage, qint64 ns) {
+    if (!has_committed) {
+        return;
+    }
+
+    samples[(next_sample - 1 + STATS_CAPACITY) % STATS_CAPACITY].stage_ns[stage] = ns;
+}
+
+static QString mode_name(int display_mode) {
+    QStringList names;
+    if (display_mode & DISPLAY_MODE::Book) {
+        names << "book";
+    }
+    if (display_mode & DISPLAY_MODE::Wallpaper) {
+        names << "wallpaper";
+    }
+    if (display_mode & DISPLAY_MODE::Overlay) {
+        names << "overlay";
+    }
+
+    return names.isEmpty() ? QString("none") : names.join('+');
+}
+
+static QString size_name(QSize size) {
+    return size.isValid() ? QString("%1x%2").arg(size.width()).arg(size.height()) : QString("-");
+}
+
+static QString ms(qint64 ns) {
+    return QString::number(ns / 1e6, 'f', 1);
+}
+
+static qint64 sample_total(const SleepSample &sample) {
+    qint64 total = 0;
+    for (int stage = 0; stage < SLEEP_STAGE::StageCount; ++stage) {
+        total += qMax(sample.stage_ns[stage], (qint64)0);
+    }
+
+    return total;
+}
+
+static bool write_stats() {
+    QSaveFile file(STATS_PATH);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
+        return false;
+    }
+
+    QTextStream out(&file);
+    out << "# " << sample_count << " most recent sleeps, times in ms\n";
+    out << "stage count p50 p95 max\n";
+
+    for (int stage = 0; stage <= SLEEP_STAGE::StageCount; ++stage) {
+        std::vector<qint64> values;
+        for (int i = 0; i < sample_count; ++i) {
+            qint64 value = stage < SLEEP_STAGE::StageCount ? samples[i].stage_ns[stage] : sample_total(samples[i]);
+            if (value >= 0) {
+                values.push_back(value);
+            }
+        }
+
+        out << (stage < SLEEP_STAGE::StageCount ? STAGE_NAMES[stage] : "total") << ' ' << (int)values.size();
+        if (!values.empty()) {
+            std::sort(values.begin(), values.end());
+            out << ' ' << ms(values[(values.size() - 1) * 50 / 100])
+                << ' ' << ms(values[(values.size() - 1) * 95 / 100])
+                << ' ' << ms(values.back());
+        }
+        out << '\n';
+    }
+
+    // Oldest first
+    out << "\n# mode level frame wallpaper overlay peak_kb fs_reads fs_writes total\n";
+    for (int i = 0; i < sample_count; ++i) {
+        const SleepSample &sample = samples[(next_sample - sample_count + i + STATS_CAPACITY) % STATS_CAPACITY];
+        out << mode_name(sample.display_mode)
+            << ' ' << SLEEP_LEVEL_NAMES[sample.level]
+            << ' ' << size_name(sample.frame_size)
+            << ' ' << size_name(sample.wallpaper_size)
+            << ' ' << size_name(sample.overlay_size)
+            << ' ' << sample.frame_peak / 1024
+            << ' ' << sample.fs_reads
+            << ' ' << sample.fs_writes
+            << ' ' << ms(sample_total(sample)) << '\n';
+    }
+
+    out.flush();
+    return file.commit();
+}
+
+void sleep_stats_flush() {
+    if (unwritten_count < STATS_WRITE_INTERVAL) {
+        return;
+    }
+
+    if (write_stats()) {
+        unwritten_count = 0;
+    } else {
+        nh_log("Couldn't write %s", STATS_PATH);
+    }
+}
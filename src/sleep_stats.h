@@ -0,0 +1,77 @@
+#pragma once
+
+#include <QElapsedTimer>
+#include <QSize>
+
+enum SLEEP_STAGE {
+    Migration = 0,
+    Settings,
+    Selection,
+    Decode,
+    Screenshot,
+    Glitch,
+    Composite,
+    Handoff,
+    Paint,      // from the sleep view being shown to the end of the first paint of the frame
+    StageCount,
+};
+
+struct SleepSample {
+    qint64 stage_ns[SLEEP_STAGE::StageCount];  // -1 when the stage didn't run
+    int display_mode;
+    int level;          // SLEEP_LEVEL taken
+    QSize frame_size;
+    QSize wallpaper_size;
+    QSize overlay_size;
+    qint64 frame_peak;  // bytes held by frame buffers at the peak of the sleep
+    int fs_reads;       // stat, listing and read calls on the onboard partition
+    int fs_writes;      // create, write, rename and remove calls on the onboard partition
+};
+
+// Stages are timed when stats are `enabled`, or when the sleep budget `needs_estimates` of their time
+void sleep_stats_configure(bool enabled, bool needs_estimates);
+
+// Start recording a sleep, the previous one is dropped if it wasn't committed
+void sleep_stats_begin();
+
+// Sample being recorded, nullptr when stats are disabled
+SleepSample* sleep_stats_current();
+
+// Whether the stages of the current sleep are timed
+bool sleep_stats_timing();
+
+// Only added while the stages are timed, the sample only records them when stats are enabled
+void sleep_stats_add(int stage, qint64 ns);
+
+// Time a stage is expected to take, from the previous sleeps
+qint64 sleep_stats_estimate(int stage);
+
+// Count filesystem calls made on the onboard partition while going to sleep, a steady state sleep writes nothing
+void sleep_stats_count_fs(int reads, int writes = 0);
+void sleep_stats_commit();
+
+// Time of a stage that ends after the sleep was committed, added to that sleep when it was recorded
+void sleep_stats_add_committed(int stage, qint64 ns);
+
+// Write the stats file once enough sleeps were recorded, call it outside of the sleep path
+void sleep_stats_flush();
+
+// Adds the time until it goes out of scope to a stage, when the stages of the current sleep are timed
+class SleepStageTimer {
+public:
+    explicit SleepStageTimer(int stage) : stage(stage) {
+        if (sleep_stats_timing()) {
+            timer.start();
+        }
+    }
+
+    ~SleepStageTimer() {
+        if (timer.isValid()) {
+            sleep_stats_add(stage, timer.nsecsElapsed());
+        }
+    }
+
+private:
+    int stage;
+    QElapsedTimer timer;
+};
@@ -0,0 +1,103 @@
+#include "worker_pool.h"
+
+#include <QRunnable>
+#include <QThread>
+#include <QThreadPool>
+
+// Decoding the wallpaper and the overlay at the same time doesn't need more
+constexpr int MAX_THREADS = 2;
+
+enum JOB_STATE {
+    Queued    = 0,
+    Running   = 1,
+    Finished  = 2,
+    Cancelled = 3,
+};
+
+bool WorkerJob::claim() {
+    return state.testAndSetOrdered(JOB_STATE::Queued, JOB_STATE::Running);
+}
+
+void WorkerJob::run_claimed() {
+    task();
+    // What the task captured is released on the thread that ran it
+    task = nullptr;
+
+    QMutexLocker locker(&mutex);
+    state.storeRelease(JOB_STATE::Finished);
+    finished.wakeAll();
+}
+
+void WorkerJob::finish() {
+    if (claim()) {
+        run_claimed();
+        return;
+    }
+
+    QMutexLocker locker(&mutex);
+    while (state.loadAcquire() == JOB_STATE::Running) {
+        finished.wait(&mutex);
+    }
+}
+
+void WorkerJob::cancel() {
+    state.testAndSetOrdered(JOB_STATE::Queued, JOB_STATE::Cancelled);
+}
+
+bool WorkerJob::is_done() const {
+    int current = state.loadAcquire();
+    return current == JOB_STATE::Finished || current == JOB_STATE::Cancelled;
+}
+
+class WorkerTask : public QRunnable {
+public:
+    explicit WorkerTask(const QSharedPointer<WorkerJob> &job) : job(job) {}
+
+    void run() override {
+        if (job->claim()) {
+            job->run_claimed();
+        }
+    }
+
+private:
+    QSharedPointer<WorkerJob> job;
+};
+
+static QThreadPool* pool = nullptr;
+static int thread_count = -1;
+
+static QThreadPool* worker_pool() {
+    if (!pool) {
+        pool = new QThreadPool();
+        if (thread_count < 0) {
+            thread_count = qBound(1, QThread::idealThreadCount(), MAX_THREADS);
+        }
+        pool->setMaxThreadCount(qMax(1, thread_count));
+    }
+
+    return pool;
+}
+
+void worker_pool_configure(int count) {
+    thread_count = qBound(0, count, MAX_THREADS);
+    if (pool) {
+        pool->waitForDone();
+        pool->setMaxThreadCount(qMax(1, thread_count));
+    }
+}
+
+int worker_pool_threads() {
+    worker_pool();
+    return thread_count;
+}
+
+QSharedPointer<WorkerJob> worker_pool_start(const std::function<void()> &task) {
+    QSharedPointer<WorkerJob> job(new WorkerJob(task));
+    if (worker_pool_threads() == 0) {
+        job->finish();
+        return job;
+    }
+
+    worker_pool()->start(new WorkerTask(job));
+    return job;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <QAtomicInt>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QWaitCondition>
+
+#include <functional>
+
+// Worker threads for the steps of the sleep pipeline that don't need the GUI thread.
+// A dedicated pool, so waiting for it never waits for Nickel's own tasks.
+
+// A task that runs once, on a worker thread or on the first thread that needs it finished.
+// A job that is cancelled or dropped before a worker took it never runs, one already running finishes
+// on its own and nothing waits for it.
+class WorkerJob {
+public:
+    explicit WorkerJob(const std::function<void()> &task) : task(task) {}
+
+    // Run it on the calling thread unless a worker took it, then wait for that worker only
+    void finish();
+
+    // Skip it if no thread took it yet
+    void cancel();
+
+    // Finished or cancelled
+    bool is_done() const;
+
+    // Take the job, returns false when another thread took it or it was cancelled
+    bool claim();
+    // Run a claimed job
+    void run_claimed();
+
+private:
+    std::function<void()> task;
+    QAtomicInt state;
+    QMutex mutex;
+    QWaitCondition finished;
+};
+
+// 0 runs every task right away on the calling thread
+void worker_pool_configure(int thread_count);
+int worker_pool_threads();
+
+// Queue `task` on the worker threads
+QSharedPointer<WorkerJob> worker_pool_start(const std::function<void()> &task);
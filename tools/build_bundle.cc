@@ -0,0 +1,236 @@
+#include "bundle.h"
+#include "compositor.h"
+#include "decoder.h"
+
+#include <QCommandLineParser>
+#include <QCryptographicHash>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QGuiApplication>
+#include <QSaveFile>
+#include <QVector>
+
+#include <cstdio>
+#include <cstring>
+#include <zlib.h>
+
+// Packs the files of a screensaver folder, scaled to one screen size, into the bundle the mod maps at sleep.
+// The bundle is written at the root of the folder, then read back through the mod's own reader and checked.
+
+// Same folders and filters as pick_plan()
+struct Folder {
+    const char* path;
+    const char* filters;
+    bool has_overlays;  // PNG files are overlays
+};
+
+static const Folder FOLDERS[] = {
+    {"", "*.png *.jpg", true},
+    {"wallpaper", "*.png *.jpg cover", false},
+    {"wallpaper/overlay", "*.png", true},
+};
+
+// Host memory isn't the limit here
+constexpr qint64 DECODE_BUDGET = 1024 * 1024 * 1024;
+
+struct Item {
+    QString name;        // relative to the screensaver folder
+    double decode_ms;
+    qint64 stored_size;
+    QByteArray checksum; // of the pixels and the extra data
+};
+
+static qint64 aligned(qint64 offset) {
+    return (offset + BUNDLE_ALIGNMENT - 1) / BUNDLE_ALIGNMENT * BUNDLE_ALIGNMENT;
+}
+
+static bool parse_size(const QString &text, QSize &size) {
+    QStringList parts = text.split('x');
+    bool is_width_ok = false, is_height_ok = false;
+    if (parts.size() == 2) {
+        size = QSize(parts[0].toInt(&is_width_ok), parts[1].toInt(&is_height_ok));
+    }
+
+    return is_width_ok && is_height_ok && size.width() > 0 && size.height() > 0 && size.width() <= 0xffff;
+}
+
+static bool write_padding(QSaveFile &file, qint64 offset) {
+    QByteArray padding(aligned(offset) - offset, '\0');
+    return file.write(padding) == padding.size();
+}
+
+int main(int argc, char** argv) {
+    QGuiApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Build the screensaver bundle of a folder laid out like .adds/screensaver");
+    parser.addHelpOption();
+    parser.addOption(QCommandLineOption("screen", "Screen size of the device, like 1264x1680.", "size"));
+    parser.addOption(QCommandLineOption("compress", "Deflate the entries, smaller but inflated at every sleep."));
+    parser.addPositionalArgument("folder", "Screensaver folder, the bundle is written at its root.");
+    parser.process(app);
+
+    QSize screen_size;
+    if (parser.positionalArguments().size() != 1 || !parse_size(parser.value("screen"), screen_size)) {
+        parser.showHelp(1);
+    }
+
+    bool is_compressed = parser.isSet("compress");
+    QString root = QDir::cleanPath(parser.positionalArguments().first());
+    decoder_configure(DECODE_BUDGET);
+
+    // Every file the mod could pick, entries are written in this order
+    QStringList names;
+    QList<bool> are_overlays;
+    for (const Folder &folder : FOLDERS) {
+        QString prefix = strlen(folder.path) > 0 ? QString(folder.path) + '/' : QString();
+        QStringList filters = QString(folder.filters).split(' ');
+        for (const QString &file : QDir(root + '/' + folder.path).entryList(filters, QDir::Files)) {
+            names.append(prefix + file);
+            are_overlays.append(folder.has_overlays && file.endsWith(".png", Qt::CaseInsensitive));
+        }
+    }
+    if (names.isEmpty()) {
+        fprintf(stderr, "No screensaver files in %s\n", qPrintable(root));
+        return 1;
+    }
+
+    QString bundle_path = root + '/' + BUNDLE_FILE_NAME;
+    QSaveFile file(bundle_path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        fprintf(stderr, "Couldn't write %s\n", qPrintable(bundle_path));
+        return 1;
+    }
+
+    BundleHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = BUNDLE_MAGIC;
+    header.screen_width = screen_size.width();
+    header.screen_height = screen_size.height();
+
+    QByteArray name_data;
+    QVector<BundleEntry> entries;
+    for (const QString &name : names) {
+        BundleEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        QByteArray utf8 = name.toUtf8();
+        entry.name_offset = name_data.size();
+        entry.name_size = utf8.size();
+        name_data += utf8;
+        entries.append(entry);
+    }
+    header.entry_count = entries.size();
+    header.names_offset = sizeof(BundleHeader) + entries.size() * sizeof(BundleEntry);
+    header.names_size = name_data.size();
+
+    // Entries are written again once their data is known
+    bool is_ok = file.write(reinterpret_cast<const char*>(&header), sizeof(header)) == (qint64)sizeof(header)
+        && file.write(reinterpret_cast<const char*>(entries.constData()), entries.size() * sizeof(BundleEntry)) == (qint64)(entries.size() * sizeof(BundleEntry))
+        && file.write(name_data) == name_data.size()
+        && write_padding(file, file.pos());
+
+    // Skipped files leave their slot and their name unused
+    QVector<BundleEntry> written;
+    QList<Item> items;
+    for (int i = 0; i < names.size() && is_ok; ++i) {
+        Item item = {names[i], 0, 0, QByteArray()};
+        BundleEntry &entry = entries[i];
+        entry.format = QImage::Format_Invalid;
+
+        QElapsedTimer timer;
+        timer.start();
+        QImage image;
+        QByteArray extra;
+        // Scaled like the mod does it, overlays premultiplied with their spans
+        if (!names[i].endsWith("/cover")) {
+            image = decode_scaled(root + '/' + names[i], screen_size);
+            if (image.isNull()) {
+                fprintf(stderr, "Skipped %s, it can't be decoded\n", qPrintable(names[i]));
+                continue;
+            }
+            if (are_overlays[i]) {
+                image = image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+                QVector<OverlaySpan> rows = overlay_spans(image);
+                extra = QByteArray(reinterpret_cast<const char*>(rows.constData()), rows.size() * (int)sizeof(OverlaySpan));
+            }
+        }
+        item.decode_ms = timer.nsecsElapsed() / 1e6;
+
+        if (!image.isNull()) {
+            QByteArray raw(reinterpret_cast<const char*>(image.constBits()), image.byteCount());
+            raw += extra;
+            item.checksum = QCryptographicHash::hash(raw, QCryptographicHash::Md5);
+
+            entry.format = image.format();
+            entry.width = image.width();
+            entry.height = image.height();
+            entry.bytes_per_line = image.bytesPerLine();
+            entry.extra_size = extra.size();
+            entry.compression = BUNDLE_COMPRESSION::Stored;
+
+            QByteArray data = raw;
+            if (is_compressed) {
+                uLongf deflated_size = compressBound(raw.size());
+                QByteArray deflated(deflated_size, Qt::Uninitialized);
+                if (compress2(reinterpret_cast<Bytef*>(deflated.data()), &deflated_size,
+                        reinterpret_cast<const Bytef*>(raw.constData()), raw.size(), Z_BEST_COMPRESSION) == Z_OK
+                        && deflated_size < (uLongf)raw.size()) {
+                    deflated.resize(deflated_size);
+                    data = deflated;
+                    entry.compression = BUNDLE_COMPRESSION::Deflate;
+                }
+            }
+
+            entry.data_offset = file.pos();
+            entry.data_size = data.size();
+            is_ok = file.write(data) == data.size() && write_padding(file, file.pos());
+            item.stored_size = data.size();
+        }
+
+        written.append(entry);
+        items.append(item);
+    }
+    header.entry_count = written.size();
+
+    is_ok = is_ok && file.seek(0)
+        && file.write(reinterpret_cast<const char*>(&header), sizeof(header)) == (qint64)sizeof(header)
+        && file.write(reinterpret_cast<const char*>(written.constData()), written.size() * sizeof(BundleEntry)) == (qint64)(written.size() * sizeof(BundleEntry));
+    if (!is_ok || !file.commit()) {
+        fprintf(stderr, "Couldn't write %s\n", qPrintable(bundle_path));
+        return 1;
+    }
+
+    // Read it back like the mod does
+    if (!bundle_open(root, screen_size)) {
+        fprintf(stderr, "FAIL: %s can't be opened\n", qPrintable(bundle_path));
+        return 1;
+    }
+
+    printf("%s, %dx%d, %s\n\n", qPrintable(bundle_path), screen_size.width(), screen_size.height(), is_compressed ? "deflated" : "stored");
+    printf("%-40s %10s %10s %10s\n", "file", "decode ms", "stored KB", "load ms");
+
+    qint64 total_size = 0;
+    for (const Item &item : items) {
+        QElapsedTimer timer;
+        timer.start();
+        QByteArray extra;
+        QImage image = bundle_image(root + '/' + item.name, &extra);
+        QByteArray checksum;
+        if (!image.isNull()) {
+            // Touch every page, mapping alone doesn't read anything
+            QByteArray raw(reinterpret_cast<const char*>(image.constBits()), image.byteCount());
+            checksum = QCryptographicHash::hash(raw + extra, QCryptographicHash::Md5);
+        }
+        double load_ms = timer.nsecsElapsed() / 1e6;
+
+        printf("%-40s %10.1f %10lld %10.1f\n", qPrintable(item.name), item.decode_ms, item.stored_size / 1024, load_ms);
+        if (checksum != item.checksum) {
+            printf("FAIL: %s doesn't read back as written\n", qPrintable(item.name));
+            is_ok = false;
+        }
+        total_size += item.stored_size;
+    }
+    printf("\n%d files, %lld KB\n", items.size(), total_size / 1024);
+
+    return is_ok ? 0 : 1;
+}